@@ -1,5 +1,7 @@
 #include "address.h"
+#include "dns.h"
 #include "log.h"
+#include "offload.h"
 #include <sstream>
 #include <netdb.h>
 #include <ifaddrs.h>
@@ -102,8 +104,41 @@ namespace bin {
         if(node.empty()){
             node = host;
         }
-        //4.调用API获取域名上的网络通信地址
-        int error = getaddrinfo(node.c_str(), service, &hints, &results); //libfunc:
+        //4.数字形式的IP不用查询，getaddrinfo不会阻塞，直接调用
+        bool numeric_service = !service || (*service && strspn(service, "0123456789") == strlen(service));
+        in6_addr buf;
+        bool numeric_host = inet_pton(AF_INET, node.c_str(), &buf) == 1
+                || inet_pton(AF_INET6, node.c_str(), &buf) == 1;
+        //5.域名交给协程化的DNS解析器，服务名要查/etc/services，和解析器不可用时一样退回getaddrinfo
+        if(!numeric_host && numeric_service
+                && (family == AF_INET || family == AF_INET6 || family == AF_UNSPEC)){
+            std::vector<IPAddress::ptr> addrs;
+            Resolver::Status status = ResolverMgr::GetInstance()->resolve(node, family, addrs);
+            if(status != Resolver::UNAVAILABLE){
+                if(status != Resolver::OK){
+                    BIN_LOG_DEBUG(g_logger) << "Address::Lookup resolve(" << host << ", "
+                        << family << ") status=" << Resolver::StatusToString(status);
+                    return false;
+                }
+                uint16_t port = service ? (uint16_t)atoi(service) : 0;
+                for(auto& i : addrs){
+                    i->setPort(port);
+                    result.push_back(i);
+                }
+                return !result.empty();
+            }
+        }
+
+        //6.调用API获取域名上的网络通信地址，getaddrinfo会阻塞，放到阻塞线程池
+        int error;
+        if(numeric_host && numeric_service){
+            hints.ai_flags = AI_NUMERICHOST | AI_NUMERICSERV;
+            error = getaddrinfo(node.c_str(), service, &hints, &results); //libfunc:
+        }else{
+            error = bin::offload([&](){
+                return getaddrinfo(node.c_str(), service, &hints, &results); //libfunc:
+            });
+        }
         if(error){
             BIN_LOG_DEBUG(g_logger) << "Address::Lookup getaddress(" << host << ", "
                 << family << ", " << type << ") err=" << error << " errstr="
@@ -111,7 +146,7 @@ namespace bin {
             return false;
         }
 
-        //5.获取到的所有网络通信地址是一个链表的形式 依次访问构建对应的地址类对象
+        //7.获取到的所有网络通信地址是一个链表的形式 依次访问构建对应的地址类对象
         next = results;
         while(next){
             result.push_back(Create(next->ai_addr,(socklen_t)next->ai_addrlen));
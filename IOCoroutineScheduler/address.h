@@ -39,6 +39,7 @@ namespace bin {
          * @param[out] result 保存满足条件的Address       
         **/
         //通过host地址返回对应条件的所有Address，返回是否转换成功，失败返回UnknownAddress
+        //域名由Resolver解析(见dns.h)，每个IP只返回一个地址，不按type/protocol展开
         static bool Lookup(std::vector<Address::ptr>& result, const std::string& host, int family = AF_INET, int type = 0, int protocol = 0);
         //通过host地址返回对应条件的任意Address，返回满足条件的任意Address,失败返回nullptr
         static Address::ptr LookupAny(const std::string& host, int family = AF_INET, int type = 0, int protocol = 0);
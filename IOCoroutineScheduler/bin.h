@@ -12,12 +12,15 @@
 
 #include "config.h"
 #include "coroutine.h"
+#include "dns.h"
 #include "iomanager.h"
 #include "log.h"
 #include "macro.h"
+#include "offload.h"
 #include "print.h"
 #include "scheduler.h"
 #include "singleton.h"
+#include "task.h"
 #include "thread.h"
 #include "util.h"
 
@@ -8,12 +8,17 @@
  */
 
 #include <atomic>
+#include <errno.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
 
 #include "config.h"
 #include "coroutine.h"
 #include "log.h"
 #include "macro.h"
 #include "scheduler.h"
+#include "util.h"
 
 namespace bin {
 
@@ -25,53 +30,280 @@ static std::atomic<uint64_t> s_fiber_id{0};
 /// 全局静态变量，当前(所有)线程下存在协程的总数
 static std::atomic<uint64_t> s_fiber_count{0};
 
+/// 全局静态变量，共享栈协程私有缓冲区占用的总字节数
+static std::atomic<uint64_t> s_shared_saved_bytes{0};
+
 /// 线程局部变量，当前线程下正在运行协程
 static thread_local Fiber *t_fiber = nullptr;
 
 /// 线程局部变量当前线程的主协程，切换到这个协程,相当于切换到主线程中运行，一般上一次切出的协程，
 static thread_local Fiber::ptr t_threadFiber = nullptr;
 
+/// 累计新建/析构/从池中复用的协程数，不含线程主协程
+static std::atomic<uint64_t> s_fiber_created{0};
+static std::atomic<uint64_t> s_fiber_destroyed{0};
+static std::atomic<uint64_t> s_fiber_reused{0};
+
+/// 正在调度协程的栈上执行inline任务
+static thread_local bool t_inline_task = false;
+
 /// 配置项，每个协程的栈默认大小为1MB
 static ConfigVar<uint32_t>::ptr g_fiber_stack_size = Config::Lookup<uint32_t>(
     "fiber.stack_size", 128 * 1024, "fiber stack size");
 
-using StackAllocator = MallocStackAllocator;
+/// 配置项，每个线程栈池最多缓存的栈数量
+static ConfigVar<uint32_t>::ptr g_fiber_stack_pool_max_cached =
+    Config::Lookup<uint32_t>("fiber.stack_pool.max_cached", 64,
+                             "max cached fiber stacks per thread");
+
+/// 配置项，栈归还到池中时从栈顶算起保留的常驻内存大小
+static ConfigVar<uint32_t>::ptr g_fiber_stack_pool_high_water =
+    Config::Lookup<uint32_t>("fiber.stack_pool.high_water", 16 * 1024,
+                             "resident bytes kept at the top of a pooled stack");
+
+/// 配置项，每个线程的共享栈数量
+static ConfigVar<uint32_t>::ptr g_fiber_shared_stack_count =
+    Config::Lookup<uint32_t>("fiber.shared_stack.count", 4,
+                             "shared fiber stacks per thread");
+
+/// 配置项，每个共享栈的大小，只有实际使用的部分会被拷贝
+static ConfigVar<uint32_t>::ptr g_fiber_shared_stack_size =
+    Config::Lookup<uint32_t>("fiber.shared_stack.size", 1024 * 1024,
+                             "shared fiber stack size");
+
+/// 配置项，每个线程协程池最多缓存的协程数量
+static ConfigVar<uint32_t>::ptr g_fiber_pool_max_cached =
+    Config::Lookup<uint32_t>("fiber.pool.max_cached", 64,
+                             "max cached terminated fibers per thread");
+
+/// 配置项，全局协程池最多缓存的协程数量，线程池满了溢出到这里
+static ConfigVar<uint32_t>::ptr g_fiber_pool_global_max_cached =
+    Config::Lookup<uint32_t>("fiber.pool.global_max_cached", 1024,
+                             "max cached terminated fibers shared by threads");
+
+using StackAllocator = StackPoolAllocator;
+
+static size_t GetPageSize() {
+  static size_t s_page_size = sysconf(_SC_PAGESIZE);
+  return s_page_size;
+}
+
+static size_t AlignToPage(size_t size) {
+  size_t page = GetPageSize();
+  return (size + page - 1) & ~(page - 1);
+}
+
+// 高水位以下的页还给内核，缓存起来的栈只占用高水位以内的物理内存
+static void TrimStack(void *vp, size_t size) {
+  size_t high_water = AlignToPage(g_fiber_stack_pool_high_water->getValue());
+  if (size > high_water) {
+    madvise(vp, size - high_water, MADV_DONTNEED);
+  }
+}
+
+/// 线程的栈池是否已经析构，线程退出后才析构的协程直接munmap
+static thread_local bool t_stack_pool_destroyed = false;
+
+/**
+ * @brief 线程局部的空闲栈链表，线程退出时释放
+ */
+struct StackPool {
+  std::vector<std::pair<void *, size_t>> stacks; /// <栈低地址, 栈大小>
+
+  ~StackPool() {
+    for (auto &i : stacks) {
+      munmap((char *)i.first - GetPageSize(), i.second + GetPageSize());
+    }
+    stacks.clear();
+    t_stack_pool_destroyed = true;
+  }
+};
+
+static thread_local StackPool t_stack_pool;
+
+void *StackPoolAllocator::Alloc(size_t size) {
+  size = AlignToPage(size);
+  auto &stacks = t_stack_pool.stacks;
+  // 从尾部找，最近归还的栈高水位以内的页大概率还在cache里
+  for (auto it = stacks.rbegin(); it != stacks.rend(); ++it) {
+    if (it->second == size) {
+      void *vp = it->first;
+      stacks.erase(std::next(it).base());
+      return vp;
+    }
+  }
+  size_t page = GetPageSize();
+  void *mem = mmap(nullptr, size + page, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, -1, 0);
+  if (mem == MAP_FAILED) {
+    BIN_LOG_ERROR(g_logger) << "mmap fiber stack fail, size=" << size
+                            << " errno=" << errno << " " << strerror(errno);
+    throw std::bad_alloc();
+  }
+  // 栈向低地址增长，保护页放在最低处
+  if (mprotect(mem, page, PROT_NONE)) {
+    BIN_LOG_ERROR(g_logger) << "mprotect guard page fail, errno=" << errno
+                            << " " << strerror(errno);
+  }
+  return (char *)mem + page;
+}
+
+void StackPoolAllocator::Dealloc(void *vp, size_t size) {
+  if (!vp) {
+    return;
+  }
+  size = AlignToPage(size);
+  if (t_stack_pool_destroyed) {
+    munmap((char *)vp - GetPageSize(), size + GetPageSize());
+    return;
+  }
+  auto &stacks = t_stack_pool.stacks;
+  if (stacks.size() >= g_fiber_stack_pool_max_cached->getValue()) {
+    munmap((char *)vp - GetPageSize(), size + GetPageSize());
+    return;
+  }
+  TrimStack(vp, size);
+  stacks.push_back(std::make_pair(vp, size));
+}
+
+size_t StackPoolAllocator::GetCachedCount() {
+  return t_stack_pool_destroyed ? 0 : t_stack_pool.stacks.size();
+}
+
+/**
+ * @brief 共享执行栈，同一时刻只有occupant的栈内容在上面
+ */
+struct SharedStack {
+  void *stack = nullptr;     /// 栈的低地址
+  size_t size = 0;           /// 栈大小
+  Fiber *occupant = nullptr; /// 当前栈上内容所属的协程
+};
+
+/**
+ * @brief 线程局部的共享栈集合，第一次使用时按配置创建
+ */
+struct SharedStackPool {
+  std::vector<SharedStack *> stacks;
+  size_t next = 0; /// 轮转分配的位置
+
+  ~SharedStackPool() {
+    for (auto i : stacks) {
+      StackAllocator::Dealloc(i->stack, i->size);
+      delete i;
+    }
+    stacks.clear();
+  }
+};
+
+static thread_local SharedStackPool t_shared_stacks;
+
+/// 当前线程上开始运行了、还没有结束的共享栈协程数
+static thread_local size_t t_shared_live = 0;
+
+// 优先分配没有占用者的共享栈，都被占用时轮转，减少切换时的拷贝
+static SharedStack *AcquireSharedStack() {
+  auto &stacks = t_shared_stacks.stacks;
+  if (stacks.empty()) {
+    size_t count = std::max(1u, g_fiber_shared_stack_count->getValue());
+    size_t size = AlignToPage(g_fiber_shared_stack_size->getValue());
+    for (size_t i = 0; i < count; ++i) {
+      SharedStack *ss = new SharedStack;
+      ss->stack = StackAllocator::Alloc(size);
+      ss->size = size;
+      stacks.push_back(ss);
+    }
+  }
+  for (auto i : stacks) {
+    if (!i->occupant) {
+      return i;
+    }
+  }
+  return stacks[t_shared_stacks.next++ % stacks.size()];
+}
+
+/// 线程的协程池是否已经析构，之后回收的协程直接释放
+static thread_local bool t_fiber_pool_destroyed = false;
+
+/**
+ * @brief 线程局部的已结束协程，线程退出时释放
+ */
+struct FiberPool {
+  std::vector<Fiber::ptr> fibers;
+
+  ~FiberPool() {
+    fibers.clear();
+    t_fiber_pool_destroyed = true;
+  }
+};
+
+static thread_local FiberPool t_fiber_pool;
+
+/**
+ * @brief 全局协程池，线程池满了的协程放这里，其他线程池空了从这里取
+ * @details 进程退出时不释放，避免静态析构顺序问题
+ */
+struct GlobalFiberPool {
+  Mutex mutex;
+  std::vector<Fiber::ptr> fibers;
+};
+
+static GlobalFiberPool *GetGlobalFiberPool() {
+  static GlobalFiberPool *s_pool = new GlobalFiberPool;
+  return s_pool;
+}
+
+/// GetPoolStats()计算速率的上一个采样点
+static Mutex s_rate_mutex;
+static uint64_t s_rate_time = 0;
+static uint64_t s_rate_created = 0;
+static uint64_t s_rate_destroyed = 0;
 
 Fiber::Fiber() {
   BIN_LOG_DEBUG(g_logger) << "协程构造: main";
   m_state = EXEC;
   SetThis(this);
   ++s_fiber_count;
-  if (getcontext(&m_ctx)) {
-    BIN_ASSERT2(false, "getcontext");
-  }
+  m_ctx.init();
 }
 
-Fiber::Fiber(std::function<void()> cb, size_t stacksize, bool use_caller)
-    : m_id(++s_fiber_id), m_cb(cb) {
+Fiber::Fiber(Task cb, size_t stacksize, bool use_caller, bool shared_stack)
+    : m_id(++s_fiber_id), m_cb(std::move(cb)) {
   BIN_LOG_DEBUG(g_logger) << "协程构造: " << m_id;
   ++s_fiber_count;
+  ++s_fiber_created;
+  // 共享栈在第一次切入时才绑定，上下文也推迟到那时在共享栈上创建
+  if (shared_stack) {
+    m_shared = true;
+    m_useCaller = use_caller;
+    m_needMake = true;
+    return;
+  }
   // 为协程分配栈空间，让回调函数在对应栈空间去运行。未设置的时候 stacksize =
   // 128 * 1024
   m_stacksize = stacksize ? stacksize : g_fiber_stack_size->getValue();
   m_stack = StackAllocator::Alloc(m_stacksize);
-  if (getcontext(&m_ctx)) {
-    BIN_ASSERT2(false, "getcontext");
-  }
-  // 初始化上下文结构体的成员
-  m_ctx.uc_link = nullptr; // 后续程序上下文
-  m_ctx.uc_stack.ss_sp = m_stack;
-  m_ctx.uc_stack.ss_size = m_stacksize;
   // use_call 标识当前的协程是否是调度协程
   if (!use_caller) // false
-    makecontext(&m_ctx, &Fiber::MainFunc, 0);
+    m_ctx.make(m_stack, m_stacksize, &Fiber::MainFunc);
   else // true
-    makecontext(&m_ctx, &Fiber::CallerMainFunc, 0);
+    m_ctx.make(m_stack, m_stacksize, &Fiber::CallerMainFunc);
 }
 
 Fiber::~Fiber() {
   --s_fiber_count;
-  if (m_stack) { // 有栈，回收栈
+  if (m_id) {
+    ++s_fiber_destroyed;
+  }
+  if (m_shared) { // 共享栈，释放私有缓冲区
+    BIN_ASSERT(m_state == TERM || m_state == EXCEPT || m_state == INIT);
+    if (m_sharedStack && m_sharedStack->occupant == this) {
+      m_sharedStack->occupant = nullptr;
+    }
+    s_shared_saved_bytes -= m_saveCapacity;
+    free(m_saveBuffer);
+    BIN_LOG_DEBUG(g_logger)
+        << "协程析构: id/s_fiber_count = " << m_id << "/" << s_fiber_count;
+  } else if (m_stack) { // 有栈，回收栈
     // 只要不是运行态 或者 挂起就释放栈空间
     BIN_ASSERT(m_state == TERM || m_state == EXCEPT || m_state == INIT);
     // 释放栈空间
@@ -92,20 +324,69 @@ Fiber::~Fiber() {
 
 // 重置协程函数，并重置状态
 // INIT，TERM, EXCEPT
-void Fiber::reset(std::function<void()> cb) {
-  BIN_ASSERT(m_stack);
+void Fiber::reset(Task cb) {
+  BIN_ASSERT(m_stack || m_shared);
   BIN_ASSERT(m_state == TERM || m_state == EXCEPT || m_state == INIT);
-  m_cb = cb;
-  if (getcontext(&m_ctx)) {
-    BIN_ASSERT2(false, "getcontext");
-  }
-  m_ctx.uc_link = nullptr;
-  m_ctx.uc_stack.ss_sp = m_stack;
-  m_ctx.uc_stack.ss_size = m_stacksize;
-  makecontext(&m_ctx, &Fiber::MainFunc, 0);
+  m_cb = std::move(cb);
+  if (m_shared) {
+    // 共享栈上可能还是别的协程的内容，切入时再创建
+    m_useCaller = false;
+    m_needMake = true;
+  } else {
+    m_ctx.make(m_stack, m_stacksize, &Fiber::MainFunc);
+  }
   m_state = INIT;
 }
 
+void Fiber::switchInSharedStack() {
+  if (!m_sharedStack) {
+    m_sharedStack = AcquireSharedStack();
+    m_stackThread = bin::GetThreadId();
+  }
+  BIN_ASSERT2(m_stackThread == bin::GetThreadId(),
+              "shared stack fiber resumed on another thread");
+  SharedStack *ss = m_sharedStack;
+  Fiber *occupant = ss->occupant;
+  if (occupant != this) {
+    if (occupant) {
+      occupant->saveSharedStack();
+    }
+    ss->occupant = this;
+  }
+  if (m_needMake) {
+    ++t_shared_live;
+    m_ctx.make(ss->stack, ss->size,
+               m_useCaller ? &Fiber::CallerMainFunc : &Fiber::MainFunc);
+    m_needMake = false;
+  } else if (occupant != this && m_saveSize) {
+    memcpy((char *)ss->stack + ss->size - m_saveSize, m_saveBuffer, m_saveSize);
+  }
+}
+
+void Fiber::saveSharedStack() {
+  SharedStack *ss = m_sharedStack;
+  char *top = (char *)ss->stack + ss->size;
+  char *sp = (char *)m_ctx.getStackPointer();
+  if (!sp) {
+    sp = (char *)ss->stack;
+  }
+  BIN_ASSERT(sp >= (char *)ss->stack && sp <= top);
+  size_t used = top - sp;
+  // 按实际使用大小分配，挂起时栈明显变浅了也缩小缓冲区
+  if (used > m_saveCapacity || used < m_saveCapacity / 2) {
+    free(m_saveBuffer);
+    m_saveBuffer = (char *)malloc(used);
+    if (!m_saveBuffer) {
+      throw std::bad_alloc();
+    }
+    s_shared_saved_bytes += used;
+    s_shared_saved_bytes -= m_saveCapacity;
+    m_saveCapacity = used;
+  }
+  memcpy(m_saveBuffer, sp, used);
+  m_saveSize = used;
+}
+
 // //bin:看语雀，为了改bug，根据不同的切入选择不同的切出
 // void Fiber::swapOut(){
 //     //如果当前不在调度协程上执行代码 说明是从调度协程切过来的 要切回调度协程
@@ -128,20 +409,22 @@ void Fiber::reset(std::function<void()> cb) {
 // }
 
 ////将当前协程切换到运行状态
-// 核心函数：利用swapcontext(参数1,
+// 核心函数：利用FiberContext::Swap(参数1,
 // 参数2)，将目标代码段（参数2）推送到CPU上执行，将当前执行的代码段保存起来（保存到参数1
 // 母协程init-------------------->子协程
 void Fiber::swapIn() {
   // 将当前的子协程Fiber* 设置到 t_fiber 中，表明是这个协程正在运行
+  // 还在调度协程的栈上，共享栈的换出/恢复只能在这里做
+  if (m_shared) {
+    switchInSharedStack();
+  }
   SetThis(this);
   // 没在运行态才能调入运行
   BIN_ASSERT(m_state != EXEC);
   m_state = EXEC;
-  if (swapcontext(&Scheduler::GetMainFiber()->m_ctx, &m_ctx)) {
-    // if(swapcontext(&t_threadFiber->m_ctx, &m_ctx)){
-    // //test_coroutine时取消注释这里
-    BIN_ASSERT2(false, "swapcontext");
-  }
+  FiberContext::Swap(Scheduler::GetMainFiber()->m_ctx, m_ctx);
+  // FiberContext::Swap(t_threadFiber->m_ctx, m_ctx);
+  // //test_coroutine时取消注释这里
   // BIN_LOG_INFO(g_logger) << "Fiber " << m_id << " swapin end";
 }
 
@@ -149,37 +432,37 @@ void Fiber::swapIn() {
 // 子协程-------------------->母协程init
 void Fiber::swapOut() {
   SetThis(Scheduler::GetMainFiber());
-  if (swapcontext(&m_ctx, &Scheduler::GetMainFiber()->m_ctx)) {
-    // if(swapcontext(&m_ctx, &t_threadFiber->m_ctx)){
-    // //test_coroutine时取消注释这里
-    BIN_ASSERT2(false, "swapcontext");
-  }
+  FiberContext::Swap(m_ctx, Scheduler::GetMainFiber()->m_ctx);
+  // FiberContext::Swap(m_ctx, t_threadFiber->m_ctx);
+  // //test_coroutine时取消注释这里
 }
 
 // 从init协程 切换到 目标代码
 void Fiber::call() {
+  if (m_shared) {
+    switchInSharedStack();
+  }
   SetThis(this);
   m_state = EXEC;
-  if (swapcontext(&t_threadFiber->m_ctx, &m_ctx)) {
-    BIN_ASSERT2(false, "swapcontext");
-  }
+  FiberContext::Swap(t_threadFiber->m_ctx, m_ctx);
 }
 
 // 目标代码 切换到 从init协程
 void Fiber::back() {
   SetThis(t_threadFiber.get());
-  if (swapcontext(&m_ctx, &t_threadFiber->m_ctx)) {
-    BIN_ASSERT2(false, "swapcontext");
-  }
+  FiberContext::Swap(m_ctx, t_threadFiber->m_ctx);
 }
 
 // 设置当前协程
 void Fiber::SetThis(Fiber *f) { t_fiber = f; }
 
 // 返回当前协程，如果当前线程没有协程，会初始化一个主协程
-Fiber::ptr Fiber::GetThis() {
-  if (t_fiber) {
-    return t_fiber->shared_from_this();
+Fiber::ptr Fiber::GetThis() { return GetThisRaw()->shared_from_this(); }
+
+// 返回当前协程的裸指针，如果当前线程没有协程，会初始化一个主协程
+Fiber *Fiber::GetThisRaw() {
+  if (BIN_LIKELY(t_fiber != nullptr)) {
+    return t_fiber;
   }
   // 如果当前线程没有协程，会初始化一个主协程
   // 可以封装成一个函数Init()
@@ -187,12 +470,13 @@ Fiber::ptr Fiber::GetThis() {
   Fiber::ptr main_fiber(new Fiber); // 创建母协程init
   BIN_ASSERT(t_fiber == main_fiber.get());
   t_threadFiber = main_fiber; // 这句代码很关键
-  return t_fiber->shared_from_this();
+  return t_fiber;
 }
 
 // 协程切换到后台，并且设置为Ready状态
 void Fiber::YieldToReady() {
-  Fiber::ptr cur = GetThis();
+  BIN_ASSERT2(!t_inline_task, "inline task must not yield");
+  Fiber *cur = GetThisRaw();
   BIN_ASSERT(cur->m_state == EXEC);
   cur->m_state = READY;
   cur->swapOut();
@@ -200,16 +484,100 @@ void Fiber::YieldToReady() {
 
 // 协程切换到后台，并且设置为Hold状态
 void Fiber::YieldToHold() {
-  Fiber::ptr cur = GetThis();
+  BIN_ASSERT2(!t_inline_task, "inline task must not yield");
+  Fiber *cur = GetThisRaw();
   BIN_ASSERT(cur->m_state == EXEC);
   // 不debug协程类时注释下面这一句代码，交给Secheduler::idle()处理，不是停止就hold住
   // cur->m_state = HOLD;
   cur->swapOut();
 }
 
+Fiber::ptr Fiber::Create(Task cb, bool shared_stack) {
+  if (shared_stack) {
+    return Fiber::ptr(new Fiber(std::move(cb), 0, false, true));
+  }
+  uint32_t stacksize = g_fiber_stack_size->getValue();
+  Fiber::ptr fiber;
+  if (!t_fiber_pool_destroyed && !t_fiber_pool.fibers.empty()) {
+    fiber = std::move(t_fiber_pool.fibers.back());
+    t_fiber_pool.fibers.pop_back();
+  } else {
+    GlobalFiberPool *pool = GetGlobalFiberPool();
+    Mutex::Lock lock(pool->mutex);
+    if (!pool->fibers.empty()) {
+      fiber = std::move(pool->fibers.back());
+      pool->fibers.pop_back();
+    }
+  }
+  // 栈大小配置改过了，旧的协程不再复用
+  if (fiber && fiber->m_stacksize == stacksize) {
+    ++s_fiber_reused;
+    fiber->reset(std::move(cb));
+    return fiber;
+  }
+  fiber.reset(new Fiber(std::move(cb), stacksize));
+  fiber->m_pooled = true;
+  return fiber;
+}
+
+void Fiber::Recycle(Fiber::ptr &fiber) {
+  Fiber::ptr f(std::move(fiber));
+  if (!f || !f->m_pooled || f.use_count() != 1 ||
+      (f->m_state != TERM && f->m_state != EXCEPT)) {
+    return;
+  }
+  // 异常退出的协程还留着任务，先释放任务捕获的资源
+  f->m_cb = nullptr;
+  TrimStack(f->m_stack, f->m_stacksize);
+  if (!t_fiber_pool_destroyed &&
+      t_fiber_pool.fibers.size() < g_fiber_pool_max_cached->getValue()) {
+    t_fiber_pool.fibers.push_back(std::move(f));
+    return;
+  }
+  GlobalFiberPool *pool = GetGlobalFiberPool();
+  Mutex::Lock lock(pool->mutex);
+  if (pool->fibers.size() < g_fiber_pool_global_max_cached->getValue()) {
+    pool->fibers.push_back(std::move(f));
+  }
+  // 都满了，f在解锁之后析构
+}
+
+FiberPoolStats Fiber::GetPoolStats() {
+  FiberPoolStats stats;
+  stats.created = s_fiber_created;
+  stats.destroyed = s_fiber_destroyed;
+  stats.reused = s_fiber_reused;
+  stats.local_cached = t_fiber_pool_destroyed ? 0 : t_fiber_pool.fibers.size();
+  GlobalFiberPool *pool = GetGlobalFiberPool();
+  {
+    Mutex::Lock lock(pool->mutex);
+    stats.global_cached = pool->fibers.size();
+  }
+  Mutex::Lock lock(s_rate_mutex);
+  uint64_t now = bin::GetMonotonicMS();
+  uint64_t used = s_rate_time ? now - s_rate_time : 0;
+  if (used) {
+    stats.created_per_sec = (stats.created - s_rate_created) * 1000.0 / used;
+    stats.destroyed_per_sec =
+        (stats.destroyed - s_rate_destroyed) * 1000.0 / used;
+  }
+  s_rate_time = now;
+  s_rate_created = stats.created;
+  s_rate_destroyed = stats.destroyed;
+  return stats;
+}
+
 // 总协程数
 uint64_t Fiber::TotalFibers() { return s_fiber_count; }
 
+uint64_t Fiber::SharedStackSavedBytes() { return s_shared_saved_bytes; }
+
+size_t Fiber::SharedStackLiveCount() { return t_shared_live; }
+
+bool Fiber::InInlineTask() { return t_inline_task; }
+
+void Fiber::SetInlineTask(bool v) { t_inline_task = v; }
+
 uint64_t Fiber::GetFiberId() {
   if (t_fiber)
     return t_fiber->getId();
@@ -219,7 +587,8 @@ uint64_t Fiber::GetFiberId() {
 
 // usercall = false
 void Fiber::MainFunc() {
-  Fiber::ptr cur = GetThis();
+  // 切入本协程的一方(调度器或call()的调用者)持有它，这里不再加引用计数
+  Fiber *cur = GetThisRaw();
   BIN_ASSERT(cur);
   try {
     BIN_LOG_DEBUG(g_logger) << "Fier::MainFunc() : cb() begin";
@@ -241,9 +610,12 @@ void Fiber::MainFunc() {
   }
   // Coroutine和thread确实不同，thread会自己回来，coroutine要手动帮他设置好回来
   // 因为thread是操作系统帮忙调度，coroutine要自己控制
-  auto raw_ptr = cur.get(); // raw/normal pointer
-  // swapout切出了，不会切回来了，无法执行析构函数。让其减少一次该函数调用中应该减少的引用次数
-  cur.reset(); // 让其减少一次该函数调用中应该减少的引用次数
+  auto raw_ptr = cur;
+  // 执行完毕的协程不会再切回来，共享栈上的内容不必保存
+  if (raw_ptr->m_sharedStack) {
+    raw_ptr->m_sharedStack->occupant = nullptr;
+    --t_shared_live;
+  }
   raw_ptr->swapOut();
   // 不会再回到这个地方 回来了说明有问题
   BIN_ASSERT2(false,
@@ -252,7 +624,7 @@ void Fiber::MainFunc() {
 
 // usercall = true
 void Fiber::CallerMainFunc() {
-  Fiber::ptr cur = GetThis();
+  Fiber *cur = GetThisRaw();
   BIN_ASSERT(cur);
   try {
     BIN_LOG_DEBUG(g_logger) << "Fiber::CallerMainFunc() : cb() begin";
@@ -271,8 +643,11 @@ void Fiber::CallerMainFunc() {
                             << " fiber_id=" << cur->getId() << std::endl
                             << bin::BacktraceToString();
   }
-  auto raw_ptr = cur.get(); // raw/normal pointer
-  cur.reset(); // 让其减少一次该函数调用中应该减少的引用次数
+  auto raw_ptr = cur;
+  if (raw_ptr->m_sharedStack) {
+    raw_ptr->m_sharedStack->occupant = nullptr;
+    --t_shared_live;
+  }
   raw_ptr->back();
   // 不会再回到这个地方 回来了说明有问题
   BIN_ASSERT2(false,
@@ -18,6 +18,7 @@
 
 /*
  * 准备：依赖的库文件<ucontext.h>
+ * (现在默认使用fiber_context.h中的汇编切换，ucontext作为回退实现，接口语义一致)
  * ● 切换程序上下文API:
  * //依赖实现的结构体
  * typedef struct ucontext {
@@ -59,7 +60,11 @@
 
 #include <functional>
 #include <memory>
-#include <ucontext.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "fiber_context.h"
+#include "task.h"
 
 namespace bin {
 
@@ -88,10 +93,61 @@ public:
   }
 };
 
+/**
+ * @brief 协程栈池分配器
+ * @details 每个线程维护一个mmap栈的空闲链表，每个栈的低地址处有一个PROT_NONE的
+ *  保护页，栈溢出时直接段错误而不是踩坏别的内存。
+ *  ~Fiber时栈归还到当前线程的池中，超过fiber.stack_pool.max_cached才munmap；
+ *  归还时把高水位(fiber.stack_pool.high_water，从栈顶算起)以下的页
+ *  madvise(MADV_DONTNEED)还给内核，池中的栈只占用高水位以内的物理内存。
+ */
+class StackPoolAllocator {
+public:
+  /**
+   * @brief 从当前线程的栈池中取一个栈，没有就mmap一个新的
+   * @param size 栈大小，按页对齐
+   * @return 栈的低地址(保护页之上)
+   */
+  static void *Alloc(size_t size);
+
+  /**
+   * @brief 把栈归还到当前线程的栈池
+   * @param vp Alloc返回的栈指针
+   * @param size 栈大小，和Alloc时一致
+   */
+  static void Dealloc(void *vp, size_t size);
+
+  /**
+   * @brief 当前线程栈池中缓存的栈数量
+   */
+  static size_t GetCachedCount();
+};
+
 class Scheduler;
+struct SharedStack;
+
+/**
+ * @brief 协程池的计数，Fiber::GetPoolStats()返回
+ */
+struct FiberPoolStats {
+  uint64_t created = 0;        /// 累计新建的协程数(不含线程主协程)
+  uint64_t destroyed = 0;      /// 累计析构的协程数(不含线程主协程)
+  uint64_t reused = 0;         /// 累计从池中复用的次数
+  size_t local_cached = 0;     /// 当前线程池中的协程数
+  size_t global_cached = 0;    /// 全局池中的协程数
+  double created_per_sec = 0;  /// 距上次调用GetPoolStats()的新建速率
+  double destroyed_per_sec = 0; /// 距上次调用GetPoolStats()的析构速率
+};
 
 /**
  * @brief 协程类
+ * @details 共享栈模式(shared_stack=true)：协程不独占栈，而是运行在所在线程的
+ *  少数几个共享执行栈(fiber.shared_stack.count个，每个fiber.shared_stack.size大小)上。
+ *  另一个协程要使用同一个共享栈时，才把当前占用者已使用的那部分栈拷贝到它自己的
+ *  私有缓冲区(按实际使用大小分配)，切回时再拷贝回来。大量挂起在do_io上的连接
+ *  每个只占几KB，而不是一个完整的协程栈。
+ *  栈上变量的地址必须保持不变，所以共享栈协程第一次运行后就绑定在该线程上，
+ *  之后的调度都会被固定到这个线程。
  */
 class Fiber : public std::enable_shared_from_this<Fiber> {
   friend class Scheduler;
@@ -118,9 +174,10 @@ public:
    * @param cb 协程执行的函数
    * @param stacksize 协程栈大小
    * @param use_caller 是否在MainFiber上调度
+   * @param shared_stack 是否运行在线程的共享栈上，为true时忽略stacksize
    */
-  Fiber(std::function<void()> cb, size_t stacksize = 0,
-        bool use_caller = false);
+  Fiber(Task cb, size_t stacksize = 0,
+        bool use_caller = false, bool shared_stack = false);
   /**
    * @brief Destroy the Fiber object
    */
@@ -131,7 +188,7 @@ public:
    *  getState()=INIT。协程执行完了，但是分配的内存没释放，基于这段内存创建新的协程
    * @param cb callback function
    */
-  void reset(std::function<void()> cb);
+  void reset(Task cb);
 
   /**
    * @brief 将当前协程切换到运行状态，getState() = EXEC
@@ -163,6 +220,16 @@ public:
    */
   State getState() const { return m_state; }
 
+  /**
+   * @brief 是否运行在共享栈上
+   */
+  bool isSharedStack() const { return m_shared; }
+
+  /**
+   * @brief 共享栈协程绑定的线程id，独立栈协程或还未运行过时返回-1
+   */
+  int getSharedStackThread() const { return m_stackThread; }
+
 public:
   /**
    * @brief 设置当前线程的运行协程
@@ -176,6 +243,14 @@ public:
    */
   static Fiber::ptr GetThis();
 
+  /**
+   * @brief 返回当前所在协程的裸指针，不增加引用计数
+   * @details GetThis()每次都要shared_from_this()，对控制块做一次原子CAS，
+   *          再在析构时原子减一。切换路径上调用者自己或调度器已经持有协程，
+   *          只需要裸指针；要把协程保存起来(挂到事件、等待队列)时才用GetThis()
+   */
+  static Fiber *GetThisRaw();
+
   /**
    * @brief  将当前协程切换到后台,并设置为READY状态  getState() = READY
    */
@@ -192,12 +267,51 @@ public:
    */
   static uint64_t TotalFibers();
 
+  /**
+   * @brief 返回所有共享栈协程私有缓冲区占用的总字节数
+   */
+  static uint64_t SharedStackSavedBytes();
+
+  /**
+   * @brief 当前线程上开始运行了、还没有结束的共享栈协程数
+   * @details 这些协程的栈内容在当前线程的共享栈上，线程退出后就无法恢复
+   */
+  static size_t SharedStackLiveCount();
+
   /**
    * @brief 获取当前协程的id
    * @return 当前协程的id
    */
   static uint64_t GetFiberId();
 
+  /**
+   * @brief 当前线程是否正在调度协程的栈上直接执行scheduleInline()的任务
+   * @details 这时不能让出，YieldToHold()/YieldToReady()会断言失败
+   */
+  static bool InInlineTask();
+
+  /**
+   * @brief 从协程池取一个执行完的协程reset(cb)，池里没有才新建
+   * @details 先取当前线程的池(fiber.pool.max_cached)，再取全局池
+   *  (fiber.pool.global_max_cached)。只池化默认栈大小的独立栈协程；
+   *  共享栈协程第一次运行后绑定了线程的共享栈，总是新建
+   * @param cb 协程执行的函数
+   * @param shared_stack 是否运行在线程的共享栈上
+   */
+  static Fiber::ptr Create(Task cb, bool shared_stack = false);
+
+  /**
+   * @brief 把Create()得到、已经执行完的协程放回池中，fiber被置空
+   * @details 只有调用者持有最后一个引用时才回收；当前线程的池满了放全局池，
+   *  全局池也满了直接释放
+   */
+  static void Recycle(Fiber::ptr &fiber);
+
+  /**
+   * @brief 协程新建/析构/复用的计数和速率
+   */
+  static FiberPoolStats GetPoolStats();
+
   /**
    * @brief 协程执行函数，执行完成返回到线程主协程
    */
@@ -208,13 +322,40 @@ public:
    */
   static void CallerMainFunc();
 
+private:
+  /**
+   * @brief 标记当前线程开始/结束执行inline任务，由Scheduler::run()调用
+   */
+  static void SetInlineTask(bool v);
+
+  /**
+   * @brief 切入前把共享栈准备好：换出当前占用者，恢复自己保存的栈
+   * @pre 不能在共享栈上调用
+   */
+  void switchInSharedStack();
+
+  /**
+   * @brief 把挂起时已使用的共享栈拷贝到私有缓冲区
+   */
+  void saveSharedStack();
+
 private:
   uint64_t m_id = 0;          /// 协程id
   void *m_stack = nullptr;    /// 协程运行栈指针
   uint32_t m_stacksize = 0;   /// 协程运行栈大小
   State m_state = INIT;       /// 协程状态
-  ucontext_t m_ctx;           /// 协程上下文
-  std::function<void()> m_cb; /// 协程运行函数
+  FiberContext m_ctx;         /// 协程上下文
+  Task m_cb;                  /// 协程运行函数
+
+  bool m_shared = false;              /// 是否运行在共享栈上
+  bool m_useCaller = false;           /// 共享栈延迟创建上下文时使用的入口
+  bool m_needMake = false;            /// 共享栈上的上下文是否还未创建
+  int m_stackThread = -1;             /// 共享栈所属线程id
+  SharedStack *m_sharedStack = nullptr; /// 绑定的共享栈
+  char *m_saveBuffer = nullptr;       /// 换出时保存栈内容的私有缓冲区
+  uint32_t m_saveSize = 0;            /// 缓冲区中有效的栈大小
+  uint32_t m_saveCapacity = 0;        /// 缓冲区容量
+  bool m_pooled = false;              /// 由Create()创建，执行完可以回收
 };
 
 } // namespace bin
@@ -0,0 +1,761 @@
+/**
+ * @file dns.cc
+ * @author yinyb (990900296@qq.com)
+ * @brief 协程化的DNS解析器
+ * @version 1.0
+ * @date 2022-04-04
+ * @copyright Copyright (c) {2022}
+ */
+
+#include <algorithm>
+#include <errno.h>
+#include <fstream>
+#include <random>
+#include <sstream>
+#include <sys/stat.h>
+
+#include "config.h"
+#include "coroutine.h"
+#include "dns.h"
+#include "log.h"
+#include "scheduler.h"
+#include "socket.h"
+#include "util.h"
+
+namespace bin {
+
+static bin::Logger::ptr g_logger = BIN_LOG_NAME("system");
+
+static ConfigVar<bool>::ptr g_dns_enable = Config::Lookup<bool>(
+    "dns.enable", true, "resolve host names with the fiber dns resolver");
+
+static ConfigVar<std::string>::ptr g_dns_resolv_conf =
+    Config::Lookup<std::string>("dns.resolv_conf", "/etc/resolv.conf",
+                                "resolv.conf path");
+
+static ConfigVar<std::string>::ptr g_dns_hosts =
+    Config::Lookup<std::string>("dns.hosts", "/etc/hosts", "hosts file path");
+
+static ConfigVar<std::vector<std::string>>::ptr g_dns_nameservers =
+    Config::Lookup<std::vector<std::string>>(
+        "dns.nameservers", std::vector<std::string>(),
+        "nameservers ip[:port], override resolv.conf when not empty");
+
+static ConfigVar<uint32_t>::ptr g_dns_timeout_ms = Config::Lookup<uint32_t>(
+    "dns.timeout_ms", 0, "dns query timeout, 0 means resolv.conf timeout");
+
+static ConfigVar<uint32_t>::ptr g_dns_attempts = Config::Lookup<uint32_t>(
+    "dns.attempts", 0, "dns query rounds, 0 means resolv.conf attempts");
+
+static ConfigVar<uint32_t>::ptr g_dns_cache_max_entries =
+    Config::Lookup<uint32_t>("dns.cache.max_entries", 4096,
+                             "max entries of the dns cache");
+
+static ConfigVar<uint32_t>::ptr g_dns_cache_max_ttl = Config::Lookup<uint32_t>(
+    "dns.cache.max_ttl_s", 3600, "max seconds a dns answer is cached");
+
+static ConfigVar<uint32_t>::ptr g_dns_cache_negative_ttl =
+    Config::Lookup<uint32_t>("dns.cache.negative_ttl_s", 30,
+                             "seconds a missing name is cached without soa");
+
+static const uint16_t DNS_PORT = 53;
+static const uint16_t TYPE_A = 1;
+static const uint16_t TYPE_CNAME = 5;
+static const uint16_t TYPE_SOA = 6;
+static const uint16_t TYPE_AAAA = 28;
+static const uint16_t CLASS_IN = 1;
+static const uint8_t RCODE_NXDOMAIN = 3;
+static const uint8_t FLAG_TC = 0x02; /// 头部第3字节，应答被截断
+/// 不带EDNS的UDP应答最长512字节，留一些余量
+static const size_t MAX_PACKET = 1024;
+
+static uint16_t Get16(const uint8_t *p) { return (p[0] << 8) | p[1]; }
+
+static uint32_t Get32(const uint8_t *p) {
+  return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) |
+         ((uint32_t)p[2] << 8) | p[3];
+}
+
+static void Put16(std::string &out, uint16_t v) {
+  out.push_back((char)(v >> 8));
+  out.push_back((char)(v & 0xff));
+}
+
+static uint16_t NextQueryId() {
+  static thread_local std::mt19937 s_rand(GetCurrentUS() ^ GetThreadId());
+  return (uint16_t)s_rand();
+}
+
+/**
+ * @brief 解析ip、ip:port、[ipv6]:port形式的服务器地址
+ */
+static IPAddress::ptr ParseServer(const std::string &str) {
+  std::string host = str;
+  uint16_t port = DNS_PORT;
+  if (!str.empty() && str[0] == '[') {
+    size_t end = str.find(']');
+    if (end == std::string::npos) {
+      return nullptr;
+    }
+    host = str.substr(1, end - 1);
+    if (end + 1 < str.size() && str[end + 1] == ':') {
+      port = (uint16_t)atoi(str.c_str() + end + 2);
+    }
+  } else if (std::count(str.begin(), str.end(), ':') == 1) {
+    size_t colon = str.find(':');
+    host = str.substr(0, colon);
+    port = (uint16_t)atoi(str.c_str() + colon + 1);
+  }
+  return IPAddress::Create(host.c_str(), port);
+}
+
+/**
+ * @brief 生成查询报文，名字不合法返回false
+ */
+static bool EncodeQuery(uint16_t id, const std::string &name, uint16_t qtype,
+                        std::string &out) {
+  if (name.empty() || name.size() > 253) {
+    return false;
+  }
+  out.clear();
+  Put16(out, id);
+  Put16(out, 0x0100); // RD，请求递归查询
+  Put16(out, 1);      // QDCOUNT
+  Put16(out, 0);
+  Put16(out, 0);
+  Put16(out, 0);
+  size_t begin = 0;
+  while (begin <= name.size()) {
+    size_t end = name.find('.', begin);
+    if (end == std::string::npos) {
+      end = name.size();
+    }
+    size_t len = end - begin;
+    if (len == 0 || len > 63) {
+      return false;
+    }
+    out.push_back((char)len);
+    out.append(name, begin, len);
+    begin = end + 1;
+  }
+  out.push_back('\0');
+  Put16(out, qtype);
+  Put16(out, CLASS_IN);
+  return true;
+}
+
+/**
+ * @brief 读取报文中pos处的名字，支持压缩指针，pos移到名字之后
+ */
+static bool ReadName(const uint8_t *msg, size_t len, size_t &pos,
+                     std::string &name) {
+  name.clear();
+  size_t p = pos;
+  bool jumped = false;
+  int hops = 0;
+  while (true) {
+    if (p >= len) {
+      return false;
+    }
+    uint8_t c = msg[p];
+    if ((c & 0xc0) == 0xc0) {
+      // 压缩指针，限制跳转次数防止循环
+      if (p + 1 >= len || ++hops > 16) {
+        return false;
+      }
+      if (!jumped) {
+        pos = p + 2;
+        jumped = true;
+      }
+      p = ((c & 0x3f) << 8) | msg[p + 1];
+      continue;
+    }
+    if (c & 0xc0) {
+      return false;
+    }
+    ++p;
+    if (c == 0) {
+      break;
+    }
+    if (p + c > len || name.size() + c > 254) {
+      return false;
+    }
+    if (!name.empty()) {
+      name.push_back('.');
+    }
+    for (size_t i = 0; i < c; ++i) {
+      name.push_back((char)tolower(msg[p + i]));
+    }
+    p += c;
+  }
+  if (!jumped) {
+    pos = p;
+  }
+  return true;
+}
+
+/**
+ * @brief 否定应答的TTL：权威段SOA记录的TTL和MINIMUM取小，没有SOA用配置值
+ */
+static uint32_t NegativeTTL(const uint8_t *msg, size_t len, size_t pos,
+                            uint16_t count) {
+  std::string owner;
+  for (uint16_t i = 0; i < count; ++i) {
+    if (!ReadName(msg, len, pos, owner) || pos + 10 > len) {
+      break;
+    }
+    uint16_t type = Get16(msg + pos);
+    uint32_t ttl = Get32(msg + pos + 4);
+    uint16_t rdlen = Get16(msg + pos + 8);
+    pos += 10;
+    if (pos + rdlen > len) {
+      break;
+    }
+    if (type == TYPE_SOA) {
+      size_t p = pos;
+      std::string mname, rname;
+      if (ReadName(msg, len, p, mname) && ReadName(msg, len, p, rname) &&
+          p + 20 <= pos + rdlen) {
+        return std::min(ttl, Get32(msg + p + 16));
+      }
+    }
+    pos += rdlen;
+  }
+  return g_dns_cache_negative_ttl->getValue();
+}
+
+/**
+ * @brief 解析应答报文，CNAME链上的记录都在同一个应答里
+ * @details 截断的应答只带了一部分记录，没有TCP重试，返回UNAVAILABLE交给getaddrinfo
+ */
+static Resolver::Status ParseResponse(const uint8_t *msg, size_t len,
+                                      const std::string &name, uint16_t qtype,
+                                      std::vector<IPAddress::ptr> &addrs,
+                                      uint32_t &ttl) {
+  uint8_t rcode = msg[3] & 0x0f;
+  uint16_t qdcount = Get16(msg + 4);
+  uint16_t ancount = Get16(msg + 6);
+  uint16_t nscount = Get16(msg + 8);
+  size_t pos = 12;
+  std::string owner;
+  if (qdcount != 1 || !ReadName(msg, len, pos, owner) || pos + 4 > len ||
+      owner != name || Get16(msg + pos) != qtype) {
+    return Resolver::ERROR;
+  }
+  pos += 4;
+  if (msg[2] & FLAG_TC) {
+    return Resolver::UNAVAILABLE;
+  }
+  if (rcode == RCODE_NXDOMAIN) {
+    ttl = NegativeTTL(msg, len, pos, nscount); // 没有回答段，pos就是权威段
+    return Resolver::NOT_FOUND;
+  }
+  if (rcode != 0) {
+    return Resolver::ERROR;
+  }
+
+  uint32_t min_ttl = ~0u;
+  for (uint16_t i = 0; i < ancount; ++i) {
+    if (!ReadName(msg, len, pos, owner) || pos + 10 > len) {
+      return Resolver::ERROR;
+    }
+    uint16_t type = Get16(msg + pos);
+    uint16_t cls = Get16(msg + pos + 2);
+    uint32_t rttl = Get32(msg + pos + 4);
+    uint16_t rdlen = Get16(msg + pos + 8);
+    pos += 10;
+    if (pos + rdlen > len) {
+      return Resolver::ERROR;
+    }
+    if (cls == CLASS_IN) {
+      if (type == TYPE_A && qtype == TYPE_A && rdlen == 4) {
+        addrs.push_back(IPAddress::ptr(new IPv4Address(Get32(msg + pos), 0)));
+        min_ttl = std::min(min_ttl, rttl);
+      } else if (type == TYPE_AAAA && qtype == TYPE_AAAA && rdlen == 16) {
+        addrs.push_back(IPAddress::ptr(new IPv6Address(msg + pos, 0)));
+        min_ttl = std::min(min_ttl, rttl);
+      } else if (type == TYPE_CNAME) {
+        min_ttl = std::min(min_ttl, rttl);
+      }
+    }
+    pos += rdlen;
+  }
+  if (addrs.empty()) {
+    // NODATA：名字存在但没有这个类型的记录
+    ttl = NegativeTTL(msg, len, pos, nscount);
+    return Resolver::NOT_FOUND;
+  }
+  ttl = min_ttl;
+  return Resolver::OK;
+}
+
+/**
+ * @brief 当前协程能否挂起等待其他协程的查询结果，条件同OffloadTask()
+ */
+static bool CanSuspend() {
+  if (!Scheduler::GetThis()) {
+    return false;
+  }
+  Fiber *cur = Fiber::GetThisRaw();
+  return cur->getId() != 0 && cur != Scheduler::GetMainFiber() &&
+         !Fiber::InInlineTask();
+}
+
+/**
+ * @brief 复制地址，缓存里的地址对象不交给调用方，避免调用方setPort()互相影响
+ */
+static void CopyAddrs(const std::vector<IPAddress::ptr> &addrs,
+                      std::vector<IPAddress::ptr> &result) {
+  for (auto &i : addrs) {
+    result.push_back(std::static_pointer_cast<IPAddress>(
+        Address::Create(i->getAddr(), i->getAddrLen())));
+  }
+}
+
+static bool IsLocalhost(const std::string &name) {
+  static const std::string s_suffix = ".localhost";
+  return name == "localhost" ||
+         (name.size() > s_suffix.size() &&
+          name.compare(name.size() - s_suffix.size(), s_suffix.size(),
+                       s_suffix) == 0);
+}
+
+static time_t FileMtime(const std::string &path) {
+  struct stat st;
+  return stat(path.c_str(), &st) == 0 ? st.st_mtime : 0;
+}
+
+Resolver::Resolver() {}
+
+Resolver::Status Resolver::resolve(const std::string &name, int family,
+                                   std::vector<IPAddress::ptr> &result) {
+  if (!g_dns_enable->getValue()) {
+    return UNAVAILABLE;
+  }
+  std::string key = ToLower(name);
+  if (key.empty() || key == ".") {
+    return ERROR;
+  }
+  reload();
+  if (lookupHosts(key, family, result)) {
+    return OK;
+  }
+  if (IsLocalhost(key)) {
+    // RFC 6761：localhost总是解析为回环地址
+    if (family != AF_INET6) {
+      result.push_back(IPAddress::ptr(new IPv4Address(INADDR_LOOPBACK, 0)));
+    }
+    if (family != AF_INET) {
+      result.push_back(IPv6Address::Create("::1"));
+    }
+    return OK;
+  }
+
+  uint16_t qtypes[2];
+  size_t count = 0;
+  if (family == AF_INET || family == AF_UNSPEC) {
+    qtypes[count++] = TYPE_A;
+  }
+  if (family == AF_INET6 || family == AF_UNSPEC) {
+    qtypes[count++] = TYPE_AAAA;
+  }
+  if (count == 0) {
+    return ERROR;
+  }
+  Status rt = NOT_FOUND;
+  bool found = false;
+  size_t old_size = result.size();
+  for (size_t i = 0; i < count; ++i) {
+    Status s = cachedQuery(key, qtypes[i], result);
+    if (s == OK) {
+      found = true;
+    } else if (s == UNAVAILABLE) {
+      // 有一种记录拿不全，不返回另一种的部分结果
+      result.resize(old_size);
+      return UNAVAILABLE;
+    } else if (s != NOT_FOUND) {
+      rt = s;
+    }
+  }
+  return found ? OK : rt;
+}
+
+void Resolver::clearCache() {
+  for (size_t i = 0; i < SHARD_COUNT; ++i) {
+    Mutex::Lock lock(m_shards[i].mutex);
+    m_shards[i].cache.clear();
+  }
+  RWMutex::WriteLock lock(m_confMutex);
+  m_confPath.clear();
+  m_hostsPath.clear();
+  m_lastCheckMs = 0;
+}
+
+bool Resolver::LoadResolvConf(const std::string &path, ResolvConf &conf) {
+  std::ifstream ifs(path);
+  if (!ifs) {
+    return false;
+  }
+  std::string line;
+  while (std::getline(ifs, line)) {
+    size_t comment = line.find_first_of("#;");
+    if (comment != std::string::npos) {
+      line.resize(comment);
+    }
+    std::istringstream ss(line);
+    std::string key, value;
+    if (!(ss >> key)) {
+      continue;
+    }
+    if (key == "nameserver") {
+      if (ss >> value) {
+        IPAddress::ptr addr = IPAddress::Create(value.c_str(), DNS_PORT);
+        if (addr) {
+          conf.nameservers.push_back(addr);
+        } else {
+          BIN_LOG_WARN(g_logger) << path << ": invalid nameserver " << value;
+        }
+      }
+    } else if (key == "search" || key == "domain") {
+      // 后出现的search/domain覆盖前面的
+      conf.search.clear();
+      while (ss >> value) {
+        if (!value.empty() && value.back() == '.') {
+          value.pop_back();
+        }
+        if (!value.empty()) {
+          conf.search.push_back(ToLower(value));
+        }
+      }
+    } else if (key == "options") {
+      while (ss >> value) {
+        size_t colon = value.find(':');
+        if (colon == std::string::npos) {
+          continue;
+        }
+        std::string opt = value.substr(0, colon);
+        uint32_t v = (uint32_t)atoi(value.c_str() + colon + 1);
+        if (opt == "ndots") {
+          conf.ndots = std::min(v, 15u);
+        } else if (opt == "timeout") {
+          conf.timeout_ms = std::max(1u, std::min(v, 30u)) * 1000;
+        } else if (opt == "attempts") {
+          conf.attempts = std::max(1u, std::min(v, 5u));
+        }
+      }
+    }
+  }
+  return true;
+}
+
+bool Resolver::LoadHosts(const std::string &path, HostsMap &hosts) {
+  std::ifstream ifs(path);
+  if (!ifs) {
+    return false;
+  }
+  std::string line;
+  while (std::getline(ifs, line)) {
+    size_t comment = line.find('#');
+    if (comment != std::string::npos) {
+      line.resize(comment);
+    }
+    std::istringstream ss(line);
+    std::string ip, name;
+    if (!(ss >> ip)) {
+      continue;
+    }
+    IPAddress::ptr addr = IPAddress::Create(ip.c_str());
+    if (!addr) {
+      continue;
+    }
+    while (ss >> name) {
+      hosts[ToLower(name)].push_back(addr);
+    }
+  }
+  return true;
+}
+
+const char *Resolver::StatusToString(Status status) {
+  switch (status) {
+#define XX(name)                                                               \
+  case name:                                                                   \
+    return #name;
+    XX(OK);
+    XX(NOT_FOUND);
+    XX(TIMEOUT);
+    XX(ERROR);
+    XX(UNAVAILABLE);
+#undef XX
+  default:
+    return "UNKNOWN";
+  }
+}
+
+void Resolver::reload() {
+  uint64_t now = GetMonotonicMS();
+  uint64_t last = m_lastCheckMs;
+  if (last != 0 && now < last + 1000) {
+    return;
+  }
+  // 只让一个线程检查
+  if (!m_lastCheckMs.compare_exchange_strong(last, std::max<uint64_t>(now, 1))) {
+    return;
+  }
+  const std::string conf_path = g_dns_resolv_conf->getValue();
+  const std::string hosts_path = g_dns_hosts->getValue();
+  time_t conf_mtime = FileMtime(conf_path);
+  time_t hosts_mtime = FileMtime(hosts_path);
+  bool conf_changed, hosts_changed;
+  {
+    RWMutex::ReadLock lock(m_confMutex);
+    conf_changed = conf_path != m_confPath || conf_mtime != m_confMtime;
+    hosts_changed = hosts_path != m_hostsPath || hosts_mtime != m_hostsMtime;
+  }
+  if (conf_changed) {
+    ResolvConf conf;
+    LoadResolvConf(conf_path, conf);
+    RWMutex::WriteLock lock(m_confMutex);
+    m_conf = conf;
+    m_confPath = conf_path;
+    m_confMtime = conf_mtime;
+  }
+  if (hosts_changed) {
+    HostsMap hosts;
+    LoadHosts(hosts_path, hosts);
+    RWMutex::WriteLock lock(m_confMutex);
+    m_hosts.swap(hosts);
+    m_hostsPath = hosts_path;
+    m_hostsMtime = hosts_mtime;
+  }
+}
+
+bool Resolver::lookupHosts(const std::string &name, int family,
+                           std::vector<IPAddress::ptr> &result) {
+  std::string key = name;
+  if (key.back() == '.') {
+    key.pop_back();
+  }
+  std::vector<IPAddress::ptr> addrs;
+  {
+    RWMutex::ReadLock lock(m_confMutex);
+    auto it = m_hosts.find(key);
+    if (it == m_hosts.end()) {
+      return false;
+    }
+    for (auto &i : it->second) {
+      if (family == AF_UNSPEC || i->getFamily() == family) {
+        addrs.push_back(i);
+      }
+    }
+  }
+  CopyAddrs(addrs, result);
+  return !addrs.empty();
+}
+
+Resolver::Status Resolver::cachedQuery(const std::string &name, uint16_t qtype,
+                                       std::vector<IPAddress::ptr> &result) {
+  std::string key = name + (qtype == TYPE_A ? "/A" : "/AAAA");
+  Shard &shard = m_shards[std::hash<std::string>()(key) % SHARD_COUNT];
+  std::shared_ptr<Pending> pending;
+  bool leader = false;
+  {
+    Mutex::Lock lock(shard.mutex);
+    auto it = shard.cache.find(key);
+    if (it != shard.cache.end()) {
+      if (it->second.expireMs > GetMonotonicMS()) {
+        ++m_cacheHits;
+        CopyAddrs(it->second.addrs, result);
+        return it->second.status;
+      }
+      shard.cache.erase(it);
+    }
+    auto pit = shard.inflight.find(key);
+    if (pit == shard.inflight.end()) {
+      pending.reset(new Pending);
+      shard.inflight[key] = pending;
+      leader = true;
+    } else if (CanSuspend()) {
+      pending = pit->second;
+      Scheduler *scheduler = Scheduler::GetThis();
+      pending->waiters.push_back(std::make_pair(scheduler, Fiber::GetThis()));
+      // 在锁里登记，保证查询方的endExternalWait()在这之后
+      scheduler->beginExternalWait();
+    }
+    // 不能挂起的线程自己查询，不登记也不唤醒别人
+  }
+  if (pending && !leader) {
+    ++m_coalesced;
+    Fiber::YieldToHold();
+    CopyAddrs(pending->addrs, result);
+    return pending->status;
+  }
+
+  std::vector<IPAddress::ptr> addrs;
+  uint32_t ttl = 0;
+  Status rt = query(name, qtype, addrs, ttl);
+  std::vector<std::pair<Scheduler *, Fiber::ptr>> waiters;
+  {
+    Mutex::Lock lock(shard.mutex);
+    ttl = std::min(ttl, g_dns_cache_max_ttl->getValue());
+    if ((rt == OK || rt == NOT_FOUND) && ttl > 0) {
+      size_t max_entries =
+          std::max<size_t>(1, g_dns_cache_max_entries->getValue() / SHARD_COUNT);
+      if (shard.cache.size() >= max_entries && !shard.cache.count(key)) {
+        uint64_t now = GetMonotonicMS();
+        for (auto it = shard.cache.begin(); it != shard.cache.end();) {
+          if (it->second.expireMs <= now) {
+            it = shard.cache.erase(it);
+          } else {
+            ++it;
+          }
+        }
+        if (shard.cache.size() >= max_entries) {
+          shard.cache.erase(shard.cache.begin());
+        }
+      }
+      CacheEntry &entry = shard.cache[key];
+      entry.status = rt;
+      entry.addrs = addrs;
+      entry.expireMs = GetMonotonicMS() + (uint64_t)ttl * 1000;
+    }
+    if (leader) {
+      pending->status = rt;
+      pending->addrs = addrs;
+      waiters.swap(pending->waiters);
+      shard.inflight.erase(key);
+    }
+  }
+  for (auto &i : waiters) {
+    i.first->schedule(std::move(i.second));
+    i.first->endExternalWait();
+  }
+  CopyAddrs(addrs, result);
+  return rt;
+}
+
+Resolver::Status Resolver::query(const std::string &name, uint16_t qtype,
+                                 std::vector<IPAddress::ptr> &addrs,
+                                 uint32_t &ttl) {
+  ResolvConf conf;
+  {
+    RWMutex::ReadLock lock(m_confMutex);
+    conf = m_conf;
+  }
+  const std::vector<std::string> &servers = g_dns_nameservers->getValue();
+  if (!servers.empty()) {
+    conf.nameservers.clear();
+    for (auto &i : servers) {
+      IPAddress::ptr addr = ParseServer(i);
+      if (addr) {
+        conf.nameservers.push_back(addr);
+      } else {
+        BIN_LOG_WARN(g_logger) << "dns.nameservers invalid server " << i;
+      }
+    }
+  }
+  if (conf.nameservers.empty()) {
+    return UNAVAILABLE;
+  }
+  uint32_t timeout_ms = g_dns_timeout_ms->getValue();
+  if (timeout_ms == 0) {
+    timeout_ms = conf.timeout_ms;
+  }
+  uint32_t attempts = g_dns_attempts->getValue();
+  if (attempts == 0) {
+    attempts = conf.attempts;
+  }
+
+  // 以点结尾的是完整域名，不拼接搜索域；点数够ndots的先查原名
+  std::vector<std::string> names;
+  if (name.back() == '.') {
+    names.push_back(name.substr(0, name.size() - 1));
+  } else {
+    if ((uint32_t)std::count(name.begin(), name.end(), '.') >= conf.ndots) {
+      names.push_back(name);
+    }
+    for (auto &i : conf.search) {
+      names.push_back(name + "." + i);
+    }
+    if (names.empty() || names[0] != name) {
+      names.push_back(name);
+    }
+  }
+
+  Status rt = NOT_FOUND;
+  uint32_t negative_ttl = ~0u;
+  for (auto &n : names) {
+    Status s = TIMEOUT;
+    uint32_t t = 0;
+    for (uint32_t i = 0; i < attempts && s != OK && s != NOT_FOUND; ++i) {
+      for (auto &server : conf.nameservers) {
+        addrs.clear();
+        s = queryServer(server, n, qtype, timeout_ms, addrs, t);
+        if (s == OK || s == NOT_FOUND) {
+          break;
+        }
+        // 应答被截断，换服务器也一样，不缓存，直接让调用方退回getaddrinfo
+        if (s == UNAVAILABLE) {
+          addrs.clear();
+          ttl = 0;
+          return UNAVAILABLE;
+        }
+        BIN_LOG_DEBUG(g_logger) << "dns query " << n << " server="
+                                << server->toString()
+                                << " status=" << StatusToString(s);
+      }
+    }
+    if (s == OK) {
+      ttl = t;
+      return OK;
+    }
+    if (s == NOT_FOUND) {
+      negative_ttl = std::min(negative_ttl, t);
+    } else {
+      rt = s;
+    }
+  }
+  // 有服务器没应答时不能确定名字不存在，不缓存
+  ttl = rt == NOT_FOUND ? negative_ttl : 0;
+  return rt;
+}
+
+Resolver::Status Resolver::queryServer(const IPAddress::ptr &server,
+                                       const std::string &name, uint16_t qtype,
+                                       uint32_t timeout_ms,
+                                       std::vector<IPAddress::ptr> &addrs,
+                                       uint32_t &ttl) {
+  uint16_t id = NextQueryId();
+  std::string packet;
+  if (!EncodeQuery(id, name, qtype, packet)) {
+    return ERROR;
+  }
+  // 在hook开启的线程里，socket由IOManager管理，等待应答只挂起当前协程
+  Socket::ptr sock = Socket::CreateUDP(server);
+  if (!sock->isValid() || !sock->connect(server)) {
+    return ERROR;
+  }
+  uint64_t deadline = GetMonotonicMS() + timeout_ms;
+  sock->setRecvTimeout(timeout_ms);
+  ++m_queries;
+  if (sock->send(packet.data(), packet.size()) != (int)packet.size()) {
+    return ERROR;
+  }
+  uint8_t buf[MAX_PACKET];
+  while (true) {
+    int n = sock->recv(buf, sizeof(buf));
+    if (n < 0) {
+      return (errno == EAGAIN || errno == ETIMEDOUT) ? TIMEOUT : ERROR;
+    }
+    // 丢弃ID不对的迟到应答，继续等到超时
+    if (n >= 12 && Get16(buf) == id && (buf[2] & 0x80)) {
+      return ParseResponse(buf, n, name, qtype, addrs, ttl);
+    }
+    uint64_t now = GetMonotonicMS();
+    if (now >= deadline) {
+      return TIMEOUT;
+    }
+    sock->setRecvTimeout(deadline - now);
+  }
+}
+
+} // namespace bin
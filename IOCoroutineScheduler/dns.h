@@ -0,0 +1,171 @@
+/**
+ * @file dns.h
+ * @author yinyb (990900296@qq.com)
+ * @brief 协程化的DNS解析器
+ *  getaddrinfo是阻塞调用，放到阻塞线程池也要占一个线程等完整个查询。Resolver先查
+ *  /etc/hosts，再用hook过的UDP socket按resolv.conf里的服务器发A/AAAA查询，等应答时
+ *  只挂起当前协程。结果按TTL缓存在分片的缓存里，同一个名字同时只有一个查询在进行，
+ *  其他请求的协程挂起等它的结果
+ * @version 1.0
+ * @date 2022-04-04
+ * @copyright Copyright (c) {2022}
+ */
+
+#ifndef __BIN_DNS_H__
+#define __BIN_DNS_H__
+
+#include <atomic>
+#include <memory>
+#include <stdint.h>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "address.h"
+#include "mutex.h"
+#include "singleton.h"
+
+namespace bin {
+
+class Fiber;
+class Scheduler;
+
+/**
+ * @brief resolv.conf里解析器用到的配置
+ */
+struct ResolvConf {
+  std::vector<IPAddress::ptr> nameservers; /// DNS服务器
+  std::vector<std::string> search;         /// 搜索域
+  uint32_t ndots = 1;         /// 名字里的点少于ndots时先拼接搜索域查询
+  uint32_t timeout_ms = 5000; /// 每次查询等待应答的时间
+  uint32_t attempts = 2;      /// 所有服务器轮流查询的轮数
+};
+
+class Resolver {
+public:
+  typedef std::unordered_map<std::string, std::vector<IPAddress::ptr>> HostsMap;
+
+  /**
+   * @brief 解析结果
+   */
+  enum Status {
+    OK = 0,     /// 解析成功
+    NOT_FOUND,  /// 名字不存在或者没有要的记录，结果会按否定TTL缓存
+    TIMEOUT,    /// 所有服务器都没有应答
+    ERROR,      /// 服务器返回错误、应答不合法或者名字不合法
+    UNAVAILABLE /// 没有可用的DNS服务器或者应答被截断，调用方应该退回getaddrinfo
+  };
+
+  /// 缓存分片数，每个分片一把锁
+  static const size_t SHARD_COUNT = 16;
+
+  Resolver();
+
+  /**
+   * @brief 解析域名，返回的地址端口为0，调用方可以随意修改
+   * @param[in] name 域名，不能是数字形式的IP
+   * @param[in] family AF_INET查A记录，AF_INET6查AAAA记录，AF_UNSPEC先A后AAAA
+   * @param[out] result 追加解析到的地址
+   * @details 在调度器的任务协程里调用时，等待应答和等待相同名字的查询都只挂起协程；
+   *  在线程里直接调用时阻塞等待
+   */
+  Status resolve(const std::string &name, int family,
+                 std::vector<IPAddress::ptr> &result);
+
+  /**
+   * @brief 清空缓存，hosts和resolv.conf下次解析时重新读取
+   */
+  void clearCache();
+
+  uint64_t getQueryCount() const { return m_queries; }      /// 发出的查询报文数
+  uint64_t getCacheHitCount() const { return m_cacheHits; } /// 命中缓存的次数
+  uint64_t getCoalescedCount() const { return m_coalesced; } /// 等待相同名字查询的次数
+
+  /**
+   * @brief 读取resolv.conf，支持nameserver、search、domain和options的ndots/timeout/attempts
+   * @return 文件是否能打开
+   */
+  static bool LoadResolvConf(const std::string &path, ResolvConf &conf);
+
+  /**
+   * @brief 读取hosts文件，名字统一转成小写
+   * @return 文件是否能打开
+   */
+  static bool LoadHosts(const std::string &path, HostsMap &hosts);
+
+  static const char *StatusToString(Status status);
+
+private:
+  /**
+   * @brief 缓存的解析结果，包括否定结果
+   */
+  struct CacheEntry {
+    Status status = ERROR;
+    std::vector<IPAddress::ptr> addrs;
+    uint64_t expireMs = 0; /// 到期的单调时钟毫秒数
+  };
+
+  /**
+   * @brief 正在进行的查询，等待同一个名字的协程挂在上面
+   */
+  struct Pending {
+    Status status = ERROR;
+    std::vector<IPAddress::ptr> addrs;
+    std::vector<std::pair<Scheduler *, std::shared_ptr<Fiber>>> waiters;
+  };
+
+  struct Shard {
+    Mutex mutex;
+    std::unordered_map<std::string, CacheEntry> cache;
+    std::unordered_map<std::string, std::shared_ptr<Pending>> inflight;
+  };
+
+  /**
+   * @brief hosts和resolv.conf修改后重新读取，最多每秒检查一次
+   */
+  void reload();
+
+  bool lookupHosts(const std::string &name, int family,
+                   std::vector<IPAddress::ptr> &result);
+
+  /**
+   * @brief 查询一种记录，先查缓存，相同名字的查询合并
+   */
+  Status cachedQuery(const std::string &name, uint16_t qtype,
+                     std::vector<IPAddress::ptr> &result);
+
+  /**
+   * @brief 按搜索域和服务器依次查询
+   */
+  Status query(const std::string &name, uint16_t qtype,
+               std::vector<IPAddress::ptr> &addrs, uint32_t &ttl);
+
+  /**
+   * @brief 向一个服务器发一次查询，等待应答
+   */
+  Status queryServer(const IPAddress::ptr &server, const std::string &name,
+                     uint16_t qtype, uint32_t timeout_ms,
+                     std::vector<IPAddress::ptr> &addrs, uint32_t &ttl);
+
+private:
+  RWMutex m_confMutex;
+  ResolvConf m_conf;
+  HostsMap m_hosts;
+  std::string m_confPath;     /// 当前读取的resolv.conf路径
+  std::string m_hostsPath;    /// 当前读取的hosts路径
+  time_t m_confMtime = 0;
+  time_t m_hostsMtime = 0;
+  std::atomic<uint64_t> m_lastCheckMs{0}; /// 上次检查文件修改的时间，0表示需要重新读取
+
+  Shard m_shards[SHARD_COUNT];
+
+  std::atomic<uint64_t> m_queries{0};
+  std::atomic<uint64_t> m_cacheHits{0};
+  std::atomic<uint64_t> m_coalesced{0};
+};
+
+typedef Singleton<Resolver> ResolverMgr; // DNS解析器单例
+
+} // namespace bin
+
+#endif
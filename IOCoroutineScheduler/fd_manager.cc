@@ -11,10 +11,14 @@ namespace bin{
     FdCtx::FdCtx(int fd)
         :m_isInit(false)
         ,m_isSocket(false)
+        ,m_isRegular(false)
+        ,m_isBlockDev(false)
         ,m_sysNonblock(false)
         ,m_userNonblock(false)
         ,m_isClosed(false)
         ,m_fd(fd)
+        ,m_dev(0)
+        ,m_ino(0)
         ,m_recvTimeout(-1)
         ,m_sendTimeout(-1){
         init();
@@ -42,6 +46,10 @@ namespace bin{
             m_isInit = true;
             //取出状态位 判断句柄类型
             m_isSocket = S_ISSOCK(fd_stat.st_mode);
+            m_isRegular = S_ISREG(fd_stat.st_mode);
+            m_isBlockDev = S_ISBLK(fd_stat.st_mode);
+            m_dev = fd_stat.st_dev;
+            m_ino = fd_stat.st_ino;
         }
 
         if(m_isSocket){
@@ -75,6 +83,22 @@ namespace bin{
             return m_sendTimeout;
     }
 
+    bool FdCtx::isStale() const{
+        struct stat fd_stat;
+        if(-1 == fstat(m_fd, &fd_stat))
+            return true;
+        return fd_stat.st_dev != m_dev || fd_stat.st_ino != m_ino;
+    }
+
+    bool FdCtx::bindIOManager(IOManager* iom){
+        IOManager* expected = nullptr;
+        return m_iom.compare_exchange_strong(expected, iom);
+    }
+
+    void FdCtx::unbindIOManager(IOManager* iom){
+        m_iom.compare_exchange_strong(iom, nullptr);
+    }
+
 
 
     
@@ -109,6 +133,19 @@ namespace bin{
         return ctx;
     }
 
+    FdCtx::ptr FdManager::create(int fd){
+        if(fd == -1)
+            return nullptr;
+
+        FdCtx::ptr ctx(new FdCtx(fd));
+        RWMutexType::WriteLock lock(m_mutex);
+        if(fd >= (int)m_fds.size()){
+            m_fds.resize(fd * 1.5);
+        }
+        m_fds[fd] = ctx;
+        return ctx;
+    }
+
     void FdManager::del(int fd){
         RWMutexType::WriteLock lock(m_mutex);
         if((int)m_fds.size() <= fd)
@@ -2,13 +2,17 @@
 #ifndef __FD_MANAGER_H__
 #define __FD_MANAGER_H__
 
+#include <atomic>
 #include <memory>
 #include <vector>
+#include <sys/types.h>
 #include "thread.h"
 #include "singleton.h"
 
 namespace bin {
 
+    class IOManager;
+
     //文件句柄上下文类 管理文件句柄类型(是否socket)是否阻塞,是否关闭,读/写超时时间
     class FdCtx : public std::enable_shared_from_this<FdCtx> {
     public:
@@ -19,7 +23,13 @@ namespace bin {
         //常用接口
         bool isInit() const { return m_isInit; }                //是否初始化完成
         bool isSocket() const { return m_isSocket; }            //是否socket
+        bool isRegularFile() const { return m_isRegular; }      //是否普通文件
+        bool isBlockDevice() const { return m_isBlockDev; }     //是否块设备
         bool isClose() const { return m_isClosed; }             //是否已关闭
+        //句柄号是否已经换成了别的文件。没经过hook的close(如fclose)关掉句柄后FdCtx留了下来，
+        //同号的新句柄会沿用它记下的类型，这里重新fstat比较设备号和inode
+        bool isStale() const;
+        void setClose(){ m_isClosed = true; }                  //标记为已关闭，之后被唤醒的IO不再重试
         void setUserNonblock(bool v){ m_userNonblock = v; }     //设置用户主动设置非阻塞(v)
         bool getUserNonblock() const { return m_userNonblock; } //获取是否用户主动设置的非阻塞
         void setSysNonblock(bool v){ m_sysNonblock = v; }       //设置系统非阻塞(v)
@@ -29,18 +39,33 @@ namespace bin {
         void setTimeout(int type, uint64_t t);  //设置超时时间(ms) type为SO_RCVTIMEO类型(读超时), SO_SNDTIMEO(写超时) t 时间毫秒
         uint64_t getTimeout(int type);          //获取超时时间(ms) type为SO_RCVTIMEO类型(读超时), SO_SNDTIMEO(写超时)
 
+        //常驻注册所在的IOManager。句柄第一次等待事件时注册到当时的IOManager，
+        //之后可能在别的IOManager上关闭，close()要到注册的IOManager上移除
+        IOManager* getIOManager() const { return m_iom; }
+        //还没有注册过时记下iom，返回是否由iom注册
+        bool bindIOManager(IOManager* iom);
+        //取走注册所在的IOManager，句柄关闭时调用
+        IOManager* unbindIOManager(){ return m_iom.exchange(nullptr); }
+        //注册在iom上时清空，IOManager析构时调用
+        void unbindIOManager(IOManager* iom);
+
     private:
         bool init();    //初始化
 
     private:
         bool m_isInit: 1;       //是否初始化
         bool m_isSocket: 1;     //是否socket
+        bool m_isRegular: 1;    //是否普通文件，创建时fstat一次记下，读写时不再fstat
+        bool m_isBlockDev: 1;   //是否块设备
         bool m_sysNonblock: 1;  //是否hook非阻塞
         bool m_userNonblock: 1; //是否用户主动设置非阻塞
         bool m_isClosed: 1;     //是否关闭
         int m_fd;               //文件句柄
+        dev_t m_dev;            //创建时的设备号，用来判断句柄号是否被复用
+        ino_t m_ino;            //创建时的inode
         uint64_t m_recvTimeout; //读超时时间毫秒 读（SO_REVTIMEO）超时类型
         uint64_t m_sendTimeout; //写超时时间毫秒 写（SO_SNDTIMEO）超时类型
+        std::atomic<IOManager*> m_iom{nullptr}; //常驻注册所在的IOManager
     };
 
 
@@ -54,6 +79,10 @@ namespace bin {
         
         //获取/创建文件句柄类FdCtx，返回对应的指针 fd 文件句柄 auto_create 是否自动创建
         FdCtx::ptr get(int fd, bool auto_create = false);
+
+        //socket()/accept()新得到的句柄创建FdCtx。同号的旧句柄可能被没有hook的close(如fclose)关掉，
+        //留下的FdCtx已经过期，直接替换
+        FdCtx::ptr create(int fd);
         
         void del(int fd);   //删除文件句柄类  fd: 文件句柄
 
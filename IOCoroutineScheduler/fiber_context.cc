@@ -0,0 +1,176 @@
+/**
+ * @file fiber_context.cc
+ * @author yinyb (990900296@qq.com)
+ * @brief 协程上下文切换
+ * @version 1.0
+ * @date 2022-04-03
+ * @copyright Copyright (c) {2022}
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#include "fiber_context.h"
+#include "macro.h"
+
+#if defined(__x86_64__)
+/*
+ * 栈布局(从高地址到低地址):
+ *   返回地址 | rbp | rbx | r12 | r13 | r14 | r15 | mxcsr + x87控制字 <- sp
+ */
+asm(R"(
+.text
+.globl bin_swap_context
+.type bin_swap_context,@function
+.align 16
+bin_swap_context:
+    pushq %rbp
+    pushq %rbx
+    pushq %r12
+    pushq %r13
+    pushq %r14
+    pushq %r15
+    subq $8, %rsp
+    stmxcsr (%rsp)
+    fnstcw 4(%rsp)
+    movq %rsp, (%rdi)
+    movq %rsi, %rsp
+    ldmxcsr (%rsp)
+    fldcw 4(%rsp)
+    addq $8, %rsp
+    popq %r15
+    popq %r14
+    popq %r13
+    popq %r12
+    popq %rbx
+    popq %rbp
+    ret
+.size bin_swap_context,.-bin_swap_context
+)");
+#elif defined(__aarch64__)
+/*
+ * 栈布局(sp起始的偏移):
+ *   0x00-0x3f d8-d15 | 0x40-0x8f x19-x28 | 0x90 x29(fp) | 0x98 x30(lr)
+ */
+asm(R"(
+.text
+.globl bin_swap_context
+.type bin_swap_context,%function
+.align 4
+bin_swap_context:
+    sub sp, sp, #0xa0
+    stp d8, d9, [sp, #0x00]
+    stp d10, d11, [sp, #0x10]
+    stp d12, d13, [sp, #0x20]
+    stp d14, d15, [sp, #0x30]
+    stp x19, x20, [sp, #0x40]
+    stp x21, x22, [sp, #0x50]
+    stp x23, x24, [sp, #0x60]
+    stp x25, x26, [sp, #0x70]
+    stp x27, x28, [sp, #0x80]
+    stp x29, x30, [sp, #0x90]
+    mov x9, sp
+    str x9, [x0]
+    mov sp, x1
+    ldp d8, d9, [sp, #0x00]
+    ldp d10, d11, [sp, #0x10]
+    ldp d12, d13, [sp, #0x20]
+    ldp d14, d15, [sp, #0x30]
+    ldp x19, x20, [sp, #0x40]
+    ldp x21, x22, [sp, #0x50]
+    ldp x23, x24, [sp, #0x60]
+    ldp x25, x26, [sp, #0x70]
+    ldp x27, x28, [sp, #0x80]
+    ldp x29, x30, [sp, #0x90]
+    add sp, sp, #0xa0
+    ret
+.size bin_swap_context,.-bin_swap_context
+)");
+#endif
+
+namespace bin {
+
+#if defined(__x86_64__)
+void *MakeAsmContext(void *stack, size_t size, void (*fn)()) {
+  // 栈顶16字节对齐
+  uintptr_t top = ((uintptr_t)stack + size) & ~(uintptr_t)15;
+  void **sp = (void **)top;
+  // 入口函数的"返回地址"，ret进入fn时 rsp+8 是16字节对齐的，符合调用约定
+  *--sp = nullptr;
+  *--sp = (void *)fn; // ret 的跳转地址
+  for (int i = 0; i < 6; ++i) {
+    *--sp = nullptr; // rbp rbx r12 r13 r14 r15
+  }
+  --sp;
+  uint32_t mxcsr = 0x1F80; // 默认值: 屏蔽所有浮点异常，就近舍入
+  uint16_t fpucw = 0x037F;
+  memcpy(sp, &mxcsr, sizeof(mxcsr));
+  memcpy((char *)sp + 4, &fpucw, sizeof(fpucw));
+  return sp;
+}
+#elif defined(__aarch64__)
+void *MakeAsmContext(void *stack, size_t size, void (*fn)()) {
+  uintptr_t top = ((uintptr_t)stack + size) & ~(uintptr_t)15;
+  void **sp = (void **)(top - 0xa0);
+  memset(sp, 0, 0xa0);
+  sp[0x98 / sizeof(void *)] = (void *)fn; // lr, ret 的跳转地址
+  return sp;
+}
+#endif
+
+#ifdef BIN_FIBER_UCONTEXT
+
+void FiberContext::init() {
+  if (getcontext(&m_ctx)) {
+    BIN_ASSERT2(false, "getcontext");
+  }
+}
+
+void FiberContext::make(void *stack, size_t size, EntryFunc fn) {
+  if (getcontext(&m_ctx)) {
+    BIN_ASSERT2(false, "getcontext");
+  }
+  m_ctx.uc_link = nullptr; // 后续程序上下文
+  m_ctx.uc_stack.ss_sp = stack;
+  m_ctx.uc_stack.ss_size = size;
+  makecontext(&m_ctx, fn, 0);
+}
+
+void FiberContext::Swap(FiberContext &from, FiberContext &to) {
+  if (swapcontext(&from.m_ctx, &to.m_ctx)) {
+    BIN_ASSERT2(false, "swapcontext");
+  }
+}
+
+void *FiberContext::getStackPointer() const {
+#if defined(__x86_64__)
+  return (void *)m_ctx.uc_mcontext.gregs[REG_RSP];
+#elif defined(__aarch64__)
+  return (void *)m_ctx.uc_mcontext.sp;
+#else
+  return nullptr;
+#endif
+}
+
+const char *FiberContext::BackendName() { return "ucontext"; }
+
+#else
+
+// 主协程的栈顶在第一次切出时由bin_swap_context写入
+void FiberContext::init() { m_sp = nullptr; }
+
+void FiberContext::make(void *stack, size_t size, EntryFunc fn) {
+  m_sp = MakeAsmContext(stack, size, fn);
+}
+
+void FiberContext::Swap(FiberContext &from, FiberContext &to) {
+  bin_swap_context(&from.m_sp, to.m_sp);
+}
+
+void *FiberContext::getStackPointer() const { return m_sp; }
+
+const char *FiberContext::BackendName() { return "asm"; }
+
+#endif
+
+} // namespace bin
@@ -0,0 +1,108 @@
+/**
+ * @file fiber_context.h
+ * @author yinyb (990900296@qq.com)
+ * @brief 协程上下文切换
+ * @version 1.0
+ * @date 2022-04-03
+ * @copyright Copyright (c) {2022}
+ */
+
+/*
+ * swapcontext每次切换都会通过rt_sigprocmask系统调用保存/恢复信号掩码，
+ * 在do_io频繁挂起/恢复协程的场景下，这个系统调用是切换开销的大头。
+ *
+ * 默认使用手写汇编完成切换(x86-64/aarch64)，只保存ABI规定的callee-saved寄存器：
+ *  x86-64:  rbx rbp r12-r15 + mxcsr/x87控制字
+ *  aarch64: x19-x29 lr(x30) d8-d15
+ * 寄存器压在协程自己的栈上，上下文只需要记录一个栈顶指针。
+ *
+ * 编译时定义 BIN_FIBER_UCONTEXT (cmake -DFIBER_UCONTEXT=ON) 或者在其他架构上，
+ * 回退为ucontext实现。
+ */
+
+#ifndef __BIN_FIBER_CONTEXT_H__
+#define __BIN_FIBER_CONTEXT_H__
+
+#include <stddef.h>
+#include <ucontext.h>
+
+#if defined(__x86_64__) || defined(__aarch64__)
+#define BIN_FIBER_ASM_SUPPORTED 1
+#endif
+
+#if !defined(BIN_FIBER_ASM_SUPPORTED) && !defined(BIN_FIBER_UCONTEXT)
+#define BIN_FIBER_UCONTEXT 1
+#endif
+
+#ifdef BIN_FIBER_ASM_SUPPORTED
+extern "C" {
+/**
+ * @brief 汇编实现的上下文切换
+ *  把callee-saved寄存器压到当前栈上，*from_sp = 当前栈顶，然后切到to_sp恢复执行
+ * @param from_sp 保存当前上下文栈顶的位置
+ * @param to_sp 目标上下文的栈顶
+ */
+void bin_swap_context(void **from_sp, void *to_sp);
+}
+#endif
+
+namespace bin {
+
+#ifdef BIN_FIBER_ASM_SUPPORTED
+/**
+ * @brief 在[stack, stack + size)上构造一个可以被bin_swap_context切入的初始栈帧
+ * @param stack 栈的低地址
+ * @param size 栈大小
+ * @param fn 入口函数，不允许返回
+ * @return 初始上下文的栈顶指针
+ */
+void *MakeAsmContext(void *stack, size_t size, void (*fn)());
+#endif
+
+/**
+ * @brief 协程上下文
+ */
+class FiberContext {
+public:
+  typedef void (*EntryFunc)();
+
+  /**
+   * @brief 以当前执行流初始化上下文，主协程使用
+   */
+  void init();
+
+  /**
+   * @brief 在指定的栈上创建上下文，切入后从fn开始执行
+   * @param stack 栈的低地址
+   * @param size 栈大小
+   * @param fn 入口函数，不允许返回
+   */
+  void make(void *stack, size_t size, EntryFunc fn);
+
+  /**
+   * @brief 保存当前上下文到from，切换到to
+   */
+  static void Swap(FiberContext &from, FiberContext &to);
+
+  /**
+   * @brief 返回挂起时保存的栈顶指针，共享栈模式据此计算需要拷贝的栈大小
+   * @return 栈顶指针，当前架构无法获取时返回nullptr
+   */
+  void *getStackPointer() const;
+
+  /**
+   * @brief 返回上下文切换后端的名称
+   */
+  static const char *BackendName();
+
+private:
+#ifdef BIN_FIBER_UCONTEXT
+  ucontext_t m_ctx; /// ucontext上下文
+#else
+  void *m_sp = nullptr; /// 挂起时的栈顶指针，寄存器都保存在栈上
+#endif
+};
+
+} // namespace bin
+
+#endif
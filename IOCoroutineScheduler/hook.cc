@@ -8,6 +8,7 @@
  */
 
 #include <dlfcn.h>
+#include <sys/stat.h>
 
 #include "config.h"
 #include "coroutine.h"
@@ -16,6 +17,7 @@
 #include "iomanager.h"
 #include "log.h"
 #include "macro.h"
+#include "offload.h"
 
 bin::Logger::ptr g_logger = BIN_LOG_NAME("system");
 
@@ -29,6 +31,15 @@ namespace bin {
 static bin::ConfigVar<int>::ptr g_tcp_connect_timeout =
     bin::Config::Lookup("tcp.connect.timeout", 5000, "tcp connect timeout");
 
+static bin::ConfigVar<bool>::ptr g_offload_file_io = bin::Config::Lookup(
+    "offload.file_io", true,
+    "run blocking file io of hooked threads on the blocking call offload pool");
+
+static bin::ConfigVar<uint32_t>::ptr g_offload_file_write_min =
+    bin::Config::Lookup<uint32_t>(
+        "offload.file_write_min", 64 * 1024,
+        "file writes at least this many bytes go to the offload pool");
+
 static thread_local bool t_hook_enable = false;
 
 #define HOOK_FUN(XX)                                                           \
@@ -40,15 +51,19 @@ static thread_local bool t_hook_enable = false;
   XX(accept)                                                                   \
   XX(read)                                                                     \
   XX(readv)                                                                    \
+  XX(pread)                                                                    \
   XX(recv)                                                                     \
   XX(recvfrom)                                                                 \
   XX(recvmsg)                                                                  \
   XX(write)                                                                    \
   XX(writev)                                                                   \
+  XX(pwrite)                                                                   \
   XX(send)                                                                     \
   XX(sendto)                                                                   \
   XX(sendmsg)                                                                  \
   XX(close)                                                                    \
+  XX(fsync)                                                                    \
+  XX(fdatasync)                                                                \
   XX(fcntl)                                                                    \
   XX(ioctl)                                                                    \
   XX(getsockopt)                                                               \
@@ -98,10 +113,6 @@ void set_hook_enable(bool flag) { t_hook_enable = flag; }
 
 } // namespace bin
 
-struct timer_info {
-  int cancelled = 0;
-};
-
 // block2: hook系统函数，使用我们自定义的函数，替换系统调用
 /*SO_RCVTIMEO和SO_SNDTIMEO，分别用来设置socket接收数据超时时间和发送数据超时时间
 这两个选项仅对与数据收发相关的系统调用有效，这些系统调用包括：send, sendmsg,
@@ -109,15 +120,87 @@ recv, recvmsg, accept, connect 。 这两个选项设置后，若超时，
 返回-1，并设置errno为EAGAIN或EWOULDBLOCK 其中connect超时的话，也是返回-1,
 但errno设置为EINPROGRESS
 */
+/*
+ * 普通文件、块设备的读写不会返回EAGAIN，epoll也不支持，只能阻塞。
+ * 读不在页缓存里就要等磁盘，read和pread一样卸载；写进页缓存的小块写几乎不阻塞，
+ * 卸载反而多一次线程切换，而且会让持锁的协程挂起，所以写只卸载超过
+ * offload.file_write_min的，fsync/fdatasync总是卸载。管道、终端这些可能一直阻塞
+ * 下去的不卸载，不占住线程池
+ */
+enum FileIoKind {
+  FILE_READ,  // read/readv/pread
+  FILE_WRITE, // write/writev/pwrite
+  FILE_SYNC   // fsync/fdatasync
+};
+
+// 取非socket句柄的FdCtx，第一次用到时创建，之后读写不再fstat。
+// 无效的句柄不留下FdCtx；没经过hook的socket()创建的socket不接管，不改成非阻塞
+static bin::FdCtx::ptr get_file_ctx(int fd) {
+  bin::FdCtx::ptr ctx = bin::FdMgr::GetInstance()->get(fd);
+  if (ctx)
+    return ctx;
+  struct stat st;
+  if (fstat(fd, &st) != 0 || S_ISSOCK(st.st_mode))
+    return nullptr;
+  return bin::FdMgr::GetInstance()->get(fd, true);
+}
+
+static bool file_io_blocks(const bin::FdCtx::ptr &ctx, FileIoKind kind,
+                           size_t len, int fd) {
+  if (!ctx || !bin::g_offload_file_io->getValue() ||
+      !(ctx->isRegularFile() || ctx->isBlockDevice()))
+    return false;
+  if (kind == FILE_WRITE && len < bin::g_offload_file_write_min->getValue())
+    return false;
+  // 记下的类型可能已经过期：句柄被fclose这类没经过hook的close关掉，号码又分给了
+  // 管道。管道上的读写可能一直阻塞，占住线程池，卸载前重新确认一次；
+  // 比起卸载的线程切换，多一次fstat可以忽略
+  if (BIN_UNLIKELY(ctx->isStale())) {
+    bin::FdMgr::GetInstance()->del(fd);
+    bin::FdCtx::ptr fresh = get_file_ctx(fd);
+    return fresh && (fresh->isRegularFile() || fresh->isBlockDevice());
+  }
+  return true;
+}
+
+template <typename OriginFun, typename... Args>
+static ssize_t do_file_io(const bin::FdCtx::ptr &ctx, FileIoKind kind,
+                          size_t len, int fd, OriginFun fun, Args &&...args) {
+  if (!file_io_blocks(ctx, kind, len, fd))
+    return fun(fd, std::forward<Args>(args)...);
+  // errno是线程局部的，从线程池带回来
+  int error = 0;
+  ssize_t n = bin::offload([&]() {
+    ssize_t rt = fun(fd, args...);
+    error = errno;
+    return rt;
+  });
+  errno = error;
+  return n;
+}
+
+// 常驻注册推迟到句柄第一次等待事件时，注册到等待所在的IOManager。
+// TcpServer在accept的IOManager上得到句柄、在另一个IOManager上读写和关闭，
+// 句柄只注册在读写的IOManager里，accept的IOManager不会被它的就绪通知唤醒
+static void register_fd(const bin::FdCtx::ptr &ctx, bin::IOManager *iom,
+                        int fd) {
+  if (!ctx->getIOManager() && ctx->bindIOManager(iom))
+    iom->registerFd(fd);
+}
+
+// len: read/write/readv/writev的字节数，只用来判断文件的写要不要卸载，socket调用传0
 template <typename OriginFun, typename... Args>
 static ssize_t do_io(int fd, OriginFun fun, const char *hook_fun_name,
-                     uint32_t event, int timeout_so, Args &&...args) {
+                     uint32_t event, int timeout_so, size_t len,
+                     Args &&...args) {
   if (!bin::t_hook_enable)
     return fun(fd, std::forward<Args>(args)...);
   BIN_LOG_DEBUG(g_logger) << "do_io<" << hook_fun_name << ">";
   // 1. 从FdManager中通过get()获取当前文件描述符fd的对象FdCtx
   bin::FdCtx::ptr ctx = bin::FdMgr::GetInstance()->get(fd);
-  // a.FdManger不存在当前的文件描述符fd，我们认为它不是一个socket，执行原来的系统调用
+  // a.FdManger不存在当前的文件描述符fd，我们认为它不是一个socket，第一次读写时记下句柄类型
+  if (!ctx)
+    ctx = get_file_ctx(fd);
   if (!ctx)
     return fun(fd, std::forward<Args>(args)...);
   // b. 该描述符是socket但是已经被关闭，就返回错误
@@ -125,14 +208,17 @@ static ssize_t do_io(int fd, OriginFun fun, const char *hook_fun_name,
     errno = EBADF;
     return -1;
   }
-  // c.该描述符明确不是socket或者已经被设置为NonBlock非阻塞状态，执行原来的系统调用
-  if (!ctx->isSocket() || ctx->getUserNonblock())
+  // c.该描述符明确不是socket，会阻塞的文件读写交给阻塞线程池
+  if (!ctx->isSocket())
+    return do_file_io(ctx,
+                      event == bin::IOManager::READ ? FILE_READ : FILE_WRITE,
+                      len, fd, fun, std::forward<Args>(args)...);
+  // d.已经被设置为NonBlock非阻塞状态，执行原来的系统调用
+  if (ctx->getUserNonblock())
     return fun(fd, std::forward<Args>(args)...);
   // handle the HOOKed system call
-  // 2.取当前套接字上的读/写超时时间getTimeout()，并且通过shared_ptr<>设置一个定时器的条件
-  // （结构体struct timer_info）用于判定定时器是否是超时被执行
+  // 2.取当前套接字上的读/写超时时间getTimeout()，超时定时器嵌在IOManager的句柄上下文里
   uint64_t to = ctx->getTimeout(timeout_so);
-  std::shared_ptr<timer_info> tinfo(new timer_info);
 retry:
   // 3. 对读写IO执行一次IO操作，返回值有效直接到函数末尾的return
   ssize_t n = fun(fd, std::forward<Args>(args)...);
@@ -143,58 +229,115 @@ retry:
   // b. 判断返回值是否出错，是否属于阻塞状态errno = EAGAIN。如果是：
   if (n == -1 && errno == EAGAIN) { // again: 异步操作
     bin::IOManager *iom = bin::IOManager::GetThis();
-    bin::Timer::ptr timer;
-    std::weak_ptr<timer_info> winfo(tinfo); // 条件变量
-    // i.添加一个条件定时器ConditionTimer，将 2.中的设置的条件赋值给弱指针weak_ptr<>管理。
-    // 定时器到时后，取消对应fd上的事件并且强制触发回调函数
-    if (to != (uint64_t)-1) {
-      // 超时时间为-1说明设置了超时，这么长时间没触发，就放进定时器中主动触发
-      timer = iom->addConditionTimer(
-          to,
-          [winfo, fd, iom, event]() {
-            auto t = winfo.lock();
-            if (!t || t->cancelled) // 空说明执行了
-              return;
-            t->cancelled = ETIMEDOUT;
-            iom->cancelEvent(fd, (bin::IOManager::Event)(event));
-          },
-          winfo);
-    }
-    // ⅱ. IOManagerIO调度器为fd添加所需的读/写事件，设置异步回调
-    int rt = iom->addEvent(fd, (bin::IOManager::Event)(event));
-    if (BIN_UNLIKELY(rt)) { // 添加失败
+    register_fd(ctx, iom, fd);
+    // 常驻注册的句柄在这次IO之后又就绪了，不用挂起直接重试
+    if (iom->consumeReady(fd, (bin::IOManager::Event)(event)))
+      goto retry;
+    // i. IOManager为fd添加所需的读/写事件，挂起当前协程Fiber::YieldToHold()，
+    // 设置了超时时间就同时设置超时定时器，超时后取消事件并强制唤醒
+    int rt = iom->waitEvent(fd, (bin::IOManager::Event)(event), to);
+    if (BIN_UNLIKELY(rt == -1)) { // 添加失败
       BIN_LOG_ERROR(g_logger)
           << hook_fun_name << " addEvent(" << fd << ", " << event << ")";
-      if (timer)
-        timer->cancel();
       return -1;
     } else {
-      // ⅲ. 将当前协程挂起让出执行权Coroutine::YieldToHold()
-      bin::Fiber::YieldToHold();
-      /*//4.
-      等待协程切回（从Coroutine::YieldToHold()返回），读事件READ返回继续执行read；写事件WRITE返回继续执行write
+      /*//ii.
+      等待协程切回（从waitEvent()返回），读事件READ返回继续执行read；写事件WRITE返回继续执行write
       ● 切回的条件：
-      a. IO没有数据到达，条件定时器超时强制唤醒：
-          取消全部套接字全部事件cancelEvent()，没有指定回调函数function< >
-      cb，主动触发事件triggerEvent()默认将当前的协程作为任务加入队列，执行上一次没执行完的协程内容
+      a. IO没有数据到达，超时定时器强制唤醒：
+          cancelEvent()主动触发事件triggerEvent()，默认将当前的协程作为任务加入队列，执行上一次没执行完的协程内容
       b. 定时器还没有超时，IO活跃有数据到达触发回调
-          根据epoll_wait()带回的活跃IO信息epoll_event拿到对应的套接字对象FdCtx，主动触发事件triggerEvent()默认将当前的协程作为任务加入队列，执行上一次没执行完的协程内容
+          根据epoll_wait()带回的活跃IO信息拿到对应的句柄对象FdContext，主动触发事件triggerEvent()默认将当前的协程作为任务加入队列，执行上一次没执行完的协程内容
       */
-      // 5. 检查之前的条件定时器是否还存在，存在就要将其取消，否则还会超时触发
-      if (timer)
-        timer->cancel();
-      // 6. 检查超时条件是否有值，有值说明还没释放，返回错误
-      if (tinfo->cancelled) {
-        errno = tinfo->cancelled;
+      // iii. 超时返回错误
+      if (rt == ETIMEDOUT) {
+        errno = ETIMEDOUT;
+        return -1;
+      }
+      // close()取消事件唤醒的，句柄已经关闭，不能再注册事件
+      if (ctx->isClose()) {
+        errno = EBADF;
         return -1;
       }
-      // 7. goto RETRY继续IO操作，读写数据
+      // iv. goto RETRY继续IO操作，读写数据
       goto retry;
     }
   }
   return n;
 }
 
+/*
+ * io_uring后端支持提交式IO时，socket上的读写直接提交给内核，完成后协程被唤醒，
+ * 不需要 尝试IO -> EAGAIN -> 注册事件 -> 等待就绪 -> 再次IO 这一串系统调用。
+ * 写操作大多数时候可以立即完成，先直接写一次，写不进去再提交。
+ */
+static ssize_t try_io_now(const bin::IORequest &req) {
+  switch (req.op) {
+  case bin::IORequest::WRITE:
+    return write_f(req.fd, req.buf, req.len);
+  case bin::IORequest::WRITEV:
+    return writev_f(req.fd, (const iovec *)req.buf, req.len);
+  case bin::IORequest::SEND:
+    return send_f(req.fd, req.buf, req.len, req.flags);
+  case bin::IORequest::SENDMSG:
+    return sendmsg_f(req.fd, (const msghdr *)req.buf, req.flags);
+  default:
+    errno = EAGAIN;
+    return -1;
+  }
+}
+
+/**
+ * @brief 通过IOManager提交IO请求
+ * @param timeout_so 超时类型SO_RCVTIMEO/SO_SNDTIMEO，为0时使用timeout_ms
+ * @param n 返回值，语义同对应的系统调用
+ * @return false 不适用(没有开启hook/后端不支持/不是socket/用户设置了非阻塞)，
+ *  调用方走do_io()
+ */
+static bool submit_io(bin::IORequest &req, int timeout_so, ssize_t &n,
+                      uint64_t timeout_ms = -1) {
+  if (!bin::t_hook_enable)
+    return false;
+  bin::IOManager *iom = bin::IOManager::GetThis();
+  if (!iom || !iom->supportsAsyncIO())
+    return false;
+  bin::FdCtx::ptr ctx = bin::FdMgr::GetInstance()->get(req.fd);
+  if (!ctx || ctx->isClose() || !ctx->isSocket() || ctx->getUserNonblock())
+    return false;
+  n = try_io_now(req);
+  while (n == -1 && errno == EINTR)
+    n = try_io_now(req);
+  if (n != -1 || errno != EAGAIN)
+    return true;
+  if (timeout_so)
+    timeout_ms = ctx->getTimeout(timeout_so);
+  if (!iom->submitIO(req, timeout_ms))
+    return false;
+  // 老内核对O_NONBLOCK的socket不会等待，直接返回EAGAIN，回退到就绪通知
+  if (req.result == -EAGAIN)
+    return false;
+  if (req.result < 0) {
+    // 被close()取消
+    errno = req.result == -ECANCELED ? EBADF : -req.result;
+    n = -1;
+  } else {
+    n = req.result;
+  }
+  return true;
+}
+
+static bin::IORequest make_request(bin::IORequest::Op op, int fd,
+                                   const void *buf, size_t len,
+                                   int flags = 0) {
+  bin::IORequest req;
+  req.op = op;
+  req.fd = fd;
+  req.buf = (void *)buf;
+  req.len = len;
+  req.flags = flags;
+  return req;
+}
+
 extern "C" {
 // block: 2.1 HOOK system call: sleep、usleep、nanosleep.
 
@@ -226,10 +369,11 @@ int usleep(useconds_t usec) {
     return usleep_f(usec);
   bin::Fiber::ptr fiber = bin::Fiber::GetThis();
   bin::IOManager *iom = bin::IOManager::GetThis();
-  iom->addTimer(usec / 1000, std::bind((void(bin::Scheduler::*)(bin::Fiber::ptr,
-                                                                int thread)) &
-                                           bin::IOManager::schedule,
-                                       iom, fiber, -1));
+  // 微秒定时器，不到1ms的睡眠也会真正挂起
+  iom->addTimerUS(usec, std::bind((void(bin::Scheduler::*)(bin::Fiber::ptr,
+                                                           int thread)) &
+                                      bin::IOManager::schedule,
+                                  iom, fiber, -1));
   bin::Fiber::YieldToHold();
   return 0;
 }
@@ -237,13 +381,14 @@ int usleep(useconds_t usec) {
 int nanosleep(const struct timespec *req, struct timespec *rem) {
   if (!bin::t_hook_enable)
     return nanosleep_f(req, rem);
-  int timeout_ms = req->tv_sec * 1000 + req->tv_nsec / 1000 / 1000;
+  // 纳秒向上取整到微秒，不会提前返回
+  uint64_t timeout_us = req->tv_sec * 1000000ull + (req->tv_nsec + 999) / 1000;
   bin::Fiber::ptr fiber = bin::Fiber::GetThis();
   bin::IOManager *iom = bin::IOManager::GetThis();
-  iom->addTimer(timeout_ms, std::bind((void(bin::Scheduler::*)(bin::Fiber::ptr,
-                                                               int thread)) &
-                                          bin::IOManager::schedule,
-                                      iom, fiber, -1));
+  iom->addTimerUS(timeout_us, std::bind((void(bin::Scheduler::*)(bin::Fiber::ptr,
+                                                                 int thread)) &
+                                            bin::IOManager::schedule,
+                                        iom, fiber, -1));
   bin::Fiber::YieldToHold();
   return 0;
 }
@@ -274,8 +419,8 @@ int socket(int domain, int type, int protocol) {
   int fd = socket_f(domain, type, protocol);
   if (fd == -1)
     return fd;
-  // 由FdManager创建一个fd
-  bin::FdMgr::GetInstance()->get(fd, true);
+  // 由FdManager创建一个fd，第一次等待事件时再常驻注册
+  bin::FdMgr::GetInstance()->create(fd);
   return fd;
 }
 
@@ -333,6 +478,14 @@ int connect_with_timeout(int fd, const struct sockaddr *addr, socklen_t addrlen,
   // 用户主动设置非阻塞
   if (ctx->getUserNonblock())
     return connect_f(fd, addr, addrlen);
+  // io_uring后端直接提交connect
+  bin::IORequest req =
+      make_request(bin::IORequest::CONNECT, fd, addr, addrlen);
+  ssize_t sn = 0;
+  if (submit_io(req, 0, sn, timeout_ms)) {
+    if (sn != -1 || (errno != EINPROGRESS && errno != EALREADY))
+      return sn;
+  }
   // 创建socket时候已经设置为 非阻塞的 因此这里不会阻塞
   int n = connect_f(fd, addr, addrlen);
   // 创建成功返回0
@@ -347,37 +500,13 @@ int connect_with_timeout(int fd, const struct sockaddr *addr, socklen_t addrlen,
       如果getsockopt返回的错误码是0则表示连接真的建立成功，否则返回对应失败的错误码。
   */
   bin::IOManager *iom = bin::IOManager::GetThis();
-  bin::Timer::ptr timer;
-  std::shared_ptr<timer_info> tinfo(new timer_info);
-  std::weak_ptr<timer_info> winfo(tinfo);
-  if (timeout_ms != (uint64_t)-1) {
-    timer = iom->addConditionTimer(
-        timeout_ms,
-        [winfo, fd, iom]() {
-          auto t = winfo.lock();
-          if (!t || t->cancelled) {
-            return;
-          }
-          t->cancelled = ETIMEDOUT;
-          iom->cancelEvent(fd, bin::IOManager::WRITE);
-        },
-        winfo);
-  }
+  register_fd(ctx, iom, fd);
   // 添加写事件是因为 connect成功后马上可写
-  int rt = iom->addEvent(fd, bin::IOManager::WRITE);
-  if (rt == 0) {
-    bin::Fiber::YieldToHold(); // 切出
-    if (timer) {               // 切回
-      timer->cancel();
-    }
-    if (tinfo->cancelled) {
-      errno = tinfo->cancelled;
-      return -1;
-    }
-  } else {
-    if (timer) {
-      timer->cancel();
-    }
+  int rt = iom->waitEvent(fd, bin::IOManager::WRITE, timeout_ms);
+  if (rt == ETIMEDOUT) {
+    errno = ETIMEDOUT;
+    return -1;
+  } else if (rt == -1) {
     BIN_LOG_ERROR(g_logger) << "connect addEvent(" << fd << ", WRITE) error";
   }
   // 协程切回后 检查一下socket上是否有错误  才能最终判断连接是否建立
@@ -404,66 +533,122 @@ int connect(int sockfd, const struct sockaddr *addr, socklen_t addrlen) {
 // 功能：接受客户端连接返回通信套接字，要把系统返回的fd通过FdManager在用户态维护在FdCtx中
 // 由于accept本身是必然的会阻塞的，因此可以使用do_io()来HOOK它，和socket()类似
 int accept(int s, struct sockaddr *addr, socklen_t *addrlen) {
-  int fd = do_io(s, accept_f, "accept", bin::IOManager::READ, SO_RCVTIMEO, addr,
-                 addrlen);
+  bin::IORequest req = make_request(bin::IORequest::ACCEPT, s, addr, 0);
+  req.addrlen = addrlen;
+  ssize_t fd = 0;
+  if (!submit_io(req, SO_RCVTIMEO, fd))
+    fd = do_io(s, accept_f, "accept", bin::IOManager::READ, SO_RCVTIMEO, 0,
+               addr, addrlen);
   if (fd >= 0)
-    bin::FdMgr::GetInstance()->get(
-        fd, true); // 把新建立的通信套接字加入到FdManager中去管理
+    bin::FdMgr::GetInstance()->create(
+        fd); // 把新建立的通信套接字加入到FdManager中去管理
   return fd;
 }
 
 ssize_t read(int fd, void *buf, size_t count) {
   // do_io(int fd, OriginFun fun, const char* hook_fun_name, uint32_t event, int
-  // timeout_so, Args&&... args){
-  return do_io(fd, read_f, "read", bin::IOManager::READ, SO_RCVTIMEO, buf,
-               count);
+  // timeout_so, size_t len, Args&&... args){
+  bin::IORequest req = make_request(bin::IORequest::READ, fd, buf, count);
+  ssize_t n = 0;
+  if (submit_io(req, SO_RCVTIMEO, n))
+    return n;
+  return do_io(fd, read_f, "read", bin::IOManager::READ, SO_RCVTIMEO, count,
+               buf, count);
 }
 
 ssize_t readv(int fd, const struct iovec *iov, int iovcnt) {
-  return do_io(fd, readv_f, "readv", bin::IOManager::READ, SO_RCVTIMEO, iov,
-               iovcnt);
+  bin::IORequest req = make_request(bin::IORequest::READV, fd, iov, iovcnt);
+  ssize_t n = 0;
+  if (submit_io(req, SO_RCVTIMEO, n))
+    return n;
+  return do_io(fd, readv_f, "readv", bin::IOManager::READ, SO_RCVTIMEO, 0,
+               iov, iovcnt);
+}
+
+// pread/pwrite只用于文件，不走socket的路径
+ssize_t pread(int fd, void *buf, size_t count, off_t offset) {
+  if (!bin::t_hook_enable)
+    return pread_f(fd, buf, count, offset);
+  return do_file_io(get_file_ctx(fd), FILE_READ, count, fd, pread_f, buf,
+                    count, offset);
 }
 
 ssize_t recv(int sockfd, void *buf, size_t len, int flags) {
-  return do_io(sockfd, recv_f, "recv", bin::IOManager::READ, SO_RCVTIMEO, buf,
-               len, flags);
+  bin::IORequest req =
+      make_request(bin::IORequest::RECV, sockfd, buf, len, flags);
+  ssize_t n = 0;
+  if (submit_io(req, SO_RCVTIMEO, n))
+    return n;
+  return do_io(sockfd, recv_f, "recv", bin::IOManager::READ, SO_RCVTIMEO, 0,
+               buf, len, flags);
 }
 
 ssize_t recvfrom(int sockfd, void *buf, size_t len, int flags,
                  struct sockaddr *src_addr, socklen_t *addrlen) {
   return do_io(sockfd, recvfrom_f, "recvfrom", bin::IOManager::READ,
-               SO_RCVTIMEO, buf, len, flags, src_addr, addrlen);
+               SO_RCVTIMEO, 0, buf, len, flags, src_addr, addrlen);
 }
 
 ssize_t recvmsg(int sockfd, struct msghdr *msg, int flags) {
+  bin::IORequest req =
+      make_request(bin::IORequest::RECVMSG, sockfd, msg, 0, flags);
+  ssize_t n = 0;
+  if (submit_io(req, SO_RCVTIMEO, n))
+    return n;
   return do_io(sockfd, recvmsg_f, "recvmsg", bin::IOManager::READ, SO_RCVTIMEO,
-               msg, flags);
+               0, msg, flags);
 }
 
 ssize_t write(int fd, const void *buf, size_t count) {
-  return do_io(fd, write_f, "write", bin::IOManager::WRITE, SO_SNDTIMEO, buf,
-               count);
+  bin::IORequest req = make_request(bin::IORequest::WRITE, fd, buf, count);
+  ssize_t n = 0;
+  if (submit_io(req, SO_SNDTIMEO, n))
+    return n;
+  return do_io(fd, write_f, "write", bin::IOManager::WRITE, SO_SNDTIMEO,
+               count, buf, count);
 }
 
 ssize_t writev(int fd, const struct iovec *iov, int iovcnt) {
-  return do_io(fd, writev_f, "writev", bin::IOManager::WRITE, SO_SNDTIMEO, iov,
-               iovcnt);
+  bin::IORequest req = make_request(bin::IORequest::WRITEV, fd, iov, iovcnt);
+  ssize_t n = 0;
+  if (submit_io(req, SO_SNDTIMEO, n))
+    return n;
+  size_t len = 0;
+  for (int i = 0; i < iovcnt; ++i)
+    len += iov[i].iov_len;
+  return do_io(fd, writev_f, "writev", bin::IOManager::WRITE, SO_SNDTIMEO, len,
+               iov, iovcnt);
+}
+
+ssize_t pwrite(int fd, const void *buf, size_t count, off_t offset) {
+  if (!bin::t_hook_enable)
+    return pwrite_f(fd, buf, count, offset);
+  return do_file_io(get_file_ctx(fd), FILE_WRITE, count, fd, pwrite_f, buf,
+                    count, offset);
 }
 
 ssize_t send(int s, const void *msg, size_t len, int flags) {
-  return do_io(s, send_f, "send", bin::IOManager::WRITE, SO_SNDTIMEO, msg, len,
-               flags);
+  bin::IORequest req = make_request(bin::IORequest::SEND, s, msg, len, flags);
+  ssize_t n = 0;
+  if (submit_io(req, SO_SNDTIMEO, n))
+    return n;
+  return do_io(s, send_f, "send", bin::IOManager::WRITE, SO_SNDTIMEO, 0, msg,
+               len, flags);
 }
 
 ssize_t sendto(int s, const void *msg, size_t len, int flags,
                const struct sockaddr *to, socklen_t tolen) {
-  return do_io(s, sendto_f, "sendto", bin::IOManager::WRITE, SO_SNDTIMEO, msg,
-               len, flags, to, tolen);
+  return do_io(s, sendto_f, "sendto", bin::IOManager::WRITE, SO_SNDTIMEO, 0,
+               msg, len, flags, to, tolen);
 }
 
 ssize_t sendmsg(int s, const struct msghdr *msg, int flags) {
-  return do_io(s, sendmsg_f, "sendmsg", bin::IOManager::WRITE, SO_SNDTIMEO, msg,
-               flags);
+  bin::IORequest req = make_request(bin::IORequest::SENDMSG, s, msg, 0, flags);
+  ssize_t n = 0;
+  if (submit_io(req, SO_SNDTIMEO, n))
+    return n;
+  return do_io(s, sendmsg_f, "sendmsg", bin::IOManager::WRITE, SO_SNDTIMEO, 0,
+               msg, flags);
 }
 
 int close(int fd) {
@@ -473,14 +658,35 @@ int close(int fd) {
     return close_f(fd);
   bin::FdCtx::ptr ctx = bin::FdMgr::GetInstance()->get(fd);
   if (ctx) { // if it is socket
+    ctx->setClose();
     auto iom = bin::IOManager::GetThis();
     if (iom)
       iom->cancelAll(fd);
+    // 常驻注册所在的IOManager可能不是当前的，那边也可能有等待者。
+    // 先移除注册再唤醒：等待者是那边最后的任务时，唤醒之后它可能已经停止
+    bin::IOManager *owner = ctx->unbindIOManager();
+    if (owner) {
+      owner->deregisterFd(fd);
+      if (owner != iom)
+        owner->cancelAll(fd);
+    }
     bin::FdMgr::GetInstance()->del(fd);
   }
   return close_f(fd);
 }
 
+int fsync(int fd) {
+  if (!bin::t_hook_enable)
+    return fsync_f(fd);
+  return do_file_io(get_file_ctx(fd), FILE_SYNC, 0, fd, fsync_f);
+}
+
+int fdatasync(int fd) {
+  if (!bin::t_hook_enable)
+    return fdatasync_f(fd);
+  return do_file_io(get_file_ctx(fd), FILE_SYNC, 0, fd, fdatasync_f);
+}
+
 // 功能：设置/获取系统fd上的相关状态。同时还要将状态同步到用户态的FdCtx上
 /*小技巧：
     HOOK fcntl()需要把它内部所有标志位都罗列重写，否则导致部分功能不可用。
@@ -30,6 +30,10 @@ bool is_hook_enable();
 /**
  * @brief 设置当前线程的hook状态
  * @param flag hook or not
+ * @details hook开启后，会阻塞的文件IO(普通文件和块设备的读、fsync/fdatasync、
+ *  不小于offload.file_write_min的写)交给阻塞线程池，当前协程会挂起，见offload.h。
+ *  和socket读写一样，不要在持有bin::Mutex这类线程锁的时候做，否则同一线程上
+ *  等锁的协程会占住线程，挂起的协程回不来
  */
 void set_hook_enable(bool flag);
 
@@ -76,6 +80,9 @@ extern read_fun read_f;
 typedef ssize_t (*readv_fun)(int fd, const struct iovec *iov, int iovcnt);
 extern readv_fun readv_f;
 
+typedef ssize_t (*pread_fun)(int fd, void *buf, size_t count, off_t offset);
+extern pread_fun pread_f;
+
 typedef ssize_t (*recv_fun)(int sockfd, void *buf, size_t len, int flags);
 extern recv_fun recv_f;
 
@@ -93,6 +100,10 @@ extern write_fun write_f;
 typedef ssize_t (*writev_fun)(int fd, const struct iovec *iov, int iovcnt);
 extern writev_fun writev_f;
 
+typedef ssize_t (*pwrite_fun)(int fd, const void *buf, size_t count,
+                              off_t offset);
+extern pwrite_fun pwrite_f;
+
 typedef ssize_t (*send_fun)(int s, const void *msg, size_t len, int flags);
 extern send_fun send_f;
 
@@ -106,6 +117,13 @@ extern sendmsg_fun sendmsg_f;
 typedef int (*close_fun)(int fd);
 extern close_fun close_f;
 
+// 普通文件和块设备上会挂起协程，交给阻塞线程池
+typedef int (*fsync_fun)(int fd);
+extern fsync_fun fsync_f;
+
+typedef int (*fdatasync_fun)(int fd);
+extern fdatasync_fun fdatasync_f;
+
 // other
 typedef int (*fcntl_fun)(int fd, int cmd, ... /* arg */);
 extern fcntl_fun fcntl_f;
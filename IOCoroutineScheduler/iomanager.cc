@@ -1,7 +1,7 @@
 /**
  * @file iomanager.cc
  * @author yinyb (990900296@qq.com)
- * @brief 基于Epoll的IO协程调度器
+ * @brief IO协程调度器，IO多路复用后端见reactor.h
  *  封装套接字句柄对象+事件对象,方便归纳句柄、事件所具有的属性。句柄带有事件，事件依附
  *  于句柄。只有句柄上才有事件触发。
  *  和HOOK模块的文件句柄类做一个区分，这里的套接字句柄专门针对套接字上的事件做回调管理。
@@ -10,20 +10,66 @@
  * @copyright Copyright (c) {2022}
  */
 
+#include <algorithm>
 #include <errno.h>
 #include <fcntl.h>
+#include <poll.h>
 #include <string.h>
 #include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
 #include <unistd.h>
 
+#include "config.h"
+#include "fd_manager.h"
+#include "hook.h"
 #include "iomanager.h"
 #include "log.h"
 #include "macro.h"
+#include "util.h"
 
 namespace bin {
 
 static bin::Logger::ptr g_logger = BIN_LOG_NAME("system");
 
+static ConfigVar<std::string>::ptr g_reactor_type =
+    Config::Lookup<std::string>("iomanager.reactor", "epoll",
+                                "io multiplexing backend, epoll or io_uring");
+
+static ConfigVar<uint32_t>::ptr g_max_events = Config::Lookup<uint32_t>(
+    "iomanager.max_events", 256, "max events taken from one reactor wait");
+
+static ConfigVar<uint32_t>::ptr g_timeout_slack = Config::Lookup<uint32_t>(
+    "iomanager.timeout_slack_ms", 100,
+    "max slack of io timeouts, each timeout may be delayed by 1/16 of it");
+
+static ConfigVar<uint32_t>::ptr g_spin_max_us = Config::Lookup<uint32_t>(
+    "iomanager.spin_max_us", 50,
+    "max time an idle worker spins on the run queue before blocking, "
+    "0 disables; ignored on single cpu machines");
+
+static ConfigVar<bool>::ptr g_spin_poll_reactor = Config::Lookup<bool>(
+    "iomanager.spin_poll_reactor", false,
+    "the polling worker also polls the reactor with timeout 0 while spinning");
+
+static ConfigVar<bool>::ptr g_persistent_events = Config::Lookup<bool>(
+    "iomanager.persistent_events", true,
+    "register sockets once with EPOLLET and cache readiness");
+
+// 只有一个CPU时自旋只会占着生产者要用的CPU
+static uint32_t GetSpinMaxUS() {
+  static const bool s_multi_cpu = sysconf(_SC_NPROCESSORS_ONLN) > 1;
+  return s_multi_cpu ? g_spin_max_us->getValue() : 0;
+}
+
+static inline void CpuRelax() {
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_ia32_pause();
+#elif defined(__aarch64__)
+  asm volatile("yield" ::: "memory");
+#endif
+}
+
 enum EpollCtlOp {};
 
 static std::ostream &operator<<(std::ostream &os, const EpollCtlOp &op) {
@@ -89,14 +135,20 @@ void IOManager::FdContext::resetContext(EventContext &ctx) {
   ctx.cb = nullptr;
 }
 
-void IOManager::FdContext::triggerEvent(IOManager::Event event) {
+void IOManager::FdContext::triggerEvent(IOManager::Event event,
+                                        std::vector<FiberAndThread> *batch) {
   // BIN_LOG_INFO(g_logger) << "fd=" << fd
   //     << " triggerEvent event=" << event
   //     << " events=" << events;
   BIN_ASSERT(events & event); // 当前事件中必须包含要触发的事件
   events = (Event)(events & ~event); // 把触发后的事件去除掉
   EventContext &ctx = getContext(event);
-  if (ctx.cb)
+  if (batch && ctx.scheduler == Scheduler::GetThis()) {
+    if (ctx.cb)
+      batch->emplace_back(&ctx.cb, -1);
+    else if (ctx.fiber)
+      batch->emplace_back(&ctx.fiber, -1);
+  } else if (ctx.cb)
     ctx.scheduler->schedule(&ctx.cb);
   else if (ctx.fiber)
     ctx.scheduler->schedule(&ctx.fiber);
@@ -104,56 +156,84 @@ void IOManager::FdContext::triggerEvent(IOManager::Event event) {
 }
 
 IOManager::IOManager(size_t threads_size, bool use_caller,
-                     const std::string &name)
-    : Scheduler(threads_size, use_caller, name) {
+                     const std::string &name, size_t max_threads,
+                     const std::vector<int> &cpus, bool pin_each)
+    // 每个工作线程槽位一个时间轮，外加一个给外部线程用
+    : Scheduler(threads_size, use_caller, name, max_threads, cpus, pin_each),
+      TimerManager(getWorkerCount() + 1) {
   BIN_LOG_DEBUG(g_logger) << "IO调度器构造: IOManager";
-  m_epfd = epoll_create(5000); // 创建epoll句柄，默认超时时间5秒
-  BIN_ASSERT(m_epfd > 0);
-  // 创建管道句柄 m_tickleFds[0]读管道，m_tickleFds[1]写管道
-  int rt = pipe(m_tickleFds); // rt = 0：success
-  BIN_ASSERT(!rt);
-  epoll_event event; // 初始化epoll事件
-  memset(&event, 0, sizeof(epoll_event));
-  event.events = EPOLLIN | EPOLLET; // 设置为 读事件触发 以及 边缘触发
-  event.data.fd = m_tickleFds[0];
-  // 设置读管道句柄属性，设置为非阻塞
-  rt = fcntl(m_tickleFds[0], F_SETFL, O_NONBLOCK);
+  m_reactor = Reactor::Create(g_reactor_type->getValue());
+  // 提交式IO的后端上socket读写不等待就绪，常驻注册只会带来多余的通知
+  m_persistentEvents =
+      g_persistent_events->getValue() && !m_reactor->supportsAsyncIO();
+  // 唤醒poller用的eventfd，非阻塞
+  m_tickleFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  BIN_ASSERT(m_tickleFd >= 0);
+  // 读事件 + 边缘触发，data为空表示唤醒事件
+  int rt = m_reactor->ctl(EPOLL_CTL_ADD, m_tickleFd, EPOLLIN | EPOLLET,
+                          nullptr);
   BIN_ASSERT(!rt);
-  // 将当前的事件添加到epoll中
-  rt = epoll_ctl(m_epfd, EPOLL_CTL_ADD, m_tickleFds[0], &event);
-  BIN_ASSERT(!rt);
-  contextResize(32); // 默认为个事件信息
-  start();           // 启动IO调度器
+  // 每个工作线程槽位一个eventfd，线程启动前创建好
+  for (size_t i = 0; i < getWorkerCount(); ++i) {
+    Waiter *waiter = new Waiter;
+    waiter->fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    waiter->spinUs = GetSpinMaxUS();
+    BIN_ASSERT(waiter->fd >= 0);
+    m_waiters.emplace_back(waiter);
+  }
+  // 句柄表按RLIMIT_NOFILE预留一级数组，二级块按需分配
+  // 软限制可能在运行中被调高，硬限制允许的范围内多留一些
+  rlim_t limit = FD_TABLE_LIMIT;
+  struct rlimit rl;
+  if (getrlimit(RLIMIT_NOFILE, &rl) == 0) {
+    limit = std::max(rl.rlim_cur, std::min(rl.rlim_max, limit));
+  }
+  m_maxFd = (int)std::min(limit, (rlim_t)FD_TABLE_MAX);
+  m_fdChunkCount = (m_maxFd + FD_CHUNK_SIZE - 1) / FD_CHUNK_SIZE;
+  m_maxFd = m_fdChunkCount * FD_CHUNK_SIZE;
+  m_fdChunks = new std::atomic<FdContext *>[m_fdChunkCount];
+  for (size_t i = 0; i < m_fdChunkCount; ++i) {
+    m_fdChunks[i].store(nullptr, std::memory_order_relaxed);
+  }
+  start(); // 启动IO调度器
 }
 
 IOManager::~IOManager() {
-  stop();                // 停止调度器
-  close(m_epfd);         // 关闭epoll句柄
-  close(m_tickleFds[0]); // 关闭读管道句柄
-  close(m_tickleFds[1]); // 关闭写管道句柄
+  stop();            // 停止调度器
+  m_reactor.reset(); // 关闭IO多路复用后端
+  close(m_tickleFd); // 关闭唤醒poller的eventfd
+  for (auto &i : m_waiters) {
+    close(i->fd);
+  }
   // 删除事件对象分配的空间
   // power: 不使用智能指针的原因：要把空间释放集中到持有调度器的这个线程中
-  for (size_t i = 0; i < m_fdContexts.size(); ++i) {
-    if (m_fdContexts[i]) {
-      delete m_fdContexts[i];
+  for (size_t i = 0; i < m_fdChunkCount; ++i) {
+    FdContext *chunk = m_fdChunks[i].load(std::memory_order_relaxed);
+    if (!chunk) {
+      continue;
     }
+    // 还开着的句柄不再指向这个IOManager，之后的close()不用到这里移除注册
+    for (int j = 0; j < FD_CHUNK_SIZE; ++j) {
+      if (chunk[j].registered) {
+        FdCtx::ptr ctx = FdMgr::GetInstance()->get(chunk[j].fd);
+        if (ctx) {
+          ctx->unbindIOManager(this);
+        }
+      }
+    }
+    delete[] chunk;
   }
+  delete[] m_fdChunks;
   BIN_LOG_DEBUG(g_logger) << "IO调度器析构: ~IOManager";
 }
 
-int IOManager::addEvent(int fd, Event event, std::function<void()> cb) {
-  FdContext *fd_ctx = nullptr;
+int IOManager::addEvent(int fd, Event event, Task cb) {
   // 拿到对应的句柄对象，没有就创建
-  RWMutexType::ReadLock lock(m_mutex);
-  if ((int)m_fdContexts.size() > fd) {
-    fd_ctx = m_fdContexts[fd];
-    lock.unlock();
-  } else { // 事件对象扩容
-    lock.unlock();
-    RWMutexType::WriteLock lock2(m_mutex);
-    BIN_LOG_INFO(g_logger) << "fd不存在并扩容,fd=" << fd;
-    contextResize(fd * 1.5);
-    fd_ctx = m_fdContexts[fd];
+  FdContext *fd_ctx = getFdContext(fd, true);
+  if (BIN_UNLIKELY(!fd_ctx)) {
+    BIN_LOG_ERROR(g_logger) << "addEvent fd=" << fd
+                            << " out of range, max=" << m_maxFd;
+    return -1;
   }
   FdContext::MutexType::Lock lock2(fd_ctx->mutex);
   // 一般情况下，一个句柄不会往上面加相同的事件，之前的事件和要添加的事件是同一种类型的事件
@@ -164,21 +244,25 @@ int IOManager::addEvent(int fd, Event event, std::function<void()> cb) {
         << " fd_ctx.event=" << (EPOLL_EVENTS)fd_ctx->events;
     BIN_ASSERT(!(fd_ctx->events & event));
   }
-  // 判断事件修改还是新增
-  int op = fd_ctx->events ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
-  struct epoll_event ev;
-  // EPOLLET:位掩码//EPOLLET + 原来event + 当前的
-  ev.events = EPOLLET | fd_ctx->events | event;
-  // 回调的时候，通过数据字段(data)拿回在哪个fd_ctx上面触发的
-  ev.data.ptr = fd_ctx;
-  int rt = epoll_ctl(m_epfd, op, fd, &ev); // 将事件添加/修改到epoll，成功返回0
-  if (rt) {
-    BIN_LOG_ERROR(g_logger)
-        << "epoll_ctl(" << m_epfd << ", " << (EpollCtlOp)op << ", " << fd
-        << ", " << (EPOLL_EVENTS)ev.events << "):" << rt << " (" << errno
-        << ") (" << strerror(errno)
-        << ") fd_ctx->events=" << (EPOLL_EVENTS)fd_ctx->events;
-    return -1;
+  // 常驻注册的句柄一直在reactor里，不用修改
+  if (!fd_ctx->registered) {
+    // 判断事件修改还是新增
+    int op = fd_ctx->events ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+    struct epoll_event ev;
+    // EPOLLET:位掩码//EPOLLET + 原来event + 当前的
+    ev.events = EPOLLET | fd_ctx->events | event;
+    // 回调的时候，通过数据字段(data)拿回在哪个fd_ctx上面触发的
+    ev.data.ptr = fd_ctx;
+    // 将事件添加/修改到epoll，成功返回0
+    int rt = m_reactor->ctl(op, fd, ev.events, ev.data.ptr);
+    if (rt) {
+      BIN_LOG_ERROR(g_logger)
+          << m_reactor->getName() << " ctl(" << (EpollCtlOp)op << ", " << fd
+          << ", " << (EPOLL_EVENTS)ev.events << "):" << rt << " (" << errno
+          << ") (" << strerror(errno)
+          << ") fd_ctx->events=" << (EPOLL_EVENTS)fd_ctx->events;
+      return -1;
+    }
   }
   ++m_pendingEventCount;                            // 待处理事件自增
   fd_ctx->events = (Event)(fd_ctx->events | event); // 将句柄上的事件叠加
@@ -196,35 +280,41 @@ int IOManager::addEvent(int fd, Event event, std::function<void()> cb) {
     BIN_ASSERT2(event_ctx.fiber->getState() == Fiber::EXEC,
                 "state=" << event_ctx.fiber->getState());
   }
+  // 注册之前已经就绪了，直接触发
+  if (fd_ctx->ready & event) {
+    fd_ctx->ready = (Event)(fd_ctx->ready & ~event);
+    fd_ctx->triggerEvent(event);
+    --m_pendingEventCount;
+  }
   return 0;
 }
 
 bool IOManager::delEvent(int fd, Event event) {
-  RWMutexType::ReadLock lock(m_mutex);
+  FdContext *fd_ctx = getFdContext(fd, false);
   // 1、句柄对象不存在不用删除
-  if ((int)m_fdContexts.size() <= fd)
+  if (!fd_ctx)
     return false;
-  FdContext *fd_ctx = m_fdContexts[fd];
-  lock.unlock();
   FdContext::MutexType::Lock lock2(fd_ctx->mutex);
   // 2、句柄对象存在，但是句柄上没有对应事件 不用删除
   if (BIN_UNLIKELY(!(fd_ctx->events & event)))
     return false;
   // 3、去掉事件：取反运算 + 与运算 就是去掉该事件event
   Event new_events = (Event)(fd_ctx->events & ~event);
-  // 去掉之后看句柄上还是否有剩余的事件  有就修改epoll 没有了就从epoll删除
-  int op = new_events ? EPOLL_CTL_MOD : EPOLL_CTL_DEL;
-  epoll_event ev;
-  ev.events = EPOLLET | new_events;
-  ev.data.ptr = fd_ctx;
-  // 将事件ev添加/修改到epoll
-  int rt = epoll_ctl(m_epfd, op, fd, &ev);
-  if (rt) {
-    BIN_LOG_ERROR(g_logger)
-        << "epoll_ctl(" << m_epfd << ", " << (EpollCtlOp)op << ", " << fd
-        << ", " << (EPOLL_EVENTS)ev.events << "):" << rt << " (" << errno
-        << ") (" << strerror(errno) << ")";
-    return false;
+  if (!fd_ctx->registered) {
+    // 去掉之后看句柄上还是否有剩余的事件  有就修改epoll 没有了就从epoll删除
+    int op = new_events ? EPOLL_CTL_MOD : EPOLL_CTL_DEL;
+    epoll_event ev;
+    ev.events = EPOLLET | new_events;
+    ev.data.ptr = fd_ctx;
+    // 将事件ev添加/修改到epoll
+    int rt = m_reactor->ctl(op, fd, ev.events, ev.data.ptr);
+    if (rt) {
+      BIN_LOG_ERROR(g_logger)
+          << m_reactor->getName() << " ctl(" << (EpollCtlOp)op << ", " << fd
+          << ", " << (EPOLL_EVENTS)ev.events << "):" << rt << " (" << errno
+          << ") (" << strerror(errno) << ")";
+      return false;
+    }
   }
   --m_pendingEventCount;       // 待处理事件对象自减
   fd_ctx->events = new_events; // 更新句柄上的事件
@@ -235,31 +325,31 @@ bool IOManager::delEvent(int fd, Event event) {
 }
 
 bool IOManager::cancelEvent(int fd, Event event) {
-  RWMutexType::ReadLock lock(m_mutex);
+  FdContext *fd_ctx = getFdContext(fd, false);
   // 1、句柄对象不存在
-  if ((int)m_fdContexts.size() <= fd)
+  if (!fd_ctx)
     return false;
-  FdContext *fd_ctx = m_fdContexts[fd];
-  lock.unlock();
   FdContext::MutexType::Lock lock2(fd_ctx->mutex);
   // 2、句柄对象存在，但是句柄上没有对应事件
   if (BIN_UNLIKELY(!(fd_ctx->events & event)))
     return false;
   // 3、去掉事件：取反运算 + 与运算 就是去掉该事件event
   Event new_events = (Event)(fd_ctx->events & ~event);
-  // 去掉之后看句柄上还是否有剩余的事件  有就修改epoll 没有了就从epoll删除
-  int op = new_events ? EPOLL_CTL_MOD : EPOLL_CTL_DEL;
-  epoll_event epevent;
-  epevent.events = EPOLLET | new_events;
-  epevent.data.ptr = fd_ctx;
-  // 将事件ev添加/修改到epoll
-  int rt = epoll_ctl(m_epfd, op, fd, &epevent);
-  if (rt) {
-    BIN_LOG_ERROR(g_logger)
-        << "epoll_ctl(" << m_epfd << ", " << (EpollCtlOp)op << ", " << fd
-        << ", " << (EPOLL_EVENTS)epevent.events << "):" << rt << " (" << errno
-        << ") (" << strerror(errno) << ")";
-    return false;
+  if (!fd_ctx->registered) {
+    // 去掉之后看句柄上还是否有剩余的事件  有就修改epoll 没有了就从epoll删除
+    int op = new_events ? EPOLL_CTL_MOD : EPOLL_CTL_DEL;
+    epoll_event epevent;
+    epevent.events = EPOLLET | new_events;
+    epevent.data.ptr = fd_ctx;
+    // 将事件ev添加/修改到epoll
+    int rt = m_reactor->ctl(op, fd, epevent.events, epevent.data.ptr);
+    if (rt) {
+      BIN_LOG_ERROR(g_logger)
+          << m_reactor->getName() << " ctl(" << (EpollCtlOp)op << ", " << fd
+          << ", " << (EPOLL_EVENTS)epevent.events << "):" << rt << " ("
+          << errno << ") (" << strerror(errno) << ")";
+      return false;
+    }
   }
   --m_pendingEventCount;
   fd_ctx->triggerEvent(
@@ -268,29 +358,31 @@ bool IOManager::cancelEvent(int fd, Event event) {
 }
 
 bool IOManager::cancelAll(int fd) {
-  RWMutexType::ReadLock lock(m_mutex);
+  // 句柄要关闭了，取消上面进行中的提交式IO
+  m_reactor->closeFd(fd);
+  FdContext *fd_ctx = getFdContext(fd, false);
   // 1、句柄对象不存在不用删除
-  if ((int)m_fdContexts.size() <= fd)
+  if (!fd_ctx)
     return false;
-  FdContext *fd_ctx = m_fdContexts[fd];
-  lock.unlock();
   FdContext::MutexType::Lock lock2(fd_ctx->mutex);
   // 2、句柄对象存在，但是句柄上没有任何事件 不用删除
   if (!fd_ctx->events)
     return false;
-  // 直接从epoll里移除该事件
-  int op = EPOLL_CTL_DEL;
-  epoll_event ev;
-  ev.events = 0;
-  ev.data.ptr = fd_ctx;
-  // 将事件删除到epoll
-  int rt = epoll_ctl(m_epfd, op, fd, &ev);
-  if (rt) {
-    BIN_LOG_ERROR(g_logger)
-        << "epoll_ctl(" << m_epfd << ", " << (EpollCtlOp)op << ", " << fd
-        << ", " << (EPOLL_EVENTS)ev.events << "):" << rt << " (" << errno
-        << ") (" << strerror(errno) << ")";
-    return false;
+  // 直接从epoll里移除该事件，常驻注册的由deregisterFd()移除
+  if (!fd_ctx->registered) {
+    int op = EPOLL_CTL_DEL;
+    epoll_event ev;
+    ev.events = 0;
+    ev.data.ptr = fd_ctx;
+    // 将事件删除到epoll
+    int rt = m_reactor->ctl(op, fd, ev.events, ev.data.ptr);
+    if (rt) {
+      BIN_LOG_ERROR(g_logger)
+          << m_reactor->getName() << " ctl(" << (EpollCtlOp)op << ", " << fd
+          << ", " << (EPOLL_EVENTS)ev.events << "):" << rt << " (" << errno
+          << ") (" << strerror(errno) << ")";
+      return false;
+    }
   }
   if (fd_ctx->events & READ) {
     fd_ctx->triggerEvent(READ); // 事件对象 主动触发读事件对象上的回调
@@ -304,6 +396,196 @@ bool IOManager::cancelAll(int fd) {
   return true;
 }
 
+// IO超时允许推迟超时时间的1/16，大量相近的读写超时合并成一次唤醒
+static uint64_t TimeoutSlack(uint64_t timeout_ms) {
+  return std::min<uint64_t>(timeout_ms / 16, g_timeout_slack->getValue());
+}
+
+static void OnEventTimeout(TimerNode *node) {
+  IOManager::EventTimeout *t = static_cast<IOManager::EventTimeout *>(node);
+  // 事件已经触发过就不算超时
+  t->timedout = t->iom->cancelEvent(t->fd, t->event);
+}
+
+int IOManager::waitEvent(int fd, Event event, uint64_t timeout_ms) {
+  if (addEvent(fd, event)) {
+    return -1;
+  }
+  if (timeout_ms == ~0ull) {
+    Fiber::YieldToHold();
+    return 0;
+  }
+  // 事件等待期间只有当前协程会使用这个定时器，cancel()返回后可以安全复用
+  EventTimeout &timeout = getFdContext(fd, false)->getContext(event).timeout;
+  timeout.iom = this;
+  timeout.fd = fd;
+  timeout.event = event;
+  timeout.timedout = false;
+  addTimer(timeout, timeout_ms, &OnEventTimeout, TimeoutSlack(timeout_ms));
+  Fiber::YieldToHold();
+  timeout.cancel();
+  return timeout.timedout ? ETIMEDOUT : 0;
+}
+
+bool IOManager::registerFd(int fd) {
+  if (!m_persistentEvents) {
+    return false;
+  }
+  FdContext *fd_ctx = getFdContext(fd, true);
+  if (!fd_ctx) {
+    return false;
+  }
+  FdContext::MutexType::Lock lock2(fd_ctx->mutex);
+  if (fd_ctx->registered) {
+    return true;
+  }
+  int op = fd_ctx->events ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+  uint32_t events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+  int rt = m_reactor->ctl(op, fd, events, fd_ctx);
+  if (rt) {
+    BIN_LOG_ERROR(g_logger)
+        << m_reactor->getName() << " ctl(" << (EpollCtlOp)op << ", " << fd
+        << ", " << (EPOLL_EVENTS)events << "):" << rt << " (" << errno
+        << ") (" << strerror(errno) << ")";
+    return false;
+  }
+  fd_ctx->registered = true;
+  fd_ctx->ready = NONE;
+  return true;
+}
+
+void IOManager::deregisterFd(int fd) {
+  FdContext *fd_ctx = getFdContext(fd, false);
+  if (!fd_ctx) {
+    return;
+  }
+  FdContext::MutexType::Lock lock2(fd_ctx->mutex);
+  if (!fd_ctx->registered) {
+    return;
+  }
+  fd_ctx->registered = false;
+  fd_ctx->ready = NONE;
+  // 还有等待者时退回到普通注册
+  int op = fd_ctx->events ? EPOLL_CTL_MOD : EPOLL_CTL_DEL;
+  uint32_t events = EPOLLET | fd_ctx->events;
+  int rt = m_reactor->ctl(op, fd, events, fd_ctx);
+  if (rt) {
+    BIN_LOG_ERROR(g_logger)
+        << m_reactor->getName() << " ctl(" << (EpollCtlOp)op << ", " << fd
+        << ", " << (EPOLL_EVENTS)events << "):" << rt << " (" << errno
+        << ") (" << strerror(errno) << ")";
+  }
+}
+
+bool IOManager::consumeReady(int fd, Event event) {
+  FdContext *fd_ctx = getFdContext(fd, false);
+  if (!fd_ctx) {
+    return false;
+  }
+  FdContext::MutexType::Lock lock2(fd_ctx->mutex);
+  if (!fd_ctx->registered || !(fd_ctx->ready & event)) {
+    return false;
+  }
+  fd_ctx->ready = (Event)(fd_ctx->ready & ~event);
+  return true;
+}
+
+/**
+ * @brief 提交式IO的等待状态，放在提交协程的栈上，提交IO不分配内存
+ * @details 超时定时器是嵌在里面的TimerNode。完成和超时可能在不同线程同时发生，
+ *  由mutex保证只有一方唤醒协程；唤醒方在锁里把协程取出来，解锁后才调度，
+ *  协程恢复时完成方已经不再访问等待对象。协程恢复后调用TimerNode::cancel()，
+ *  它会等正在执行的超时回调返回，之后等待对象才能随栈帧释放
+ */
+struct AsyncIOWait : public TimerNode {
+  typedef Mutex MutexType;
+  MutexType mutex;
+  IOManager *iom = nullptr;
+  IORequest *req = nullptr;
+  Scheduler *scheduler = nullptr;
+  Fiber::ptr fiber;
+  bool done = false;     // 已经唤醒过协程
+  bool timedout = false; // 因为超时取消
+};
+
+bool IOManager::submitIO(IORequest &req, uint64_t timeout_ms) {
+  Fiber::ptr fiber = Fiber::GetThis();
+  if (!m_reactor->supportsAsyncIO() || fiber->isSharedStack()) {
+    return false;
+  }
+  // 共享栈协程已经排除，挂起期间栈上的等待对象地址不变
+  AsyncIOWait wait;
+  wait.iom = this;
+  wait.req = &req;
+  wait.scheduler = Scheduler::GetThis();
+  wait.fiber = fiber;
+  fiber.reset();
+  req.data = &wait;
+  ++m_pendingEventCount;
+  int rt = m_reactor->submit(&req);
+  if (rt <= 0) {
+    --m_pendingEventCount;
+    return rt == 0;
+  }
+  if (timeout_ms != ~0ull) {
+    addTimer(wait, timeout_ms, &IOManager::OnSubmitTimeout,
+             TimeoutSlack(timeout_ms));
+  }
+  Fiber::YieldToHold();
+  if (timeout_ms != ~0ull) {
+    wait.cancel();
+  }
+  if (wait.timedout && req.result == -ECANCELED) {
+    req.result = -ETIMEDOUT;
+  }
+  return true;
+}
+
+void IOManager::OnSubmitTimeout(TimerNode *node) {
+  AsyncIOWait *w = static_cast<AsyncIOWait *>(node);
+  Scheduler *scheduler = nullptr;
+  Fiber::ptr fiber;
+  {
+    AsyncIOWait::MutexType::Lock lock(w->mutex);
+    if (w->done) {
+      return;
+    }
+    w->timedout = true;
+    // 同步取消成功就在这里唤醒，否则等取消后的完成事件
+    if (!w->iom->m_reactor->cancel(w->req)) {
+      return;
+    }
+    w->done = true;
+    --w->iom->m_pendingEventCount;
+    scheduler = w->scheduler;
+    fiber.swap(w->fiber);
+  }
+  scheduler->schedule(&fiber);
+}
+
+void IOManager::completeIO(IORequest *req,
+                           std::vector<FiberAndThread> *batch) {
+  AsyncIOWait *wait = (AsyncIOWait *)req->data;
+  Scheduler *scheduler = nullptr;
+  Fiber::ptr fiber;
+  {
+    AsyncIOWait::MutexType::Lock lock(wait->mutex);
+    if (wait->done) {
+      return;
+    }
+    wait->done = true;
+    --m_pendingEventCount;
+    scheduler = wait->scheduler;
+    fiber.swap(wait->fiber);
+  }
+  // 解锁之后wait可能已经随协程的栈帧释放，不能再访问
+  if (batch && scheduler == this) {
+    batch->emplace_back(&fiber, -1);
+  } else {
+    scheduler->schedule(&fiber);
+  }
+}
+
 // power: 基类的指针Scheduler*转换成派生类的指针
 IOManager *IOManager::GetThis() {
   return dynamic_cast<IOManager *>(Scheduler::GetThis());
@@ -321,19 +603,107 @@ IOManager *IOManager::GetThis() {
    run()在轮询任务队列的时候，发现有任务不属于自己执行，并且也没有指定任何线程执行的时候要调用tickle()去唤醒线程执行这些任务
     ● stop()准备关闭调度器时候，要把所有创建的线程唤醒，去让他们退出
 */
-void IOManager::tickle() {
-  BIN_LOG_INFO(g_logger) << "tickle()";
-  if (!hasIdleThreads()) {
+void IOManager::tickle(int thread) {
+  BIN_LOG_DEBUG(g_logger) << "tickle() thread=" << thread;
+  if (thread != -1) {
+    int index = getWorkerIndex(thread);
+    if (index >= 0) {
+      Waiter &waiter = *m_waiters[index];
+      int state = waiter.state;
+      if (state == Waiter::PARKED) {
+        wake(waiter);
+      } else if (state == Waiter::POLLING) {
+        wakePoller();
+      }
+      return;
+    }
+  }
+  // 正在找任务的线程会取走新任务，或者在进入等待前发现它
+  if (m_spinningCount > 0) {
     return;
   }
-  int rt = write(m_tickleFds[1], "T", 1); // 写1个 T 进去
-  BIN_ASSERT(rt == 1);
+  for (auto &i : m_waiters) {
+    if (i->state == Waiter::PARKED && wake(*i)) {
+      return;
+    }
+  }
+  if (m_poller != -1) {
+    wakePoller();
+  }
+}
+
+bool IOManager::wake(Waiter &waiter) {
+  int expected = Waiter::PARKED;
+  if (!waiter.state.compare_exchange_strong(expected, Waiter::RUNNING)) {
+    return false;
+  }
+  uint64_t one = 1;
+  // eventfd不经过hook，省掉判断句柄类型
+  int rt = write_f(waiter.fd, &one, sizeof(one));
+  BIN_ASSERT(rt == sizeof(one));
+  ++m_idleWakeups;
+  return true;
 }
 
+void IOManager::wakePoller() {
+  // poller醒来前只需要写一次
+  if (m_pollerTickled.exchange(true)) {
+    return;
+  }
+  uint64_t one = 1;
+  int rt = write_f(m_tickleFd, &one, sizeof(one));
+  BIN_ASSERT(rt == sizeof(one));
+  ++m_idleWakeups;
+}
+
+bool IOManager::spinForWork(Waiter &waiter, uint64_t timeout_us,
+                            Reactor::Event *evts, int max_events, int *rt) {
+  uint64_t budget = std::min<uint64_t>(waiter.spinUs, timeout_us);
+  if (budget == 0) {
+    return false;
+  }
+  ++m_spinningCount;
+  uint64_t deadline = GetMonotonicUS() + budget;
+  bool hit = false;
+  do {
+    if (hasPendingTasks()) {
+      hit = true;
+      break;
+    }
+    if (evts) {
+      int n = m_reactor->wait(evts, max_events, 0);
+      if (n > 0) {
+        *rt = n;
+        hit = true;
+        break;
+      }
+    }
+    CpuRelax();
+  } while (GetMonotonicUS() < deadline);
+  // 之后发布PARKED/POLLING再检查一次队列，这之间入队的任务不会丢
+  --m_spinningCount;
+  if (hit) {
+    ++m_spinHits;
+    waiter.spinUs = std::min<uint64_t>(GetSpinMaxUS(), waiter.spinUs * 2);
+  } else {
+    ++m_spinMisses;
+    waiter.spinUs /= 2;
+  }
+  return hit;
+}
+
+void IOManager::learnSpin(Waiter &waiter, bool woken, uint64_t blocked_us) {
+  uint32_t max_us = GetSpinMaxUS();
+  if (woken && blocked_us < max_us) {
+    waiter.spinUs = std::min(max_us, std::max(waiter.spinUs * 2, max_us / 8));
+  } else if (waiter.spinUs > max_us) {
+    waiter.spinUs = max_us; // 配置调小了
+  }
+}
+
+// 基类stopping() + 多判断一下待处理事件数量m_pendingEventCount和是否还有定时器
 bool IOManager::stopping() {
-  // 没给缺省参数值，因为这个override了基类函数
-  uint64_t timeout = 0;
-  return stopping(timeout);
+  return !hasTimer() && (m_pendingEventCount == 0) && Scheduler::stopping();
 }
 
 /*功能：
@@ -358,62 +728,190 @@ while(1){
 */
 void IOManager::idle() {
   BIN_LOG_DEBUG(g_logger) << "IOManager::idle()";
-  const uint64_t MAX_EVNETS = 256;
-  epoll_event *evts =
-      new epoll_event[MAX_EVNETS](); // 256个一组 取出已经就绪的IO
+  const int MAX_EVNETS = std::max(1, (int)g_max_events->getValue());
+  Reactor::Event *evts =
+      new Reactor::Event[MAX_EVNETS](); // 一次最多取出MAX_EVNETS个就绪的IO
   // power: 借助智能指针的指定析构函数  自动释放数组
-  std::shared_ptr<epoll_event> shared_events(
-      evts, [](epoll_event *ptr) { delete[] ptr; });
+  std::shared_ptr<Reactor::Event> shared_events(
+      evts, [](Reactor::Event *ptr) { delete[] ptr; });
+  static const uint64_t MAX_TIMEOUT = 3000 * 1000; // 最大超时时间(微秒)
+  int index = GetWorkerIndex();
+  Waiter *waiter =
+      index >= 0 && index < (int)m_waiters.size() ? m_waiters[index].get()
+                                                  : nullptr;
+  // 一轮就绪的协程/回调先收集起来，处理完一次入队，最多唤醒一次
+  std::vector<FiberAndThread> batch;
+  batch.reserve(MAX_EVNETS);
   while (true) {
-    uint64_t next_timeout = 0;
     // 1.如果调度器关闭了 就退出该函数
-    if (BIN_UNLIKELY(stopping(next_timeout))) {
+    if (BIN_UNLIKELY(stopping())) {
       BIN_LOG_INFO(g_logger) << "name=" << getName() << ", idle stopping exit";
+      ClearLoopTime();
       break;
     }
-    // 2.通过epoll_wait 带回已经就绪的IO
+    // 空闲太久要退出的线程不再等待，退出的线程不在PARKED，它的时间轮交给poller
+    if (BIN_UNLIKELY(retiring())) {
+      BIN_LOG_INFO(g_logger) << "name=" << getName() << ", idle retire exit";
+      ClearLoopTime();
+      break;
+    }
+    // 每轮读一次单调时钟，这一轮里的定时器和超时都用这个时间
+    UpdateLoopTime();
+    // 已经有线程在epoll_wait，在自己的eventfd上等待定向唤醒
+    int expected = -1;
+    if (waiter && !m_poller.compare_exchange_strong(expected, index)) {
+      // 任务马上就来的话，自旋等到它比睡下去再被eventfd唤醒便宜
+      uint64_t spin_timeout =
+          std::min(getNextTimerUS(index + 1), MAX_TIMEOUT);
+      bool spun = spinForWork(*waiter, spin_timeout, nullptr, 0, nullptr);
+      if (!spun) {
+        waiter->state = Waiter::PARKED;
+      }
+      // 发布PARKED之后再检查一次：tickle()看到的如果还是RUNNING就不会唤醒我们；
+      // poller刚退出时也不能睡，要回去接替它
+      // 超时只看自己的时间轮，也在发布PARKED之后取，之后插入的更早的定时器会唤醒我们
+      // 可以空闲退出的线程到时间醒来，由run()决定是否退出
+      if (!spun && !hasPendingTasks() && m_poller != -1) {
+        uint64_t timeout = std::min(
+            {getNextTimerUS(index + 1), MAX_TIMEOUT, getIdleRetireUS()});
+        if (timeout != 0) {
+          pollfd pfd;
+          pfd.fd = waiter->fd;
+          pfd.events = POLLIN;
+          pfd.revents = 0;
+          // ppoll的超时精确到微秒，不到1ms的定时器不会提前醒来空转
+          timespec ts;
+          ts.tv_sec = timeout / 1000000;
+          ts.tv_nsec = timeout % 1000000 * 1000;
+          uint64_t begin = GetMonotonicUS();
+          int woken = ppoll(&pfd, 1, &ts, nullptr);
+          UpdateLoopTime();
+          learnSpin(*waiter, woken > 0, GetLoopUS() - begin);
+        }
+      }
+      expected = Waiter::PARKED;
+      waiter->state.compare_exchange_strong(expected, Waiter::RUNNING);
+      uint64_t dummy;
+      while (read_f(waiter->fd, &dummy, sizeof(dummy)) > 0)
+        ;
+      // 自己时间轮上到期的定时器放进自己的队列
+      ++m_activeThreadCount;
+      std::vector<Task> cbs;
+      countTimerWakeup(listExpiredCb(index + 1, cbs));
+      for (auto &i : cbs) {
+        batch.emplace_back(&i, -1);
+      }
+      if (!batch.empty()) {
+        scheduleBatch(batch);
+      }
+      --m_activeThreadCount;
+      Fiber::GetThisRaw()->swapOut();
+      continue;
+    }
+    if (waiter) {
+      waiter->state = Waiter::POLLING;
+    }
+    m_pollerTickled = false;
+    // poller负责的时间轮里最近的定时器(微秒)
+    uint64_t next_timeout = std::min(MAX_TIMEOUT, getIdleRetireUS());
+    for (size_t i = 0; i < getTimerWheelCount(); ++i) {
+      if (pollerOwnsTimers(index, i)) {
+        next_timeout = std::min(next_timeout, getNextTimerUS(i));
+      }
+    }
+    // 2.通过reactor 带回已经就绪的IO
     int rt = 0;
+    // 先自旋，可选地同时以超时0轮询reactor
+    bool spun = waiter && next_timeout != 0 && !hasPendingTasks() &&
+                spinForWork(*waiter, next_timeout,
+                            g_spin_poll_reactor->getValue() ? evts : nullptr,
+                            MAX_EVNETS, &rt);
+    uint64_t begin = GetMonotonicUS();
     do {
-      static const int MAX_TIMEOUT = 3000; // 最大超时时间
-      if (next_timeout != ~0ull) {
-        next_timeout =
-            (int)next_timeout > MAX_TIMEOUT ? MAX_TIMEOUT : next_timeout;
-      } else {
-        next_timeout = MAX_TIMEOUT;
+      if (spun) {
+        break;
+      }
+      // 发布POLLING之前入队的pinned任务不会唤醒我们，只收集就绪事件不阻塞
+      if (hasPendingTasks()) {
+        next_timeout = 0;
       }
-      rt = epoll_wait(m_epfd, evts, MAX_EVNETS, (int)next_timeout);
+      rt = m_reactor->wait(evts, MAX_EVNETS, next_timeout);
       if (rt < 0 && errno == EINTR) {
         continue; // 重新尝试等待wait
       } else {
         break; // 拿到了返回epoll_event(rt>0) 或者 已经超时(rt=0)就break
       }
     } while (true);
-    // 获取需要执行的定时器的回调函数列表，加入调度器
-    std::vector<std::function<void()>> cbs;
-    listExpiredCb(cbs);
-    if (!cbs.empty()) {
-      // BIN_LOG_DEBUG(g_logger) << "on timer cbs.size=" << cbs.size();
-      schedule(cbs.begin(), cbs.end());
-      cbs.clear();
+    if (waiter) {
+      waiter->state = Waiter::RUNNING;
+      m_poller = -1;
+    }
+    UpdateLoopTime();
+    if (waiter && !spun && next_timeout != 0) {
+      learnSpin(*waiter, rt > 0, GetLoopUS() - begin);
+    }
+    // 取出定时器/就绪事件到加入队列之间算作活跃，其他线程的stopping()
+    // 不会在这个窗口里看到"没有定时器也没有任务"而提前退出
+    ++m_activeThreadCount;
+    // 获取需要执行的定时器的回调函数列表，和就绪IO一起入队
+    // 各时间轮这一轮到期的定时器算作一次唤醒
+    std::vector<Task> cbs;
+    size_t fired = 0;
+    for (size_t i = 0; i < getTimerWheelCount(); ++i) {
+      if (pollerOwnsTimers(index, i)) {
+        fired += listExpiredCb(i, cbs);
+      }
     }
+    countTimerWakeup(fired);
+    for (auto &i : cbs) {
+      batch.emplace_back(&i, -1);
+    }
+    cbs.clear();
     // if(BIN_UNLIKELY(rt == MAX_EVNETS)){
     //     BIN_LOG_INFO(g_logger) << "epoll wait events=" << rt;
     // }
-    // 3.依次处理已经就绪的IO
+    // 3.依次处理已经就绪的IO，这一轮对reactor的修改合并提交
+    m_reactor->beginBatch();
     for (int i = 0; i < rt; ++i) {
-      epoll_event &ev = evts[i];
+      Reactor::Event &ev = evts[i];
+      // 提交式IO完成
+      if (ev.request) {
+        completeIO(ev.request, &batch);
+        continue;
+      }
       // 外部发消息唤醒的IO，没有实际意义，过滤跳过
-      if (ev.data.fd == m_tickleFds[0]) {
-        uint8_t dummy[256];
-        // 循环的目的，把缓冲区全部读干净，EPOLLET类型不读干净不会再通知
-        while (read(m_tickleFds[0], dummy, sizeof(dummy)) > 0)
+      if (!ev.data) {
+        uint64_t dummy;
+        // eventfd读一次就清零
+        while (read_f(m_tickleFd, &dummy, sizeof(dummy)) > 0)
           ;
         continue;
       }
       // 处理剩下的真正就绪的IO
       // addEvent()的时候把FdContext* fd_ctx添加给data.ptr了
-      FdContext *fd_ctx = (FdContext *)ev.data.ptr;
+      FdContext *fd_ctx = (FdContext *)ev.data;
       FdContext::MutexType::Lock lock(fd_ctx->mutex);
+      // 常驻注册：有等待者就触发，没有就记下就绪状态，reactor不用修改
+      if (fd_ctx->registered) {
+        int ready = NONE;
+        if (ev.events & (EPOLLIN | EPOLLRDHUP | EPOLLERR | EPOLLHUP)) {
+          ready |= READ;
+        }
+        if (ev.events & (EPOLLOUT | EPOLLERR | EPOLLHUP)) {
+          ready |= WRITE;
+        }
+        int trigger = fd_ctx->events & ready;
+        fd_ctx->ready = (Event)((fd_ctx->ready | ready) & ~trigger);
+        if (trigger & READ) {
+          fd_ctx->triggerEvent(READ, &batch);
+          --m_pendingEventCount;
+        }
+        if (trigger & WRITE) {
+          fd_ctx->triggerEvent(WRITE, &batch);
+          --m_pendingEventCount;
+        }
+        continue;
+      }
       // 事件是epoll_event事件，要分类
       // 如果是错误或者中断 导致的活动  重置一下
       if (ev.events & (EPOLLERR | EPOLLHUP)) {
@@ -440,10 +938,10 @@ void IOManager::idle() {
                            : EPOLL_CTL_DEL; // 有事件：修改 无事件：删除
       ev.events =
           EPOLLET | left_events; // 复用event，ET模式 + 剩余事件后添加到epoll中
-      int rt2 = epoll_ctl(m_epfd, op, fd_ctx->fd, &ev);
+      int rt2 = m_reactor->ctl(op, fd_ctx->fd, ev.events, fd_ctx);
       if (rt2) {
         BIN_LOG_ERROR(g_logger)
-            << "epoll_ctl(" << m_epfd << ", " << (EpollCtlOp)op << ", "
+            << m_reactor->getName() << " ctl(" << (EpollCtlOp)op << ", "
             << fd_ctx->fd << ", " << (EPOLL_EVENTS)ev.events << "):" << rt2
             << " (" << errno << ") (" << strerror(errno) << ")";
         continue;
@@ -454,45 +952,87 @@ void IOManager::idle() {
       // 把剩余没有触发的读写事件 主动触发
       if (real_events & READ) {
         BIN_LOG_INFO(g_logger) << "idle 读事件触发";
-        fd_ctx->triggerEvent(READ);
+        fd_ctx->triggerEvent(READ, &batch);
         --m_pendingEventCount;
       }
       if (real_events & WRITE) {
         BIN_LOG_INFO(g_logger) << "idle 写事件触发";
-        fd_ctx->triggerEvent(WRITE);
+        fd_ctx->triggerEvent(WRITE, &batch);
         --m_pendingEventCount;
       }
     }
+    m_reactor->endBatch();
+    if (!batch.empty()) {
+      scheduleBatch(batch);
+    }
+    --m_activeThreadCount;
+    // 自己要去执行任务了，唤醒一个等待的线程接替epoll_wait
+    if (waiter && hasPendingTasks()) {
+      for (auto &i : m_waiters) {
+        if (i->state == Waiter::PARKED && wake(*i)) {
+          break;
+        }
+      }
+    }
     // 4.处理完就绪的IO  让出当前协程的执行权 到Scheduler::run中去
-    Fiber::ptr cur = Fiber::GetThis();
-    auto raw_ptr = cur.get();
-    cur.reset();
-    raw_ptr->swapOut();
+    Fiber::GetThisRaw()->swapOut();
   }
 }
 
-void IOManager::onTimerInsertedAtFront() {
+void IOManager::onTimerInsertedAtFront(size_t wheel) {
+  // 时间轮所属线程在自己的eventfd上等待，唤醒它重新计算超时
+  int index = (int)wheel - 1;
+  if (index >= 0 && index < (int)m_waiters.size() &&
+      m_waiters[index]->state == Waiter::PARKED && wake(*m_waiters[index])) {
+    return;
+  }
   // 定时器队列队头插入对象后进行epoll_wait超时更新
-  tickle(); // 唤醒一下 在epoll_wait的线程
+  if (m_poller != -1) {
+    wakePoller(); // 唤醒一下 在epoll_wait的线程
+  } else {
+    tickle(); // 没有线程在epoll_wait，让一个空闲线程去接替
+  }
 }
 
-void IOManager::contextResize(size_t size) {
-  // 保护类型接口，修改句柄对象数量
-  m_fdContexts.resize(size);
-  for (size_t i = 0; i < m_fdContexts.size(); ++i) {
-    if (!m_fdContexts[i]) {
-      m_fdContexts[i] = new FdContext;
-      m_fdContexts[i]->fd = i;
-    }
+size_t IOManager::getTimerWheel() {
+  if (Scheduler::GetThis() != this) {
+    return 0;
   }
+  return GetWorkerIndex() + 1;
 }
 
-// 基类stopping() +
-// 多判断一下待处理事件数量m_pendingEventCount和定时器队列是否空isTimersEmpty()
-bool IOManager::stopping(uint64_t &timeout) {
-  timeout = getNextTimer();
-  return (timeout == ~0ull) && (m_pendingEventCount == 0) &&
-         Scheduler::stopping();
+bool IOManager::pollerOwnsTimers(int index, size_t wheel) {
+  if (wheel == 0 || (int)wheel == index + 1) {
+    return true;
+  }
+  return m_waiters[wheel - 1]->state != Waiter::PARKED;
+}
+
+IOManager::FdContext *IOManager::getFdContext(int fd, bool auto_create) {
+  if (BIN_UNLIKELY(fd < 0 || fd >= m_maxFd)) {
+    return nullptr;
+  }
+  std::atomic<FdContext *> &slot = m_fdChunks[fd / FD_CHUNK_SIZE];
+  FdContext *chunk = slot.load(std::memory_order_acquire);
+  if (BIN_UNLIKELY(!chunk)) {
+    if (!auto_create) {
+      return nullptr;
+    }
+    // 多个线程同时分配同一块时只有一个能装上，其余的释放掉自己的
+    FdContext *fresh = new FdContext[FD_CHUNK_SIZE];
+    int base = fd - fd % FD_CHUNK_SIZE;
+    for (int i = 0; i < FD_CHUNK_SIZE; ++i) {
+      fresh[i].fd = base + i;
+    }
+    if (slot.compare_exchange_strong(chunk, fresh, std::memory_order_acq_rel,
+                                     std::memory_order_acquire)) {
+      chunk = fresh;
+    } else {
+      delete[] fresh;
+    }
+  }
+  return &chunk[fd % FD_CHUNK_SIZE];
 }
 
+
 } // namespace bin
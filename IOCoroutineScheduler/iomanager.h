@@ -1,7 +1,7 @@
 /**
  * @file iomanager.h
  * @author yinyb (990900296@qq.com)
- * @brief 基于Epoll的IO协程调度器
+ * @brief IO协程调度器，IO多路复用后端见reactor.h
  *  封装套接字句柄对象+事件对象,方便归纳句柄、事件所具有的属性。句柄带有事件，事件依附
  *  于句柄。只有句柄上才有事件触发。
  *  和HOOK模块的文件句柄类做一个区分，这里的套接字句柄专门针对套接字上的事件做回调管理。
@@ -13,12 +13,13 @@
 #ifndef __BIN_IOMANAGER_H__
 #define __BIN_IOMANAGER_H__
 
+#include "reactor.h"
 #include "scheduler.h"
 #include "timer.h"
 
 namespace bin {
 
-// 基于Epoll的IO协程调度器
+// IO协程调度器
 class IOManager : public Scheduler, public TimerManager {
 public:
   typedef std::shared_ptr<IOManager> ptr;
@@ -33,6 +34,16 @@ public:
     WRITE = 0x4, // 写事件(EPOLLOUT)
   };
 
+  /**
+   * @brief waitEvent()的超时定时器，嵌在事件上下文里，设置超时不分配内存
+   */
+  struct EventTimeout : public TimerNode {
+    IOManager *iom = nullptr;
+    int fd = -1;
+    Event event = NONE;
+    bool timedout = false; // 超时取消了事件
+  };
+
   /**
    * @brief 句柄对象结构体, Socket事件上线文类
    */
@@ -46,7 +57,8 @@ public:
       // 执行事件的调度器。支持多线程、多协程、多个协程调度器，指定which
       Scheduler *scheduler = nullptr;
       Fiber::ptr fiber;         // 事件绑定的协程
-      std::function<void()> cb; // 事件的绑定回调函数
+      Task cb;                  // 事件的绑定回调函数
+      EventTimeout timeout;     // waitEvent()的超时定时器
     };
 
     // 根据event类型获取句柄对象上对应的事件对象
@@ -54,13 +66,17 @@ public:
     // 清空句柄对象(ctx)上的事件对象
     void resetContext(EventContext &ctx);
     // 主动触发事件(event)，执行事件对象上的回调函数
-    void triggerEvent(Event event);
+    // batch不为空且事件属于当前调度器时先收集到batch，由调用者批量入队
+    void triggerEvent(Event event,
+                      std::vector<FiberAndThread> *batch = nullptr);
 
     int fd = 0;          // 事件关联的句柄//句柄/文件描述符
     Event events = NONE; // 当前的事件//句柄上注册好的事件
     EventContext read;   // 读事件上下文//句柄上的读事件对象
     EventContext write;  // 写事件上下文//句柄上的写事件对象
-    MutexType mutex;     // 事件的Mutex
+    bool registered = false; // 常驻注册在reactor中，等待事件不再修改reactor
+    Event ready = NONE; // 常驻注册时缓存的就绪状态，没有等待者时记下来
+    MutexType mutex;    // 事件的Mutex
   };
 
 public:
@@ -69,9 +85,15 @@ public:
    * @param threads_size 线程数量
    * @param use_caller 是否将调用线程包含进去
    * @param name 调度器的名称
+   * @param max_threads 最多的线程数量，大于threads_size时线程数随负载伸缩，
+   *  见Scheduler
+   * @param cpus 工作线程绑定的CPU，创建时就绑定，见Scheduler
+   * @param pin_each 是否每个线程只绑定一个CPU
    */
   IOManager(size_t threads_size = 1, bool use_caller = true,
-            const std::string &name = "");
+            const std::string &name = "", size_t max_threads = 0,
+            const std::vector<int> &cpus = std::vector<int>(),
+            bool pin_each = true);
   ~IOManager();
 
   /**
@@ -81,7 +103,7 @@ public:
    * @param cb callback function
    * @return 0成功,-1失败
    */
-  int addEvent(int fd, Event event, std::function<void()> cb = nullptr);
+  int addEvent(int fd, Event event, Task cb = nullptr);
   /**
    * @brief 删除事件，不会触发事件
    * @param fd socket句柄，给fd这个句柄删除事件
@@ -103,6 +125,64 @@ public:
    */
   bool cancelAll(int fd);
 
+  /**
+   * @brief 添加事件并挂起当前协程，直到事件触发、被取消或者超时
+   * @details 超时定时器嵌在句柄上下文里，整个过程不分配内存
+   * @param timeout_ms 超时时间(毫秒)，~0ull不超时
+   * @return 0 事件触发或被取消；ETIMEDOUT 超时；-1 添加事件失败
+   */
+  int waitEvent(int fd, Event event, uint64_t timeout_ms = ~0ull);
+
+  /**
+   * @brief 常驻注册句柄(EPOLLIN|EPOLLOUT|EPOLLET)
+   * @details 之后addEvent()/delEvent()只修改FdContext，不再修改reactor，
+   *  没有等待者时的就绪通知缓存在FdContext::ready中。
+   *  只对就绪通知型的后端生效，配置项iomanager.persistent_events可以关闭。
+   *  hook在句柄第一次等待事件时注册，注册所在的IOManager记在FdCtx里
+   * @return 是否已经常驻注册
+   */
+  bool registerFd(int fd);
+
+  /**
+   * @brief 移除常驻注册，句柄关闭前在注册所在的IOManager上调用
+   */
+  void deregisterFd(int fd);
+
+  /**
+   * @brief 取走缓存的就绪状态
+   * @return true 常驻注册的句柄在上次IO之后又收到了就绪通知，应该直接重试IO
+   */
+  bool consumeReady(int fd, Event event);
+
+  /**
+   * @brief IO多路复用后端的名称
+   */
+  const char *getReactorName() const { return m_reactor->getName(); }
+
+  /**
+   * @brief 空闲线程阻塞前自旋等到任务的次数
+   */
+  uint64_t getSpinHits() const { return m_spinHits; }
+
+  /**
+   * @brief 空闲线程自旋完预算仍然没有任务、只好阻塞的次数
+   */
+  uint64_t getSpinMisses() const { return m_spinMisses; }
+
+  /**
+   * @brief 后端是否支持提交式IO
+   */
+  bool supportsAsyncIO() const { return m_reactor->supportsAsyncIO(); }
+
+  /**
+   * @brief 提交IO请求，挂起当前协程直到完成
+   * @details 共享栈协程挂起时栈上的缓冲区会被别的协程覆盖，不走提交式IO
+   * @param req IO请求，完成后结果在req.result
+   * @param timeout_ms 超时时间，超时后取消请求，结果为-ETIMEDOUT
+   * @return false 不支持，调用方回退到就绪通知的方式
+   */
+  bool submitIO(IORequest &req, uint64_t timeout_ms = ~0ull);
+
   /**
    * @brief 返回当前的IOManager
    * @return IOManager*
@@ -110,30 +190,120 @@ public:
   static IOManager *GetThis();
 
 protected:
-  void tickle() override;
+  /**
+   * @brief 定向唤醒一个线程
+   * @details 指定了线程时：目标线程在自己的eventfd上等待就写它的eventfd，
+   *  正在epoll_wait就写m_tickleFd，在运行中就什么都不做(进入等待前它会检查pinned队列)。
+   *  没有指定线程时：有线程正在找任务就不唤醒，否则唤醒一个等待中的线程，
+   *  都没有在等待时唤醒epoll_wait的线程。
+   */
+  void tickle(int thread = -1) override;
   bool stopping() override;
   void idle() override;
 
-  void onTimerInsertedAtFront() override;
+  /**
+   * @brief 时间轮插入了更早的定时器
+   * @details 时间轮所属线程在自己的eventfd上等待就唤醒它，否则唤醒poller
+   */
+  void onTimerInsertedAtFront(size_t wheel) override;
+  /**
+   * @brief 工作线程使用自己的时间轮(下标+1)，外部线程使用第0个
+   */
+  size_t getTimerWheel() override;
+
+  /**
+   * @brief 取句柄上下文，不加锁
+   * @param auto_create 所在的块还没分配时是否分配
+   * @return fd超出句柄表范围或者未分配时返回nullptr
+   */
+  FdContext *getFdContext(int fd, bool auto_create);
+
+private:
+  /**
+   * @brief 工作线程的等待状态
+   * @details 同一时刻只有一个线程(poller)在epoll_wait，其余空闲线程在各自的eventfd上
+   *  等待，只会被定向唤醒，不会一次任务唤醒所有线程。
+   */
+  struct Waiter {
+    enum State {
+      RUNNING = 0, // 运行中
+      PARKED = 1,  // 在自己的eventfd上等待
+      POLLING = 2, // 在epoll_wait
+    };
+    int fd = -1;                     // 该线程专用的eventfd
+    std::atomic<int> state{RUNNING}; // 等待状态
+    uint32_t spinUs = 0;             // 阻塞前自旋的预算(微秒)，自适应调整
+  };
 
   /**
-   * @brief 重置socket句柄上下文的容器(m_fdContexts)大小
-   * @param size 要设置的大小
+   * @brief 阻塞前在运行队列上自旋，等到任务就不用再被唤醒
+   * @details 自旋期间m_spinningCount>0，schedule()不会写eventfd。
+   *  等到了预算翻倍，没等到减半
+   * @param timeout_us 本来要阻塞的时间，自旋不超过它
+   * @param evts 不为空时同时以超时0轮询reactor，就绪事件数写到rt
+   * @return 是否等到了任务或者就绪事件
    */
-  void contextResize(size_t size);
+  bool spinForWork(Waiter &waiter, uint64_t timeout_us, Reactor::Event *evts,
+                   int max_events, int *rt);
+
   /**
-   * @brief 判断是否可以停止
-   * @param timeout 最近要出发的定时器事件间隔
-   * @return success or not
+   * @brief 根据阻塞的结果调整自旋预算：很快就被唤醒说明自旋本可以等到
+   * @param woken 是否被事件/唤醒叫醒，而不是超时
+   * @param blocked_us 实际阻塞的时间
    */
-  bool stopping(uint64_t &timeout);
+  void learnSpin(Waiter &waiter, bool woken, uint64_t blocked_us);
+
+  /**
+   * @brief 唤醒一个在eventfd上等待的线程
+   * @return 是否由本次调用唤醒
+   */
+  bool wake(Waiter &waiter);
+
+  /**
+   * @brief poller是否负责处理该时间轮
+   * @details 外部线程的时间轮、poller自己的、还在运行中的线程的由poller处理，
+   *  在自己的eventfd上等待的线程自己处理自己的时间轮
+   * @param index poller的工作线程下标
+   */
+  bool pollerOwnsTimers(int index, size_t wheel);
+
+  /**
+   * @brief 唤醒正在epoll_wait的线程
+   */
+  void wakePoller();
+
+  /**
+   * @brief 提交式IO完成，唤醒等待的协程
+   * @param batch 同triggerEvent
+   */
+  void completeIO(IORequest *req,
+                  std::vector<FiberAndThread> *batch = nullptr);
+
+  /**
+   * @brief 提交式IO超时，取消请求
+   */
+  static void OnSubmitTimeout(TimerNode *node);
 
 private:
-  int m_epfd = 0;                                // epoll 文件句柄
-  int m_tickleFds[2];                            // pipe 文件句柄
+  Reactor::ptr m_reactor;                        // IO多路复用后端
+  bool m_persistentEvents = false;               // 句柄是否常驻注册
+  int m_tickleFd = -1;                           // 唤醒poller的eventfd
+  std::atomic<int> m_poller{-1};       // 正在epoll_wait的工作线程下标
+  std::atomic<bool> m_pollerTickled{false}; // poller已经被唤醒过，不必重复写
+  std::vector<std::unique_ptr<Waiter>> m_waiters; // 每个工作线程一个
   std::atomic<size_t> m_pendingEventCount = {0}; // 当前等待执行的事件数量
-  std::vector<FdContext *> m_fdContexts; // socket事件上下文的容器
-  RWMutexType m_mutex;
+  std::atomic<uint64_t> m_spinHits{0};   // 自旋等到任务的次数
+  std::atomic<uint64_t> m_spinMisses{0}; // 自旋没等到任务的次数
+  /*
+   * 句柄上下文表：两级数组，一级大小按RLIMIT_NOFILE固定，二级每块FD_CHUNK_SIZE个，
+   * 按需分配且分配后不再移动，查找不需要加锁
+   */
+  static const int FD_CHUNK_SIZE = 256;
+  static const int FD_TABLE_LIMIT = 1 << 20; // 按硬限制预留的上限
+  static const int FD_TABLE_MAX = 1 << 24;   // 句柄表的绝对上限
+  std::atomic<FdContext *> *m_fdChunks = nullptr;
+  size_t m_fdChunkCount = 0;
+  int m_maxFd = 0; // 可以管理的句柄上限(不含)
 };
 
 } // namespace bin
@@ -4,6 +4,7 @@
 #include "env.h"
 #include "library.h"
 #include "log.h"
+#include "offload.h"
 
 namespace bin {
 
@@ -40,10 +41,18 @@ private:
 };
 
 Module::ptr Library::GetModule(const std::string &path) {
-  void *handle = dlopen(path.c_str(), RTLD_NOW);
+  // dlopen要读文件、执行静态初始化，放到阻塞线程池；dlerror()是线程局部的，一起取出
+  std::string error;
+  void *handle = bin::offload([&path, &error]() {
+    void *h = dlopen(path.c_str(), RTLD_NOW);
+    if (!h) {
+      error = dlerror();
+    }
+    return h;
+  });
   if (!handle) {
     BIN_LOG_ERROR(g_logger)
-        << "cannot load library path=" << path << " error=" << dlerror();
+        << "cannot load library path=" << path << " error=" << error;
     return nullptr;
   }
 
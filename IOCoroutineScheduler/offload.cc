@@ -0,0 +1,156 @@
+/**
+ * @file offload.cc
+ * @author yinyb (990900296@qq.com)
+ * @brief 阻塞调用卸载线程池
+ * @version 1.0
+ * @date 2022-04-04
+ * @copyright Copyright (c) {2022}
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <deque>
+#include <exception>
+#include <functional>
+
+#include "config.h"
+#include "coroutine.h"
+#include "log.h"
+#include "macro.h"
+#include "offload.h"
+#include "scheduler.h"
+#include "thread.h"
+
+namespace bin {
+
+static bin::Logger::ptr g_logger = BIN_LOG_NAME("system");
+
+static ConfigVar<uint32_t>::ptr g_offload_threads = Config::Lookup<uint32_t>(
+    "offload.threads", 8, "max threads of the blocking call offload pool");
+
+static std::atomic<uint64_t> s_offloaded{0};
+static std::atomic<uint64_t> s_inlined{0};
+
+/**
+ * @brief 阻塞线程池
+ * @details 线程池的线程不开启hook，调用就是原本的阻塞系统调用。
+ *  没有空闲线程时才新建线程，线程不退出；进程退出时不释放，避免静态析构顺序问题
+ */
+class OffloadPool {
+public:
+  /**
+   * @brief 一次卸载的调用
+   */
+  struct Job {
+    Task task;                   /// 要执行的调用
+    Scheduler *scheduler = nullptr; /// 调用方所在的调度器
+    Fiber::ptr fiber;            /// 挂起的调用方协程
+    std::exception_ptr *error = nullptr; /// 调用方栈上的异常，调用方挂起期间有效
+  };
+
+  static OffloadPool *GetInstance() {
+    static OffloadPool *s_pool = new OffloadPool;
+    return s_pool;
+  }
+
+  void submit(Job &&job) {
+    bool grow = false;
+    size_t index = 0;
+    {
+      Mutex::Lock lock(m_mutex);
+      m_jobs.push_back(std::move(job));
+      // 空闲线程不够取走所有排队的调用时新建线程
+      if (m_idle < m_jobs.size() &&
+          m_threadCount < std::max(1u, g_offload_threads->getValue())) {
+        index = m_threadCount++;
+        grow = true;
+      }
+    }
+    m_semaphore.notify();
+    if (grow) {
+      Thread::ptr thr(new Thread(std::bind(&OffloadPool::run, this),
+                                 "offload_" + std::to_string(index)));
+      Mutex::Lock lock(m_mutex);
+      m_threads.push_back(thr);
+    }
+  }
+
+  void getStats(OffloadStats &stats) {
+    Mutex::Lock lock(m_mutex);
+    stats.threads = m_threadCount;
+    stats.pending = m_jobs.size();
+  }
+
+private:
+  void run() {
+    while (true) {
+      {
+        Mutex::Lock lock(m_mutex);
+        ++m_idle;
+      }
+      m_semaphore.wait();
+      Job job;
+      {
+        Mutex::Lock lock(m_mutex);
+        --m_idle;
+        BIN_ASSERT(!m_jobs.empty());
+        job = std::move(m_jobs.front());
+        m_jobs.pop_front();
+      }
+      try {
+        job.task();
+      } catch (...) {
+        *job.error = std::current_exception();
+      }
+      job.task = nullptr;
+      // 调用方可能还没切出，调度器会等它切出后再恢复
+      Scheduler *scheduler = job.scheduler;
+      scheduler->schedule(std::move(job.fiber));
+      scheduler->endExternalWait();
+    }
+  }
+
+private:
+  Mutex m_mutex;
+  Semaphore m_semaphore;
+  std::deque<Job> m_jobs;          /// 排队的调用
+  std::vector<Thread::ptr> m_threads;
+  size_t m_threadCount = 0;        /// 已经创建的线程数
+  size_t m_idle = 0;               /// 等待调用的线程数
+};
+
+bool OffloadTask(Task task) {
+  Scheduler *scheduler = Scheduler::GetThis();
+  Fiber *cur = Fiber::GetThisRaw();
+  // 主协程、调度协程、inline任务不能挂起，共享栈协程挂起后栈上的变量会被覆盖
+  if (!scheduler || cur->getId() == 0 || cur == Scheduler::GetMainFiber() ||
+      cur->isSharedStack() || Fiber::InInlineTask()) {
+    ++s_inlined;
+    task();
+    return false;
+  }
+  std::exception_ptr error;
+  OffloadPool::Job job;
+  job.task = std::move(task);
+  job.scheduler = scheduler;
+  job.fiber = cur->shared_from_this();
+  job.error = &error;
+  ++s_offloaded;
+  scheduler->beginExternalWait();
+  OffloadPool::GetInstance()->submit(std::move(job));
+  Fiber::YieldToHold();
+  if (error) {
+    std::rethrow_exception(error);
+  }
+  return true;
+}
+
+OffloadStats GetOffloadStats() {
+  OffloadStats stats;
+  stats.offloaded = s_offloaded;
+  stats.inlined = s_inlined;
+  OffloadPool::GetInstance()->getStats(stats);
+  return stats;
+}
+
+} // namespace bin
@@ -0,0 +1,73 @@
+/**
+ * @file offload.h
+ * @author yinyb (990900296@qq.com)
+ * @brief 阻塞调用卸载线程池
+ *  hook没法变成非阻塞的调用(普通文件读写、fsync、getaddrinfo、dlopen)在工作线程上执行
+ *  会阻塞整个线程。offload()把调用交给专门的阻塞线程池，当前协程挂起，调用返回后
+ *  协程回到原来的调度器上恢复，工作线程这期间继续执行其他协程。
+ * @version 1.0
+ * @date 2022-04-04
+ * @copyright Copyright (c) {2022}
+ */
+
+#ifndef __BIN_OFFLOAD_H__
+#define __BIN_OFFLOAD_H__
+
+#include <memory>
+#include <stdint.h>
+#include <type_traits>
+
+#include "task.h"
+
+namespace bin {
+
+/**
+ * @brief 阻塞线程池的计数，GetOffloadStats()返回
+ */
+struct OffloadStats {
+  uint64_t offloaded = 0; /// 累计交给线程池执行的调用数
+  uint64_t inlined = 0;   /// 累计不能挂起、直接在调用线程执行的调用数
+  size_t threads = 0;     /// 线程池当前的线程数
+  size_t pending = 0;     /// 排队等待执行的调用数
+};
+
+/**
+ * @brief 把task交给阻塞线程池执行，挂起当前协程直到执行完，在原来的调度器上恢复
+ * @details 线程池按需创建线程，最多offload.threads个。
+ *  不在调度器的任务协程里(线程主协程、调度协程、inline任务)时不能挂起，
+ *  共享栈协程挂起后栈上的变量会被别的协程覆盖，这两种情况直接在当前线程执行。
+ *  task抛出的异常在调用方重新抛出。
+ *  挂起期间同一线程继续执行其他协程，持有bin::Mutex这类线程锁时调用，等锁的协程
+ *  会阻塞工作线程，调用方无法恢复而死锁。hook的文件IO会走到这里(见hook.h)，同样不能持锁
+ * @return 是否交给了线程池
+ */
+bool OffloadTask(Task task);
+
+/**
+ * @brief 阻塞线程池的计数
+ */
+OffloadStats GetOffloadStats();
+
+/**
+ * @brief 在阻塞线程池上执行fn，返回fn的返回值
+ * @details 见OffloadTask()。errno、dlerror()这类线程局部的状态不会带回来，
+ *  需要的话在fn里取出
+ */
+template <class F>
+auto offload(F &&fn) -> typename std::enable_if<
+    !std::is_void<decltype(fn())>::value, decltype(fn())>::type {
+  typedef decltype(fn()) R;
+  std::unique_ptr<R> result;
+  OffloadTask([&fn, &result]() { result.reset(new R(fn())); });
+  return std::move(*result);
+}
+
+template <class F>
+auto offload(F &&fn) ->
+    typename std::enable_if<std::is_void<decltype(fn())>::value>::type {
+  OffloadTask([&fn]() { fn(); });
+}
+
+} // namespace bin
+
+#endif
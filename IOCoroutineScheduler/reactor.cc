@@ -0,0 +1,771 @@
+/**
+ * @file reactor.cc
+ * @author yinyb (990900296@qq.com)
+ * @brief IO多路复用后端
+ * @version 1.0
+ * @date 2022-04-02
+ * @copyright Copyright (c) {2022}
+ */
+
+#include <errno.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <deque>
+#include <unordered_map>
+#include <vector>
+
+#include "config.h"
+#include "log.h"
+#include "macro.h"
+#include "mutex.h"
+#include "reactor.h"
+
+#if defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#endif
+#endif
+
+// 多路accept和按fd取消需要5.19的头文件
+#if defined(IORING_ACCEPT_MULTISHOT) && defined(IORING_ASYNC_CANCEL_FD) &&     \
+    defined(__NR_io_uring_setup)
+#define BIN_HAVE_IO_URING 1
+#endif
+
+namespace bin {
+
+static Logger::ptr g_logger = BIN_LOG_NAME("system");
+
+static ConfigVar<uint32_t>::ptr g_uring_entries =
+    Config::Lookup<uint32_t>("iomanager.uring.entries", 1024,
+                             "io_uring submission queue entries");
+
+// block1: epoll
+class EpollReactor : public Reactor {
+public:
+  EpollReactor() {
+    m_epfd = epoll_create(5000);
+    BIN_ASSERT(m_epfd >= 0);
+  }
+
+  ~EpollReactor() { close(m_epfd); }
+
+  const char *getName() const override { return "epoll"; }
+
+  int ctl(int op, int fd, uint32_t events, void *data) override {
+    epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = events;
+    ev.data.ptr = data;
+    return epoll_ctl(m_epfd, op, fd, &ev);
+  }
+
+  int wait(Event *events, int max, uint64_t timeout_us) override {
+    static thread_local std::vector<epoll_event> t_events;
+    if ((int)t_events.size() < max) {
+      t_events.resize(max);
+    }
+    int rt = -1;
+#ifdef __NR_epoll_pwait2
+    // epoll_pwait2(5.11)的超时是timespec，不到1ms的定时器也能准时醒来
+    if (s_pwait2) {
+      timespec ts;
+      ts.tv_sec = timeout_us / 1000000;
+      ts.tv_nsec = timeout_us % 1000000 * 1000;
+      rt = syscall(__NR_epoll_pwait2, m_epfd, &t_events[0], max, &ts, nullptr,
+                   0);
+      if (rt < 0 && errno == ENOSYS) {
+        s_pwait2 = false;
+      }
+    }
+    if (!s_pwait2)
+#endif
+    {
+      // 向上取整到毫秒，定时器不会提前醒来
+      rt = epoll_wait(m_epfd, &t_events[0], max, (timeout_us + 999) / 1000);
+    }
+    for (int i = 0; i < rt; ++i) {
+      events[i].events = t_events[i].events;
+      events[i].data = t_events[i].data.ptr;
+      events[i].request = nullptr;
+    }
+    return rt;
+  }
+
+private:
+  int m_epfd = -1; // epoll 文件句柄
+  static std::atomic<bool> s_pwait2; // 内核是否支持epoll_pwait2
+};
+
+std::atomic<bool> EpollReactor::s_pwait2{true};
+
+// block2: io_uring
+#ifdef BIN_HAVE_IO_URING
+
+static int io_uring_setup(unsigned entries, io_uring_params *p) {
+  return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int io_uring_enter(int fd, unsigned to_submit, unsigned min_complete,
+                          unsigned flags, const void *arg, size_t argsz) {
+  return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, arg,
+                 argsz);
+}
+
+static int io_uring_register(int fd, unsigned opcode, void *arg,
+                             unsigned nr_args) {
+  return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+class UringReactor : public Reactor {
+public:
+  ~UringReactor();
+
+  /**
+   * @brief 创建ring
+   * @return 内核不支持需要的特性时返回false
+   */
+  bool init(unsigned entries);
+
+  const char *getName() const override { return "io_uring"; }
+  int ctl(int op, int fd, uint32_t events, void *data) override;
+  int wait(Event *events, int max, uint64_t timeout_us) override;
+  void beginBatch() override;
+  void endBatch() override;
+  bool supportsAsyncIO() const override { return true; }
+  int submit(IORequest *req) override;
+  bool cancel(IORequest *req) override;
+  void closeFd(int fd) override;
+
+private:
+  // user_data的低2位区分完成事件的类型
+  enum Tag {
+    TAG_REQUEST = 0, // IORequest*
+    TAG_POLL = 1,    // 就绪通知: gen << 32 | fd << 2
+    TAG_ACCEPT = 2,  // AcceptQueue*
+    TAG_IGNORE = 3,  // 取消/删除操作本身的完成，不关心
+  };
+
+  /**
+   * @brief ctl()注册的就绪通知
+   * @details 每次重新注册gen加一，旧注册迟到的完成事件按gen过滤掉
+   */
+  struct PollReg {
+    uint32_t gen = 0;
+    uint32_t events = 0;
+    void *data = nullptr;
+  };
+
+  /**
+   * @brief 监听句柄上的多路accept
+   * @details 有accept等待时挂一个multishot accept，每来一个连接完成一次：
+   *  有等待者直接交给它，没有就放进ready等下一次accept()取走
+   */
+  struct AcceptQueue {
+    int fd = -1;
+    bool armed = false;  // multishot accept是否还在内核里
+    bool closed = false; // 句柄已经关闭，等待最后一个完成事件后释放
+    std::deque<int> ready;
+    IORequest *head = nullptr; // 等待者链表
+    IORequest *tail = nullptr;
+  };
+
+  static uint64_t PollData(int fd, uint32_t gen) {
+    return ((uint64_t)gen << 32) | ((uint64_t)(uint32_t)fd << 2) | TAG_POLL;
+  }
+
+  // 以下函数调用时需持有m_mutex
+  io_uring_sqe *getSqe();
+  void commit();
+  void flush();
+  void armPoll(int fd, const PollReg &reg);
+  void removePoll(int fd, const PollReg &reg);
+  void armAccept(AcceptQueue *q);
+  void completeLocked(IORequest *req, int res, Event *events, int &n,
+                      int max);
+  void onPoll(const io_uring_cqe &cqe, Event *events, int &n, int max);
+  void onAccept(const io_uring_cqe &cqe, Event *events, int &n, int max);
+  void destroyAccept(AcceptQueue *q);
+
+  /**
+   * @brief 取出已经完成的事件
+   */
+  int reap(Event *events, int max);
+
+private:
+  int m_fd = -1;
+  // SQ
+  void *m_sqRing = nullptr;
+  size_t m_sqRingSize = 0;
+  io_uring_sqe *m_sqes = nullptr;
+  size_t m_sqesSize = 0;
+  unsigned *m_sqHead = nullptr;
+  unsigned *m_sqTail = nullptr;
+  unsigned *m_sqArray = nullptr;
+  unsigned m_sqMask = 0;
+  unsigned m_sqEntries = 0;
+  unsigned m_sqLocalTail = 0; // 已经写好但还没发布给内核的位置
+  unsigned m_unsubmitted = 0; // 已发布但还没有io_uring_enter提交的数量
+  // CQ
+  void *m_cqRing = nullptr;
+  size_t m_cqRingSize = 0;
+  unsigned *m_cqHead = nullptr;
+  unsigned *m_cqTail = nullptr;
+  io_uring_cqe *m_cqes = nullptr;
+  unsigned m_cqMask = 0;
+
+  Mutex m_mutex;      // SQ、注册表、accept队列
+  Spinlock m_cqMutex; // CQ同一时刻只有一个线程在取
+  uint32_t m_gen = 0;
+  std::unordered_map<int, PollReg> m_polls;
+  std::unordered_map<int, AcceptQueue *> m_accepts;
+  std::unordered_map<int, int> m_inflight; // 每个fd上进行中的请求数
+  std::deque<IORequest *> m_done; // wait()放不下的已完成请求
+};
+
+// 正在批量修改的reactor，批量期间的修改在endBatch()时统一提交
+static thread_local UringReactor *t_batch = nullptr;
+
+UringReactor::~UringReactor() {
+  for (auto &i : m_accepts) {
+    destroyAccept(i.second);
+  }
+  if (m_sqes) {
+    munmap(m_sqes, m_sqesSize);
+  }
+  if (m_cqRing && m_cqRing != m_sqRing) {
+    munmap(m_cqRing, m_cqRingSize);
+  }
+  if (m_sqRing) {
+    munmap(m_sqRing, m_sqRingSize);
+  }
+  if (m_fd >= 0) {
+    close(m_fd);
+  }
+}
+
+bool UringReactor::init(unsigned entries) {
+  io_uring_params p;
+  memset(&p, 0, sizeof(p));
+  p.flags = IORING_SETUP_CQSIZE;
+  p.cq_entries = entries * 2;
+  m_fd = io_uring_setup(entries, &p);
+  if (m_fd < 0) {
+    BIN_LOG_WARN(g_logger) << "io_uring_setup(" << entries
+                           << ") errno=" << errno << " " << strerror(errno);
+    return false;
+  }
+  const uint32_t need =
+      IORING_FEAT_SINGLE_MMAP | IORING_FEAT_NODROP | IORING_FEAT_EXT_ARG |
+      IORING_FEAT_RW_CUR_POS;
+  if ((p.features & need) != need) {
+    BIN_LOG_WARN(g_logger) << "io_uring features=" << p.features
+                           << " missing " << (need & ~p.features);
+    return false;
+  }
+  // IORING_OP_SOCKET和多路accept、按fd取消都是5.19加入的
+  std::vector<char> probe_buf(sizeof(io_uring_probe) +
+                              256 * sizeof(io_uring_probe_op));
+  io_uring_probe *probe = (io_uring_probe *)&probe_buf[0];
+  if (io_uring_register(m_fd, IORING_REGISTER_PROBE, probe, 256) ||
+      probe->last_op < IORING_OP_SOCKET ||
+      !(probe->ops[IORING_OP_SOCKET].flags & IO_URING_OP_SUPPORTED)) {
+    BIN_LOG_WARN(g_logger) << "io_uring needs linux 5.19+";
+    return false;
+  }
+
+  m_sqRingSize = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  m_cqRingSize = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+  m_sqRingSize = m_cqRingSize = std::max(m_sqRingSize, m_cqRingSize);
+  m_sqRing = mmap(nullptr, m_sqRingSize, PROT_READ | PROT_WRITE,
+                  MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_SQ_RING);
+  if (m_sqRing == MAP_FAILED) {
+    m_sqRing = nullptr;
+    return false;
+  }
+  m_cqRing = m_sqRing;
+  m_sqesSize = p.sq_entries * sizeof(io_uring_sqe);
+  m_sqes = (io_uring_sqe *)mmap(nullptr, m_sqesSize, PROT_READ | PROT_WRITE,
+                                MAP_SHARED | MAP_POPULATE, m_fd,
+                                IORING_OFF_SQES);
+  if (m_sqes == MAP_FAILED) {
+    m_sqes = nullptr;
+    return false;
+  }
+
+  char *sq = (char *)m_sqRing;
+  m_sqHead = (unsigned *)(sq + p.sq_off.head);
+  m_sqTail = (unsigned *)(sq + p.sq_off.tail);
+  m_sqArray = (unsigned *)(sq + p.sq_off.array);
+  m_sqMask = *(unsigned *)(sq + p.sq_off.ring_mask);
+  m_sqEntries = *(unsigned *)(sq + p.sq_off.ring_entries);
+  m_sqLocalTail = *m_sqTail;
+
+  char *cq = (char *)m_cqRing;
+  m_cqHead = (unsigned *)(cq + p.cq_off.head);
+  m_cqTail = (unsigned *)(cq + p.cq_off.tail);
+  m_cqes = (io_uring_cqe *)(cq + p.cq_off.cqes);
+  m_cqMask = *(unsigned *)(cq + p.cq_off.ring_mask);
+  BIN_LOG_INFO(g_logger) << "io_uring reactor sq=" << p.sq_entries
+                         << " cq=" << p.cq_entries;
+  return true;
+}
+
+io_uring_sqe *UringReactor::getSqe() {
+  unsigned head = __atomic_load_n(m_sqHead, __ATOMIC_ACQUIRE);
+  if (m_sqLocalTail - head >= m_sqEntries) {
+    // SQ满了，先把已有的提交掉
+    flush();
+    head = __atomic_load_n(m_sqHead, __ATOMIC_ACQUIRE);
+    if (m_sqLocalTail - head >= m_sqEntries) {
+      return nullptr;
+    }
+  }
+  unsigned index = m_sqLocalTail & m_sqMask;
+  io_uring_sqe *sqe = &m_sqes[index];
+  memset(sqe, 0, sizeof(*sqe));
+  m_sqArray[index] = index;
+  ++m_sqLocalTail;
+  return sqe;
+}
+
+void UringReactor::commit() {
+  if (t_batch != this) {
+    flush();
+  }
+}
+
+void UringReactor::flush() {
+  // SQE写完之后再发布tail，内核只会看到完整的SQE
+  unsigned tail = *m_sqTail;
+  m_unsubmitted += m_sqLocalTail - tail;
+  __atomic_store_n(m_sqTail, m_sqLocalTail, __ATOMIC_RELEASE);
+  while (m_unsubmitted) {
+    int rt = io_uring_enter(m_fd, m_unsubmitted, 0, 0, nullptr, 0);
+    if (rt < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      // EBUSY/EAGAIN: CQ积压，留到下一次wait()提交
+      BIN_LOG_DEBUG(g_logger) << "io_uring_enter submit errno=" << errno;
+      break;
+    }
+    m_unsubmitted -= rt;
+    if (rt == 0) {
+      break;
+    }
+  }
+}
+
+void UringReactor::armPoll(int fd, const PollReg &reg) {
+  io_uring_sqe *sqe = getSqe();
+  BIN_ASSERT(sqe);
+  sqe->opcode = IORING_OP_POLL_ADD;
+  sqe->fd = fd;
+  sqe->poll32_events = reg.events & ~(EPOLLET | EPOLLONESHOT);
+  // EPOLLET对应multishot，每次有新的就绪都完成一次，不需要重新注册
+  if (reg.events & EPOLLET) {
+    sqe->len = IORING_POLL_ADD_MULTI;
+  }
+  sqe->user_data = PollData(fd, reg.gen);
+}
+
+void UringReactor::removePoll(int fd, const PollReg &reg) {
+  io_uring_sqe *sqe = getSqe();
+  BIN_ASSERT(sqe);
+  sqe->opcode = IORING_OP_POLL_REMOVE;
+  sqe->fd = -1;
+  sqe->addr = PollData(fd, reg.gen);
+  sqe->user_data = TAG_IGNORE;
+}
+
+void UringReactor::armAccept(AcceptQueue *q) {
+  io_uring_sqe *sqe = getSqe();
+  BIN_ASSERT(sqe);
+  sqe->opcode = IORING_OP_ACCEPT;
+  sqe->fd = q->fd;
+  sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+  sqe->user_data = (uint64_t)(uintptr_t)q | TAG_ACCEPT;
+  q->armed = true;
+}
+
+int UringReactor::ctl(int op, int fd, uint32_t events, void *data) {
+  Mutex::Lock lock(m_mutex);
+  auto it = m_polls.find(fd);
+  switch (op) {
+  case EPOLL_CTL_ADD:
+    if (it != m_polls.end()) {
+      errno = EEXIST;
+      return -1;
+    }
+    it = m_polls.insert(std::make_pair(fd, PollReg())).first;
+    break;
+  case EPOLL_CTL_MOD:
+  case EPOLL_CTL_DEL:
+    if (it == m_polls.end()) {
+      errno = ENOENT;
+      return -1;
+    }
+    removePoll(fd, it->second);
+    if (op == EPOLL_CTL_DEL) {
+      m_polls.erase(it);
+      commit();
+      return 0;
+    }
+    break;
+  default:
+    errno = EINVAL;
+    return -1;
+  }
+  PollReg &reg = it->second;
+  reg.gen = ++m_gen;
+  reg.events = events;
+  reg.data = data;
+  armPoll(fd, reg);
+  commit();
+  return 0;
+}
+
+void UringReactor::beginBatch() { t_batch = this; }
+
+void UringReactor::endBatch() {
+  t_batch = nullptr;
+  Mutex::Lock lock(m_mutex);
+  flush();
+}
+
+int UringReactor::submit(IORequest *req) {
+  BIN_ASSERT(((uintptr_t)req & 3) == 0);
+  Mutex::Lock lock(m_mutex);
+  if (req->op == IORequest::ACCEPT) {
+    AcceptQueue *&q = m_accepts[req->fd];
+    if (!q) {
+      q = new AcceptQueue;
+      q->fd = req->fd;
+    }
+    // 之前已经accept好的连接直接取走
+    if (!q->ready.empty()) {
+      int fd = q->ready.front();
+      q->ready.pop_front();
+      if (req->buf && req->addrlen) {
+        getpeername(fd, (sockaddr *)req->buf, req->addrlen);
+      }
+      req->result = fd;
+      return 0;
+    }
+    req->next = nullptr;
+    if (q->tail) {
+      q->tail->next = req;
+    } else {
+      q->head = req;
+    }
+    q->tail = req;
+    if (!q->armed) {
+      armAccept(q);
+      commit();
+    }
+    return 1;
+  }
+
+  io_uring_sqe *sqe = getSqe();
+  if (!sqe) {
+    return -1;
+  }
+  sqe->fd = req->fd;
+  sqe->addr = (uint64_t)(uintptr_t)req->buf;
+  switch (req->op) {
+  case IORequest::READ:
+  case IORequest::WRITE:
+  case IORequest::READV:
+  case IORequest::WRITEV: {
+    static const uint8_t s_ops[] = {IORING_OP_READ, IORING_OP_WRITE,
+                                    IORING_OP_READV, IORING_OP_WRITEV};
+    sqe->opcode = s_ops[req->op - IORequest::READ];
+    sqe->len = req->len;
+    sqe->off = (uint64_t)-1; // 使用并推进文件当前的偏移
+  } break;
+  case IORequest::RECV:
+  case IORequest::SEND:
+    sqe->opcode =
+        req->op == IORequest::RECV ? IORING_OP_RECV : IORING_OP_SEND;
+    sqe->len = req->len;
+    sqe->msg_flags = req->flags;
+    break;
+  case IORequest::RECVMSG:
+  case IORequest::SENDMSG:
+    sqe->opcode =
+        req->op == IORequest::RECVMSG ? IORING_OP_RECVMSG : IORING_OP_SENDMSG;
+    sqe->len = 1;
+    sqe->msg_flags = req->flags;
+    break;
+  case IORequest::CONNECT:
+    sqe->opcode = IORING_OP_CONNECT;
+    sqe->off = req->len;
+    break;
+  default:
+    BIN_ASSERT2(false, "op=" << req->op);
+  }
+  sqe->user_data = (uint64_t)(uintptr_t)req;
+  ++m_inflight[req->fd];
+  commit();
+  return 1;
+}
+
+bool UringReactor::cancel(IORequest *req) {
+  Mutex::Lock lock(m_mutex);
+  if (req->op == IORequest::ACCEPT) {
+    // 还在等待链表里就直接摘掉；不在说明已经拿到连接，完成事件在路上
+    auto it = m_accepts.find(req->fd);
+    if (it == m_accepts.end()) {
+      return false;
+    }
+    AcceptQueue *q = it->second;
+    IORequest *prev = nullptr;
+    for (IORequest *i = q->head; i; prev = i, i = i->next) {
+      if (i != req) {
+        continue;
+      }
+      if (prev) {
+        prev->next = i->next;
+      } else {
+        q->head = i->next;
+      }
+      if (q->tail == i) {
+        q->tail = prev;
+      }
+      req->result = -ECANCELED;
+      return true;
+    }
+    return false;
+  }
+  io_uring_sqe *sqe = getSqe();
+  BIN_ASSERT(sqe);
+  sqe->opcode = IORING_OP_ASYNC_CANCEL;
+  sqe->fd = -1;
+  sqe->addr = (uint64_t)(uintptr_t)req;
+  sqe->user_data = TAG_IGNORE;
+  commit();
+  return false;
+}
+
+void UringReactor::closeFd(int fd) {
+  Mutex::Lock lock(m_mutex);
+  bool busy = false;
+  auto it = m_accepts.find(fd);
+  if (it != m_accepts.end()) {
+    AcceptQueue *q = it->second;
+    m_accepts.erase(it);
+    q->closed = true;
+    if (q->armed) {
+      busy = true; // 最后一个完成事件到达时释放
+    } else {
+      destroyAccept(q);
+    }
+  }
+  auto it2 = m_inflight.find(fd);
+  if (it2 != m_inflight.end() && it2->second > 0) {
+    busy = true;
+  }
+  if (!busy) {
+    return;
+  }
+  io_uring_sqe *sqe = getSqe();
+  BIN_ASSERT(sqe);
+  sqe->opcode = IORING_OP_ASYNC_CANCEL;
+  sqe->fd = fd;
+  sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+  sqe->user_data = TAG_IGNORE;
+  // 关闭之前必须已经提交，不能等批量
+  flush();
+}
+
+void UringReactor::destroyAccept(AcceptQueue *q) {
+  for (int fd : q->ready) {
+    close(fd);
+  }
+  delete q;
+}
+
+void UringReactor::completeLocked(IORequest *req, int res, Event *events,
+                                  int &n, int max) {
+  req->result = res;
+  if (n < max) {
+    events[n].events = 0;
+    events[n].data = nullptr;
+    events[n].request = req;
+    ++n;
+  } else {
+    m_done.push_back(req);
+  }
+}
+
+void UringReactor::onPoll(const io_uring_cqe &cqe, Event *events, int &n,
+                          int max) {
+  int fd = (int)((cqe.user_data >> 2) & 0x3fffffff);
+  uint32_t gen = (uint32_t)(cqe.user_data >> 32);
+  auto it = m_polls.find(fd);
+  // 已经删除或重新注册过，是旧注册迟到的完成事件
+  if (it == m_polls.end() || it->second.gen != gen) {
+    return;
+  }
+  PollReg &reg = it->second;
+  uint32_t ready = 0;
+  if (cqe.res < 0) {
+    if (cqe.res == -ECANCELED) {
+      return;
+    }
+    ready = EPOLLERR | EPOLLHUP;
+  } else {
+    ready = cqe.res;
+    // multishot被内核终止(或者是一次性的poll)，重新挂上
+    if (!(cqe.flags & IORING_CQE_F_MORE)) {
+      reg.gen = ++m_gen;
+      armPoll(fd, reg);
+    }
+  }
+  if (n < max) {
+    events[n].events = ready;
+    events[n].data = reg.data;
+    events[n].request = nullptr;
+    ++n;
+  }
+}
+
+void UringReactor::onAccept(const io_uring_cqe &cqe, Event *events, int &n,
+                            int max) {
+  AcceptQueue *q = (AcceptQueue *)(uintptr_t)(cqe.user_data & ~(uint64_t)3);
+  if (cqe.res >= 0) {
+    if (q->closed) {
+      close(cqe.res);
+    } else if (q->head) {
+      IORequest *req = q->head;
+      q->head = req->next;
+      if (!q->head) {
+        q->tail = nullptr;
+      }
+      if (req->buf && req->addrlen) {
+        getpeername(cqe.res, (sockaddr *)req->buf, req->addrlen);
+      }
+      completeLocked(req, cqe.res, events, n, max);
+    } else {
+      q->ready.push_back(cqe.res);
+    }
+  } else {
+    // 出错时multishot已经终止，等待者都带着错误返回
+    while (q->head) {
+      IORequest *req = q->head;
+      q->head = req->next;
+      completeLocked(req, cqe.res, events, n, max);
+    }
+    q->tail = nullptr;
+  }
+  if (!(cqe.flags & IORING_CQE_F_MORE)) {
+    q->armed = false;
+    if (q->closed) {
+      destroyAccept(q);
+    } else if (q->head) {
+      armAccept(q);
+    }
+  }
+}
+
+int UringReactor::reap(Event *events, int max) {
+  Spinlock::Lock lock(m_cqMutex);
+  Mutex::Lock lock2(m_mutex);
+  int n = 0;
+  while (!m_done.empty() && n < max) {
+    IORequest *req = m_done.front();
+    m_done.pop_front();
+    completeLocked(req, req->result, events, n, max);
+  }
+  unsigned head = *m_cqHead;
+  unsigned tail = __atomic_load_n(m_cqTail, __ATOMIC_ACQUIRE);
+  // poll完成事件放不下时留在CQ里，下次再取
+  for (; head != tail && n < max; ++head) {
+    const io_uring_cqe &cqe = m_cqes[head & m_cqMask];
+    switch (cqe.user_data & 3) {
+    case TAG_REQUEST: {
+      IORequest *req = (IORequest *)(uintptr_t)cqe.user_data;
+      auto it = m_inflight.find(req->fd);
+      if (it != m_inflight.end() && --it->second <= 0) {
+        m_inflight.erase(it);
+      }
+      completeLocked(req, cqe.res, events, n, max);
+    } break;
+    case TAG_POLL:
+      onPoll(cqe, events, n, max);
+      break;
+    case TAG_ACCEPT:
+      onAccept(cqe, events, n, max);
+      break;
+    default:
+      break;
+    }
+  }
+  __atomic_store_n(m_cqHead, head, __ATOMIC_RELEASE);
+  // 完成事件里重新挂上的poll/accept
+  flush();
+  return n;
+}
+
+int UringReactor::wait(Event *events, int max, uint64_t timeout_us) {
+  int n = reap(events, max);
+  if (n > 0 || timeout_us == 0) {
+    return n;
+  }
+  // 把还没提交的SQE和等待合并成一次io_uring_enter
+  unsigned to_submit = 0;
+  {
+    Mutex::Lock lock(m_mutex);
+    m_unsubmitted += m_sqLocalTail - *m_sqTail;
+    __atomic_store_n(m_sqTail, m_sqLocalTail, __ATOMIC_RELEASE);
+    to_submit = m_unsubmitted;
+    m_unsubmitted = 0;
+  }
+  __kernel_timespec ts;
+  ts.tv_sec = timeout_us / 1000000;
+  ts.tv_nsec = (timeout_us % 1000000) * 1000ll;
+  io_uring_getevents_arg arg;
+  memset(&arg, 0, sizeof(arg));
+  arg.ts = (uint64_t)(uintptr_t)&ts;
+  int rt = io_uring_enter(m_fd, to_submit, 1,
+                          IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg,
+                          sizeof(arg));
+  int err = errno;
+  unsigned submitted = rt < 0 ? 0 : rt;
+  if (submitted < to_submit) {
+    Mutex::Lock lock(m_mutex);
+    m_unsubmitted += to_submit - submitted;
+  }
+  if (rt < 0 && err != ETIME && err != EBUSY) {
+    errno = err;
+    return -1;
+  }
+  return reap(events, max);
+}
+
+#endif
+
+Reactor::ptr Reactor::Create(const std::string &type) {
+  if (type == "io_uring") {
+#ifdef BIN_HAVE_IO_URING
+    std::shared_ptr<UringReactor> reactor(new UringReactor);
+    if (reactor->init(g_uring_entries->getValue())) {
+      return reactor;
+    }
+#endif
+    BIN_LOG_WARN(g_logger) << "io_uring unavailable, fallback to epoll";
+  } else if (type != "epoll") {
+    BIN_LOG_WARN(g_logger) << "unknown reactor type=" << type
+                           << ", fallback to epoll";
+  }
+  return Reactor::ptr(new EpollReactor);
+}
+
+} // namespace bin
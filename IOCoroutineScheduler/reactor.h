@@ -0,0 +1,143 @@
+/**
+ * @file reactor.h
+ * @author yinyb (990900296@qq.com)
+ * @brief IO多路复用后端
+ * @version 1.0
+ * @date 2022-04-02
+ * @copyright Copyright (c) {2022}
+ */
+
+/*
+ * IOManager通过Reactor等待句柄就绪，后端可以替换：
+ *  epoll:    默认后端，只提供就绪通知
+ *  io_uring: 就绪通知用POLL_ADD(EPOLLET对应multishot poll)实现，另外支持提交式IO，
+ *            read/write/recv/send/accept/connect直接提交到ring，完成后由poller取回
+ *
+ * 事件统一使用epoll的掩码(EPOLLIN/EPOLLOUT/EPOLLERR/EPOLLHUP/EPOLLET)，
+ * 后端通过配置项iomanager.reactor选择，io_uring初始化失败时回退到epoll。
+ *
+ * io_uring的提交是批量的：poller处理一轮就绪事件期间(beginBatch/endBatch之间)产生的
+ * 修改只写入SQ，一轮结束时一次io_uring_enter提交；其他线程的修改立即提交。
+ */
+
+#ifndef __BIN_REACTOR_H__
+#define __BIN_REACTOR_H__
+
+#include <memory>
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <sys/socket.h>
+
+namespace bin {
+
+/**
+ * @brief 提交式IO请求
+ * @details 请求和缓冲区在完成之前必须保持有效
+ */
+struct IORequest {
+  enum Op {
+    READ,    // read(fd, buf, len)
+    WRITE,   // write(fd, buf, len)
+    READV,   // readv(fd, (iovec*)buf, len)
+    WRITEV,  // writev(fd, (iovec*)buf, len)
+    RECV,    // recv(fd, buf, len, flags)
+    SEND,    // send(fd, buf, len, flags)
+    RECVMSG, // recvmsg(fd, (msghdr*)buf, flags)
+    SENDMSG, // sendmsg(fd, (msghdr*)buf, flags)
+    ACCEPT,  // accept(fd, (sockaddr*)buf, addrlen)
+    CONNECT, // connect(fd, (sockaddr*)buf, len)
+  };
+
+  Op op = READ;
+  int fd = -1;
+  void *buf = nullptr;          // 缓冲区/iovec/msghdr/地址，见Op
+  size_t len = 0;               // 缓冲区长度/iovec个数/地址长度
+  int flags = 0;                // recv/send系列的标志
+  socklen_t *addrlen = nullptr; // ACCEPT的地址长度
+  int result = 0;               // 完成结果，失败为-errno
+  void *data = nullptr;         // 提交者的上下文
+  IORequest *next = nullptr;    // 后端内部使用的链表指针
+};
+
+/**
+ * @brief IO多路复用后端
+ */
+class Reactor {
+public:
+  typedef std::shared_ptr<Reactor> ptr;
+
+  /**
+   * @brief wait()带回的事件
+   * @details request不为空表示提交式IO完成，否则是句柄就绪
+   */
+  struct Event {
+    uint32_t events = 0;          // 就绪的事件掩码
+    void *data = nullptr;         // ctl()时设置的数据
+    IORequest *request = nullptr; // 完成的IO请求
+  };
+
+  virtual ~Reactor() {}
+
+  /**
+   * @brief 后端名称
+   */
+  virtual const char *getName() const = 0;
+
+  /**
+   * @brief 修改句柄上关注的事件，语义同epoll_ctl
+   * @param op EPOLL_CTL_ADD/EPOLL_CTL_MOD/EPOLL_CTL_DEL
+   * @param events 关注的事件掩码
+   * @param data 就绪时通过Event::data带回
+   * @return 0成功，-1失败并设置errno
+   */
+  virtual int ctl(int op, int fd, uint32_t events, void *data) = 0;
+
+  /**
+   * @brief 等待事件
+   * @param events 事件数组
+   * @param max 数组大小
+   * @param timeout_us 超时时间(微秒)，0不阻塞
+   * @return 事件数量，-1失败并设置errno
+   */
+  virtual int wait(Event *events, int max, uint64_t timeout_us) = 0;
+
+  /**
+   * @brief 开始一轮批量修改，endBatch()时统一提交
+   */
+  virtual void beginBatch() {}
+  virtual void endBatch() {}
+
+  /**
+   * @brief 是否支持提交式IO
+   */
+  virtual bool supportsAsyncIO() const { return false; }
+
+  /**
+   * @brief 提交IO请求
+   * @return 1已提交，完成后由wait()带回；0已经同步完成(结果在result)；-1不支持
+   */
+  virtual int submit(IORequest *req) { return -1; }
+
+  /**
+   * @brief 取消已提交的IO请求
+   * @return true请求已经同步取消(result为-ECANCELED)，不会再由wait()带回；
+   *  false已经发起异步取消，结果仍由wait()带回
+   */
+  virtual bool cancel(IORequest *req) { return false; }
+
+  /**
+   * @brief 句柄即将关闭，取消该句柄上所有进行中的提交式IO
+   */
+  virtual void closeFd(int fd) {}
+
+  /**
+   * @brief 创建后端
+   * @param type "epoll"或"io_uring"，io_uring不可用时回退到epoll
+   */
+  static Reactor::ptr Create(const std::string &type);
+};
+
+} // namespace bin
+
+#endif
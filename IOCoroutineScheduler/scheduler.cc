@@ -7,15 +7,31 @@
  * @copyright Copyright (c) {2022}
  */
 
+#include <algorithm>
+
 #include "scheduler.h"
+#include "config.h"
 #include "hook.h"
 #include "log.h"
 #include "macro.h"
+#include "util.h"
 
 namespace bin {
 
 static bin::Logger::ptr g_logger = BIN_LOG_NAME("system");
 
+static ConfigVar<uint32_t>::ptr g_grow_latency_us = Config::Lookup<uint32_t>(
+    "scheduler.elastic.grow_latency_us", 2000,
+    "queue latency above which an elastic scheduler adds a worker");
+
+static ConfigVar<uint32_t>::ptr g_grow_interval_ms = Config::Lookup<uint32_t>(
+    "scheduler.elastic.grow_interval_ms", 100,
+    "min interval between two workers added by an elastic scheduler");
+
+static ConfigVar<uint32_t>::ptr g_idle_retire_ms = Config::Lookup<uint32_t>(
+    "scheduler.elastic.idle_retire_ms", 30000,
+    "idle time after which a worker above the min count exits");
+
 // t_scheduler_fiber保存当前线程的调度协程，加上Fiber模块的t_fiber和t_thread_fiber，
 // 每个线程总共可以记录三个协程的上下文信息
 
@@ -25,8 +41,22 @@ static thread_local Scheduler *t_scheduler = nullptr;
 /// 当前线程的调度协程，每个线程都独有一份，包括caller线程
 static thread_local Fiber *t_scheduler_fiber = nullptr;
 
-Scheduler::Scheduler(size_t threads, bool use_caller, const std::string &name)
-    : m_name(name) {
+/// 当前线程在调度器m_workers中的下标，不是工作线程时为-1
+static thread_local int t_worker_index = -1;
+
+/// 当前线程开始空闲的时间，0表示在执行任务
+static thread_local uint64_t t_idle_since_us = 0;
+
+/// 当前线程空闲太久，准备退出
+static thread_local bool t_retiring = false;
+
+/// 工作线程每取这么多次任务，先检查一次全局队列
+static const uint64_t s_globalCheckInterval = 61;
+
+Scheduler::Scheduler(size_t threads, bool use_caller, const std::string &name,
+                     size_t max_threads, const std::vector<int> &cpus,
+                     bool pin_each)
+    : m_cpus(cpus), m_pinEach(pin_each), m_name(name) {
   BIN_LOG_DEBUG(g_logger) << "调度器构造: Scheduler " << name;
   BIN_ASSERT(threads > 0); // 线程数量要 ≥ 1
   // 当前线程作为调度线程使用
@@ -47,6 +77,13 @@ Scheduler::Scheduler(size_t threads, bool use_caller, const std::string &name)
     m_rootThread = -1;
   }
   m_threadCount = threads;
+  // max_threads和threads一样包括caller线程
+  if (max_threads > threads + (use_caller ? 1 : 0)) {
+    m_maxThreadCount = max_threads - (use_caller ? 1 : 0);
+  } else {
+    m_maxThreadCount = threads;
+  }
+  m_elastic = m_maxThreadCount > m_threadCount;
 }
 
 Scheduler::~Scheduler() {
@@ -63,6 +100,53 @@ Scheduler *Scheduler::GetThis() { return t_scheduler; }
 Fiber *Scheduler::GetMainFiber() { return t_scheduler_fiber; }
 
 // 核心函数:开启Schuduler调度器的运行。根据传入的线程数，初始化其余子线程，将调度协程推送到CPU
+// 第i个工作线程可以运行的CPU
+static std::vector<int> ThreadCpus(const std::vector<int> &cpus, bool pin_each,
+                                   size_t i) {
+  if (!pin_each || cpus.empty()) {
+    return cpus;
+  }
+  return std::vector<int>(1, cpus[i % cpus.size()]);
+}
+
+void Scheduler::setCpuAffinity(const std::vector<int> &cpus, bool pin_each) {
+  MutexType::Lock lock(m_mutex);
+  pinThreads(cpus, pin_each);
+}
+
+bool Scheduler::acquireCpuAffinity(const std::vector<int> &cpus) {
+  MutexType::Lock lock(m_mutex);
+  if (!m_cpus.empty() && m_cpus != cpus) {
+    return false;
+  }
+  if (m_cpuRefs++ == 0) {
+    m_oldCpus = m_cpus;
+    m_oldPinEach = m_pinEach;
+    pinThreads(cpus, true);
+  }
+  return true;
+}
+
+void Scheduler::releaseCpuAffinity() {
+  MutexType::Lock lock(m_mutex);
+  if (m_cpuRefs == 0 || --m_cpuRefs > 0) {
+    return;
+  }
+  std::vector<int> cpus;
+  cpus.swap(m_oldCpus);
+  pinThreads(cpus, m_oldPinEach);
+}
+
+void Scheduler::pinThreads(const std::vector<int> &cpus, bool pin_each) {
+  m_cpus = cpus;
+  m_pinEach = pin_each;
+  for (size_t i = 0; i < m_threads.size(); ++i) {
+    if (m_threads[i] && !m_workers[i]->retired) {
+      m_threads[i]->setAffinity(ThreadCpus(m_cpus, m_pinEach, i));
+    }
+  }
+}
+
 void Scheduler::start() {
   BIN_LOG_INFO(g_logger) << "Scheduler::start()";
   MutexType::Lock lock(m_mutex);
@@ -73,14 +157,19 @@ void Scheduler::start() {
   // 是停止状态，开始运行
   m_stopping = false;
   BIN_ASSERT(m_threads.empty());
-  m_threads.resize(m_threadCount);
+  // 本地队列按最多的线程数在线程创建前分配好，之后不再变化，窃取时不用加锁遍历
+  // 第i个工作线程用第i个，caller线程用最后一个
+  size_t workers = getWorkerCount();
+  for (size_t i = m_workers.size(); i < workers; ++i) {
+    m_workers.emplace_back(new WorkerQueue);
+  }
+  m_threads.resize(m_maxThreadCount);
   for (size_t i = 0; i < m_threadCount; ++i) {
     // BIN_LOG_INFO(g_logger) << "创建线程"; //power:开启线程
-    // hack: 协程是Scheduler::run，线程还是Scheduler::run
-    m_threads[i].reset(new Thread(std::bind(&Scheduler::run, this),
-                                  m_name + "_" + std::to_string(i)));
+    m_threads[i] = createWorker(i);
     m_threadIds.push_back(m_threads[i]->getId());
   }
+  m_liveThreadCount = m_threadCount;
   lock.unlock();
   // if(m_rootFiber){
   //     //m_rootFiber->swapIn();
@@ -99,7 +188,7 @@ void Scheduler::stop() {
   m_autoStop = true;
   // 1.只有一个主线程在运行的情况  直接停止即可
   // 只有一个线程（即：主线程/调度协程在运行），并且调度协程处于终止态或创建态。直接调stopping()负责清理、回收工作，退出返回
-  if (m_rootFiber && m_threadCount == 0 &&
+  if (m_rootFiber && m_maxThreadCount == 0 &&
       (m_rootFiber->getState() == Fiber::TERM ||
        m_rootFiber->getState() == Fiber::INIT)) {
     BIN_LOG_INFO(g_logger) << this << " stopped";
@@ -119,7 +208,7 @@ void Scheduler::stop() {
   // 其他线程根据这个标志位退出运行
   m_stopping = true;
   // 唤醒其他线程结束
-  for (size_t i = 0; i < m_threadCount; ++i) {
+  for (size_t i = 0; i < m_liveThreadCount; ++i) {
     BIN_LOG_INFO(g_logger) << "唤醒其他线程: " << i;
     tickle();
   }
@@ -149,8 +238,11 @@ void Scheduler::stop() {
     MutexType::Lock lock(m_mutex);
     thrs.swap(m_threads);
   }
+  // 空闲退出的线程也要join
   for (auto &i : thrs) {
-    i->join();
+    if (i) {
+      i->join();
+    }
   }
 }
 
@@ -169,15 +261,30 @@ void Scheduler::run() {
   setThis();
   // 当前线程ID不等于主线程ID
   if (bin::GetThreadId() != m_rootThread) { // 当前线程未作为调度线程使用？？？
-    t_scheduler_fiber = Fiber::GetThis().get();
+    t_scheduler_fiber = Fiber::GetThisRaw();
+  }
+  // 工作线程创建时就分好了本地队列，caller线程用最后一个，
+  // 没有start()过的调度器只用全局队列
+  if (bin::GetThreadId() == m_rootThread) {
+    t_worker_index = m_workers.size() > m_maxThreadCount ? (int)m_maxThreadCount
+                                                         : -1;
+  }
+  if (t_worker_index >= 0) {
+    WorkerQueue &q = *m_workers[t_worker_index];
+    Spinlock::Lock lock(q.mutex);
+    q.retired = false;
+    q.threadId = bin::GetThreadId();
   }
+  t_idle_since_us = 0;
+  t_retiring = false;
+  uint64_t pick_count = 0;
   // power:创建一个专门跑idel()的协程，调度任务都完成之后去做idle
   Fiber::ptr idle_fiber(new Fiber(std::bind(&Scheduler::idle, this)));
   Fiber::ptr cb_fiber; // 回调函数，function函数的协程
   FiberAndThread ft;
   /*● 核心逻辑：
    * while(1){
-   * 1.加锁，取出可执行对象容器/消息队列/任务队列m_fibers中的元素，解锁
+   * 1.依次从pinned队列、本地队列、全局队列m_fibers、其他线程的本地队列取出任务
    * a.如果当前的可执行对象没有指定线程且不是当前在跑的线程要执行的，就跳过。并且设置一个
    * bool信号量，如is_tickle以便通知其他线程来执行这个属于它们的可执行对象（任务）
    * b.如果当前的可执行对象是当前在跑的线程要执行的，检查协程体和回调函数是否为空，为空断言
@@ -200,33 +307,32 @@ void Scheduler::run() {
     // 是一个信号 没轮到当前线程执行任务 就要发出信号通知下一个线程去处理
     bool tickle_me = false;
     bool is_active = false;
-    // 加锁
-    {
-      // 取出 待执行(即将要执行或者计划要执行)的协程队列m_fibers 的元素
-      MutexType::Lock lock(m_mutex);
-      auto it = m_fibers.begin();
-      while (it != m_fibers.end()) {
-        // a.当前任务没有指定线程执行 且 不是我当前线程要处理的协程
-        // 跳过，不需要处理
-        if (it->thread != -1 && it->thread != bin::GetThreadId()) {
-          ++it;
-          tickle_me = true;
-          continue;
-        }
-        BIN_ASSERT(it->fiber || it->cb); // fiber 和 回调函数至少有一个
-        // fiber正在执行状态，也不需要处理
-        if (it->fiber && it->fiber->getState() == Fiber::EXEC) {
-          ++it;
-          continue;
-        }
-        // b.是我当前线程要处理的任务/协程 就取出并且删除
-        ft = *it;
-        m_fibers.erase(it++);
-        ++m_activeThreadCount;
-        is_active = true;
-        break;
-      }
-      tickle_me |= it != m_fibers.end(); // tickle_me |= (it != m_fibers.end());
+    // 先计入活跃线程，任务从队列取出到开始执行之间stopping()不会误判
+    ++m_activeThreadCount;
+    // 找任务期间算作spinning，新任务不必唤醒别的线程
+    ++m_spinningCount;
+    bool global_first = ++pick_count % s_globalCheckInterval == 0;
+    if (global_first) {
+      is_active = takeGlobal(ft, tickle_me);
+    }
+    if (!is_active) {
+      is_active = takePinned(ft, tickle_me);
+    }
+    if (!is_active) {
+      is_active = takeLocal(ft, tickle_me);
+    }
+    if (!is_active && !global_first) {
+      is_active = takeGlobal(ft, tickle_me);
+    }
+    if (!is_active) {
+      is_active = steal(ft);
+    }
+    --m_spinningCount;
+    if (!is_active) {
+      --m_activeThreadCount;
+    } else if (m_elastic) {
+      t_idle_since_us = 0;
+      observeLatency(ft.enqueueUs);
     }
     if (tickle_me)
       tickle();
@@ -239,32 +345,56 @@ void Scheduler::run() {
       ft.fiber->swapIn(); // 让它执行，执行完做处理
       --m_activeThreadCount;
       // 从上面语句调回之后的处理 分为 还需要继续执行 和 需要挂起
+      // 主动让出的协程放回全局队列，放本地队列尾部会被自己马上再取出来
       if (ft.fiber->getState() == Fiber::READY) {
-        schedule(ft.fiber);
+        if (requeue(ft)) {
+          tickle();
+        }
       } else if (ft.fiber->getState() != Fiber::TERM &&
                  ft.fiber->getState() != Fiber::EXCEPT) {
         ft.fiber->m_state = Fiber::HOLD; // 协程状态置为HOLD
+      } else {
+        // 挂起过的回调协程在这里结束，放回协程池给下一个回调用
+        Fiber::Recycle(ft.fiber);
       }
       // 可执行对象置空
       ft.reset();
     }
-    // b. 如果要执行的任务是函数
+    // b. 保证不会让出的函数，直接在调度协程的栈上执行，不切换协程
+    else if (ft.cb && ft.inlined) {
+      Task cb(std::move(ft.cb));
+      ft.reset();
+      Fiber::SetInlineTask(true);
+      try {
+        cb();
+      } catch (std::exception &ex) {
+        BIN_LOG_ERROR(g_logger) << "inline task except: " << ex.what();
+      } catch (...) {
+        BIN_LOG_ERROR(g_logger) << "inline task except";
+      }
+      Fiber::SetInlineTask(false);
+      ++m_inlineCount;
+      --m_activeThreadCount;
+    }
+    // c. 如果要执行的任务是函数
     else if (ft.cb) {
       BIN_LOG_INFO(g_logger) << "待执行对象: cb";
       if (cb_fiber) { // 协程体的指针不为空就继续利用现有空间
-        cb_fiber->reset(
-            ft.cb); // power:
-                    // 执行Fiber的reset()函数，上下文切换。重置协程函数，并重置状态
-      } else {      // 为空就重新开辟
-        cb_fiber.reset(new Fiber(ft.cb)); // 智能指针的reset()函数
+        cb_fiber->reset(std::move(
+            ft.cb)); // power:
+                     // 执行Fiber的reset()函数，上下文切换。重置协程函数，并重置状态
+      } else { // 为空就从协程池取，池里没有才重新开辟
+        cb_fiber = Fiber::Create(std::move(ft.cb), m_sharedStack);
       }
       ft.reset(); // FiberAndThread的reset函数 可执行对象置空
       cb_fiber->swapIn();
       --m_activeThreadCount;
       // 从上面语句调回之后的处理 分为 还需要继续执行 和 需要挂起
       if (cb_fiber->getState() == Fiber::READY) {
-        schedule(cb_fiber);
-        cb_fiber.reset(); // 智能指针置空
+        FiberAndThread ready(&cb_fiber, -1);
+        if (requeue(ready)) {
+          tickle();
+        }
       } else if (cb_fiber->getState() == Fiber::EXCEPT ||
                  cb_fiber->getState() == Fiber::TERM) {
         cb_fiber->reset(nullptr); // 把执行任务置为空
@@ -272,7 +402,7 @@ void Scheduler::run() {
         cb_fiber->m_state = Fiber::HOLD; // 状态置为 HOLD
         cb_fiber.reset();                // 智能指针置空
       }
-    } else { // c.没有任务需要执行  去执行idle() --->代表空转 然后设置为hold状态
+    } else { // d.没有任务需要执行  去执行idle() --->代表空转 然后设置为hold状态
       // BIN_LOG_INFO(g_logger)
       //     << "无任务执行，空转: idle() " << is_active << " "
       //     << m_activeThreadCount << " " << idle_fiber->getState();
@@ -282,10 +412,41 @@ void Scheduler::run() {
       }
       // 负责idle()的协程结束了 说明当前线程也结束了直接break
       if (idle_fiber->getState() == Fiber::TERM) {
+        // 空闲退出：交出槽位，这期间又来了指定给它的任务就继续工作
+        if (t_retiring) {
+          t_retiring = false;
+          if (!m_stopping && !retireWorker()) {
+            t_idle_since_us = GetMonotonicUS();
+            idle_fiber->reset(std::bind(&Scheduler::idle, this));
+            continue;
+          }
+          BIN_LOG_INFO(g_logger) << "worker retired, threads=" << getThreadCount();
+        }
         BIN_LOG_INFO(g_logger) << "idle fiber term";
+        t_worker_index = -1;
+        // stop()的tickle可能早于最后一个任务完成，接力唤醒还在等待的线程
+        tickle();
         break;
       }
+      // 空闲太久，线程数多于下限时退出；有挂起的共享栈协程的线程不能退出
+      if (m_elastic) {
+        if (!t_idle_since_us) {
+          t_idle_since_us = GetMonotonicUS();
+        } else if (getIdleRetireUS() == 0) {
+          if (Fiber::SharedStackLiveCount() == 0 && !hasPendingTasks()) {
+            t_retiring = true;
+          } else {
+            t_idle_since_us = GetMonotonicUS();
+          }
+        }
+      }
       ++m_idleThreadCount;
+      // 计入空闲后再检查一次队列：schedule()是先入队再看有没有空闲线程，
+      // 两边交叉检查，任务不会在没人被唤醒的情况下留在队列里
+      if (hasPendingTasks()) {
+        --m_idleThreadCount;
+        continue;
+      }
       idle_fiber->swapIn();
       --m_idleThreadCount;
       if (idle_fiber->getState() != Fiber::TERM &&
@@ -304,17 +465,372 @@ void Scheduler::run() {
  *   执行的时候要调用tickle()去唤醒线程执行这些任务
  * ● stop()准备关闭调度器时候，要把所有创建的线程唤醒，去让他们退出
  */
-void Scheduler::tickle() { BIN_LOG_INFO(g_logger) << "tickle"; }
+void Scheduler::tickle(int thread) { BIN_LOG_INFO(g_logger) << "tickle"; }
 
-bool Scheduler::stopping() {
+int Scheduler::GetWorkerIndex() { return t_worker_index; }
+
+bool Scheduler::retiring() { return t_retiring; }
+
+uint64_t Scheduler::getIdleRetireUS() {
+  if (!m_elastic || t_worker_index < 0 ||
+      t_worker_index >= (int)m_maxThreadCount || !t_idle_since_us ||
+      m_liveThreadCount <= m_threadCount) {
+    return ~0ull;
+  }
+  uint64_t retire_us = (uint64_t)g_idle_retire_ms->getValue() * 1000;
+  uint64_t idle_us = GetMonotonicUS() - t_idle_since_us;
+  return idle_us >= retire_us ? 0 : retire_us - idle_us;
+}
+
+Thread::ptr Scheduler::createWorker(size_t i) {
+  // hack: 协程是Scheduler::run，线程还是Scheduler::run
+  return Thread::ptr(new Thread(
+      [this, i]() {
+        t_worker_index = (int)i;
+        run();
+      },
+      m_name + "_" + std::to_string(i), ThreadCpus(m_cpus, m_pinEach, i)));
+}
+
+void Scheduler::observeLatency(uint64_t enqueue_us) {
+  if (!enqueue_us) {
+    return;
+  }
+  uint64_t now = GetMonotonicUS();
+  uint64_t latency = now > enqueue_us ? now - enqueue_us : 0;
+  // 1/8权重的滑动平均，并发更新丢掉一次采样无所谓
+  uint64_t avg = m_queueLatencyUs.load(std::memory_order_relaxed);
+  avg = avg - avg / 8 + latency / 8;
+  m_queueLatencyUs.store(avg, std::memory_order_relaxed);
+  maybeGrow(avg, now);
+}
+
+void Scheduler::maybeGrow(uint64_t latency_us, uint64_t now_us) {
+  if (latency_us < g_grow_latency_us->getValue() ||
+      m_liveThreadCount >= m_maxThreadCount || m_idleThreadCount > 0) {
+    return;
+  }
+  uint64_t last = m_lastGrowUs;
+  if (now_us - last < (uint64_t)g_grow_interval_ms->getValue() * 1000 ||
+      !m_lastGrowUs.compare_exchange_strong(last, now_us)) {
+    return;
+  }
+  spawnWorker();
+}
+
+bool Scheduler::spawnWorker() {
+  // 持锁创建线程，和stop()交换m_threads互斥；有间隔限制，很少发生
   MutexType::Lock lock(m_mutex);
-  return m_autoStop && m_stopping && m_fibers.empty() &&
-         m_activeThreadCount == 0;
+  if (m_stopping || m_liveThreadCount >= m_maxThreadCount) {
+    return false;
+  }
+  for (size_t i = 0; i < m_maxThreadCount; ++i) {
+    if (m_threads[i] && !m_workers[i]->retired) {
+      continue;
+    }
+    // 退出的线程交出槽位后马上就结束了
+    if (m_threads[i]) {
+      m_threads[i]->join();
+      m_threads[i].reset();
+    }
+    ++m_liveThreadCount;
+    try {
+      m_threads[i] = createWorker(i);
+    } catch (std::exception &ex) {
+      --m_liveThreadCount;
+      BIN_LOG_ERROR(g_logger) << "add worker fail: " << ex.what();
+      return false;
+    }
+    m_threadIds.push_back(m_threads[i]->getId());
+    ++m_growCount;
+    BIN_LOG_INFO(g_logger) << "worker added, threads=" << getThreadCount()
+                           << " queue_latency_us=" << m_queueLatencyUs;
+    return true;
+  }
+  return false;
+}
+
+bool Scheduler::retireWorker() {
+  WorkerQueue &q = *m_workers[t_worker_index];
+  MutexType::Lock lock(m_mutex);
+  if (m_liveThreadCount <= m_threadCount) {
+    return false;
+  }
+  {
+    Spinlock::Lock qlock(q.mutex);
+    if (!q.tasks.empty() || !q.pinned.empty()) {
+      return false;
+    }
+    q.retired = true;
+  }
+  --m_liveThreadCount;
+  ++m_retireCount;
+  m_threadIds.erase(
+      std::remove(m_threadIds.begin(), m_threadIds.end(), bin::GetThreadId()),
+      m_threadIds.end());
+  return true;
+}
+
+int Scheduler::getWorkerIndex(int thread) {
+  for (size_t i = 0; i < m_workers.size(); ++i) {
+    if (m_workers[i]->threadId == thread) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+Scheduler::WorkerQueue *Scheduler::findWorker(int thread) {
+  // 只遍历线程数个队列，和队列里的任务数无关
+  for (auto &i : m_workers) {
+    if (i->threadId == thread) {
+      return i.get();
+    }
+  }
+  return nullptr;
+}
+
+bool Scheduler::enqueue(FiberAndThread &ft) {
+  // 先计数再入队，stopping()不会在任务可见前看到空队列
+  ++m_taskCount;
+  ++m_scheduledCount;
+  uint64_t now = 0;
+  if (m_elastic) {
+    ft.enqueueUs = now = GetMonotonicUS();
+  }
+  if (ft.thread != -1) {
+    WorkerQueue *q = findWorker(ft.thread);
+    if (q) {
+      Spinlock::Lock lock(q->mutex);
+      if (!q->retired) {
+        bool need_tickle = q->pinned.empty();
+        q->pinned.push_back(std::move(ft));
+        ++q->pinnedSize;
+        ++m_pinnedCount;
+        return need_tickle;
+      }
+      // 线程已经空闲退出，改为任意线程执行
+      ft.thread = -1;
+    }
+  }
+  if (ft.thread == -1 && t_scheduler == this && t_worker_index >= 0) {
+    WorkerQueue &q = *m_workers[t_worker_index];
+    Spinlock::Lock lock(q.mutex);
+    bool need_tickle = q.tasks.empty();
+    q.tasks.push_back(std::move(ft));
+    ++q.size;
+    return need_tickle;
+  }
+  MutexType::Lock lock(m_mutex);
+  bool need_tickle = m_fibers.empty();
+  // 所有线程都在忙，最老的任务等太久时增加线程，不用等到它被取出
+  uint64_t oldest = need_tickle || m_idleThreadCount > 0
+                        ? 0
+                        : m_fibers.front().enqueueUs;
+  m_fibers.push_back(std::move(ft));
+  ++m_globalCount;
+  lock.unlock();
+  if (oldest && now > oldest) {
+    maybeGrow(now - oldest, now);
+  }
+  return need_tickle;
+}
+
+void Scheduler::scheduleBatch(std::vector<FiberAndThread> &tasks) {
+  bool need_tickle = false;
+  size_t n = 0;
+  // 指定了线程的任务走pinned队列，各自唤醒目标线程
+  for (auto &i : tasks) {
+    if (i.thread != -1) {
+      if (enqueue(i)) {
+        tickle(i.thread);
+      }
+      i.reset();
+    } else if (i.fiber || i.cb) {
+      ++n;
+    }
+  }
+  if (n == 0) {
+    tasks.clear();
+    return;
+  }
+  m_taskCount += n;
+  m_scheduledCount += n;
+  if (m_elastic) {
+    uint64_t now = GetMonotonicUS();
+    for (auto &i : tasks) {
+      i.enqueueUs = now;
+    }
+  }
+  if (t_scheduler == this && t_worker_index >= 0) {
+    WorkerQueue &q = *m_workers[t_worker_index];
+    Spinlock::Lock lock(q.mutex);
+    need_tickle = q.tasks.empty();
+    for (auto &i : tasks) {
+      if (i.fiber || i.cb) {
+        q.tasks.push_back(std::move(i));
+      }
+    }
+    q.size += n;
+  } else {
+    MutexType::Lock lock(m_mutex);
+    need_tickle = m_fibers.empty();
+    for (auto &i : tasks) {
+      if (i.fiber || i.cb) {
+        m_fibers.push_back(std::move(i));
+      }
+    }
+    m_globalCount += n;
+  }
+  tasks.clear();
+  if (need_tickle) {
+    tickle();
+  }
+}
+
+bool Scheduler::requeue(FiberAndThread &ft) {
+  ++m_taskCount;
+  if (m_elastic) {
+    ft.enqueueUs = GetMonotonicUS();
+  }
+  MutexType::Lock lock(m_mutex);
+  bool need_tickle = m_fibers.empty();
+  m_fibers.push_back(std::move(ft));
+  ++m_globalCount;
+  return need_tickle;
+}
+
+bool Scheduler::takePinned(FiberAndThread &ft, bool &tickle_me) {
+  if (t_worker_index < 0) {
+    return false;
+  }
+  WorkerQueue &q = *m_workers[t_worker_index];
+  if (q.pinnedSize == 0) {
+    return false;
+  }
+  Spinlock::Lock lock(q.mutex);
+  if (q.pinned.empty()) {
+    return false;
+  }
+  // switchTo()过来的协程可能还没从原线程切出，留在队头，稍后再取
+  FiberAndThread &front = q.pinned.front();
+  if (front.fiber && front.fiber->getState() == Fiber::EXEC) {
+    return false;
+  }
+  ft = std::move(front);
+  q.pinned.pop_front();
+  --q.pinnedSize;
+  --m_pinnedCount;
+  --m_taskCount;
+  return true;
+}
+
+bool Scheduler::takeLocal(FiberAndThread &ft, bool &tickle_me) {
+  if (t_worker_index < 0) {
+    return false;
+  }
+  WorkerQueue &q = *m_workers[t_worker_index];
+  if (q.size == 0) {
+    return false;
+  }
+  {
+    Spinlock::Lock lock(q.mutex);
+    if (q.tasks.empty()) {
+      return false;
+    }
+    ft = std::move(q.tasks.back());
+    q.tasks.pop_back();
+    --q.size;
+    --m_taskCount;
+    // 还有剩余任务，让空闲线程来偷
+    tickle_me |= !q.tasks.empty();
+  }
+  // 协程在别的线程上schedule了自己但还没切出，交给全局队列等它切出
+  if (ft.fiber && ft.fiber->getState() == Fiber::EXEC) {
+    tickle_me |= requeue(ft);
+    ft.reset();
+    return false;
+  }
+  return true;
+}
+
+bool Scheduler::takeGlobal(FiberAndThread &ft, bool &tickle_me) {
+  if (m_globalCount == 0) {
+    return false;
+  }
+  bool found = false;
+  MutexType::Lock lock(m_mutex);
+  auto it = m_fibers.begin();
+  while (it != m_fibers.end()) {
+    // 目标线程还没开始run()时，指定线程的任务才会留在全局队列，跳过并通知其他线程
+    if (it->thread != -1 && it->thread != bin::GetThreadId()) {
+      ++it;
+      tickle_me = true;
+      continue;
+    }
+    BIN_ASSERT(it->fiber || it->cb); // fiber 和 回调函数至少有一个
+    // fiber正在执行状态，也不需要处理
+    if (it->fiber && it->fiber->getState() == Fiber::EXEC) {
+      ++it;
+      continue;
+    }
+    ft = std::move(*it);
+    m_fibers.erase(it++);
+    --m_globalCount;
+    --m_taskCount;
+    found = true;
+    break;
+  }
+  tickle_me |= it != m_fibers.end();
+  return found;
+}
+
+bool Scheduler::steal(FiberAndThread &ft) {
+  size_t n = m_workers.size();
+  size_t self = t_worker_index >= 0 ? t_worker_index : 0;
+  for (size_t i = 1; i <= n; ++i) {
+    size_t victim = (self + i) % n;
+    if ((int)victim == t_worker_index) {
+      continue;
+    }
+    WorkerQueue &q = *m_workers[victim];
+    if (q.size == 0) {
+      continue;
+    }
+    Spinlock::Lock lock(q.mutex);
+    if (q.tasks.empty()) {
+      continue;
+    }
+    // 队头的协程还没从原线程切出，这次先不偷
+    FiberAndThread &front = q.tasks.front();
+    if (front.fiber && front.fiber->getState() == Fiber::EXEC) {
+      continue;
+    }
+    ft = std::move(front);
+    q.tasks.pop_front();
+    --q.size;
+    --m_taskCount;
+    return true;
+  }
+  return false;
+}
+
+bool Scheduler::hasPendingTasks() {
+  if (t_worker_index >= 0 && m_workers[t_worker_index]->pinnedSize) {
+    return true;
+  }
+  // 其他线程的pinned任务由它们自己处理
+  return m_taskCount > m_pinnedCount;
+}
+
+bool Scheduler::stopping() {
+  return m_autoStop && m_stopping && m_taskCount == 0 &&
+         m_activeThreadCount == 0 && m_externalWaits == 0;
 }
 
 void Scheduler::idle() {
   BIN_LOG_INFO(g_logger) << "idle";
-  while (!stopping()) {
+  while (!stopping() && !retiring()) {
     bin::Fiber::YieldToHold();
   }
 }
@@ -332,15 +848,35 @@ void Scheduler::switchTo(int thread) {
 
 std::ostream &Scheduler::dump(std::ostream &os) {
   os << "[Scheduler name=" << m_name << " size=" << m_threadCount
+     << " threads=" << m_liveThreadCount << "/" << m_maxThreadCount
+     << " grown=" << m_growCount << " retired=" << m_retireCount
+     << " queue_latency_us=" << m_queueLatencyUs
      << " active_count=" << m_activeThreadCount
      << " idle_count=" << m_idleThreadCount << " stopping=" << m_stopping
-     << " ]" << std::endl
+     << " tasks=" << m_taskCount << " global=" << m_globalCount
+     << " scheduled=" << m_scheduledCount << " idle_wakeups=" << m_idleWakeups
+     << " wakeups/task=" << getIdleWakeupsPerTask()
+     << " inline=" << m_inlineCount << " local=";
+  for (size_t i = 0; i < m_workers.size(); ++i) {
+    os << (i ? "," : "") << m_workers[i]->size;
+  }
+  os << " pinned=";
+  for (size_t i = 0; i < m_workers.size(); ++i) {
+    os << (i ? "," : "") << m_workers[i]->pinnedSize;
+  }
+  os << " ]" << std::endl
      << "    ";
-  for (size_t i = 0; i < m_threadIds.size(); ++i) {
+  // 线程数可以伸缩时m_threadIds会变化
+  std::vector<int> ids;
+  {
+    MutexType::Lock lock(m_mutex);
+    ids = m_threadIds;
+  }
+  for (size_t i = 0; i < ids.size(); ++i) {
     if (i) {
       os << ", ";
     }
-    os << m_threadIds[i];
+    os << ids[i];
   }
   return os;
 }
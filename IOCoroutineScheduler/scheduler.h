@@ -25,11 +25,29 @@
  *   2. schedule 是一个协程调度器，分配协程到相应的线程去执行目标代码
  *   a. 方式一：协程随机选择一个空闲的任意的线程上执行
  *   b. 方式二：给协程指定一个线程去执行
+ *
+ * 任务队列：
+ *   每个工作线程有自己的本地双端队列，工作线程内schedule()的任务放进本地队列，
+ *   线程自己从尾部取(LIFO，刚放进去的任务数据还在cache里)，空闲线程从头部偷(FIFO)。
+ *   指定了线程的任务直接放进目标线程的pinned队列，只有该线程会去取，不会被偷。
+ *   外部线程schedule()的任务放进全局注入队列m_fibers。
+ *   工作线程取任务的顺序：pinned队列 -> 本地队列 -> 全局队列 -> 偷其他线程的本地队列，
+ *   每取s_globalCheckInterval次任务先看一次全局队列，避免外部任务饿死。
+ *
+ * 弹性线程数：
+ *   max_threads大于threads时，线程数在[threads, max_threads]之间伸缩。任务的排队时间
+ *   (滑动平均，或者全局队列里最老的任务)超过scheduler.elastic.grow_latency_us、
+ *   又没有空闲线程时增加一个线程，两次增加至少间隔scheduler.elastic.grow_interval_ms；
+ *   空闲超过scheduler.elastic.idle_retire_ms的线程在多于threads时退出。
+ *   本地队列、时间轮等按max_threads预先分配，退出的线程交出的槽位给之后新增的线程用。
+ *   use_caller的线程不会退出；还有pinned任务、挂起的共享栈协程的线程不会退出；
+ *   指定给已退出线程的任务改为任意线程执行。
  */
 
 #ifndef __BIN_SCHEDULER_H__
 #define __BIN_SCHEDULER_H__
 
+#include <deque>
 #include <iostream>
 #include <list>
 #include <memory>
@@ -51,13 +69,51 @@ public:
    * @param threads 线程数量
    * @param use_caller 当前线程是否纳入调度队列，默认纳入调度
    * @param name 协程调度器名称
+   * @param max_threads 最多的线程数量(同threads包括use_caller的线程)，
+   *  大于threads时线程数随负载在[threads, max_threads]之间伸缩，默认固定为threads
+   * @param cpus 工作线程绑定的CPU，为空不绑定，见setCpuAffinity()。
+   *  工作线程创建时就绑定，线程栈和它自己分配的协程栈按first-touch落在本地NUMA节点上
+   * @param pin_each 是否每个线程只绑定一个CPU
    */
   Scheduler(size_t threads = 1, bool use_caller = true,
-            const std::string &name = "");
+            const std::string &name = "", size_t max_threads = 0,
+            const std::vector<int> &cpus = std::vector<int>(),
+            bool pin_each = true);
   virtual ~Scheduler();
 
   const std::string &getName() const { return m_name; }
 
+  /**
+   * @brief 设置以函数形式调度的任务是否运行在共享栈协程上
+   * @details 只影响之后新创建的任务协程；以协程形式调度的任务由创建者决定
+   */
+  void setSharedStack(bool v) { m_sharedStack = v; }
+  bool isSharedStack() const { return m_sharedStack; }
+
+  /**
+   * @brief 设置工作线程的CPU亲和性
+   * @details pin_each为true时第i个工作线程绑定到cpus[i % cpus.size()]，
+   *  否则每个工作线程都可以在整个cpus上运行。use_caller的调用线程不受影响。
+   *  已经start()的调度器(IOManager构造时就start())立即重新绑定已有线程，
+   *  线程栈、协程栈已经在原来运行的节点上分配，不会迁移；需要NUMA本地内存时
+   *  在构造函数里传入cpus。本地队列等每个线程的结构由构造调度器的线程分配，
+   *  不保证在本地节点上
+   * @param cpus CPU编号，为空取消绑定
+   * @param pin_each 是否每个线程只绑定一个CPU
+   */
+  void setCpuAffinity(const std::vector<int> &cpus, bool pin_each = true);
+  const std::vector<int> &getCpuAffinity() const { return m_cpus; }
+  bool isCpuPinEach() const { return m_pinEach; }
+
+  /**
+   * @brief 共享这个调度器的使用方(如TcpServer)按自己的配置绑定CPU
+   * @details 多个使用方绑定相同的CPU时计数，都releaseCpuAffinity()后恢复绑定之前
+   *  的设置。已经绑定到其他CPU(构造时指定的或者别的使用方绑定的)时不覆盖
+   * @return 是否持有了绑定，持有的要调用releaseCpuAffinity()
+   */
+  bool acquireCpuAffinity(const std::vector<int> &cpus);
+  void releaseCpuAffinity();
+
   static Scheduler *GetThis(); // 返回当前协程调度器，如果没有，创建第一个协程
   static Fiber *GetMainFiber(); // 返回当前协程调度器的调度协程
 
@@ -71,13 +127,32 @@ public:
    * @param thread 协程执行的线程id,-1标识任意线程
    */
   template <class FiberOrCb> void schedule(FiberOrCb fc, int thread = -1) {
-    bool need_tickle = false;
-    {
-      MutexType::Lock lock(m_mutex);
-      need_tickle = scheduleNoLock(fc, thread);
+    FiberAndThread ft(std::move(fc), thread);
+    if (!ft.fiber && !ft.cb) {
+      return;
     }
-    if (need_tickle) {
-      tickle();
+    // 共享栈协程会被改成绑定的线程，指定的线程已经退出时enqueue()会改成-1，
+    // 以ft里的为准(移动不会清掉thread)
+    if (enqueue(ft)) {
+      tickle(ft.thread);
+    }
+  }
+
+  /**
+   * @brief 调度一个保证不会让出的回调
+   * @details 工作线程在调度协程的栈上直接调用，不创建任务协程，省掉两次上下文切换。
+   *  适合计数、唤醒协程这类很短的回调；回调里不能有hook的阻塞调用、不能yield
+   * @param cb 回调函数
+   * @param thread 执行的线程id,-1标识任意线程
+   */
+  void scheduleInline(Task cb, int thread = -1) {
+    FiberAndThread ft(&cb, thread);
+    if (!ft.cb) {
+      return;
+    }
+    ft.inlined = true;
+    if (enqueue(ft)) {
+      tickle(ft.thread);
     }
   }
 
@@ -102,17 +177,114 @@ public:
     }
   }
 
+  /**
+   * @brief 记一个挂起后由调度器外的线程恢复的协程(比如offload())，恢复前调度器不会停止
+   * @details 恢复时先schedule()协程再调用endExternalWait()
+   */
+  void beginExternalWait() { ++m_externalWaits; }
+  void endExternalWait() { --m_externalWaits; }
+
   void switchTo(int thread = -1);
   std::ostream &dump(std::ostream &os);
 
+  /**
+   * @brief 累计调度的任务数
+   */
+  uint64_t getScheduledCount() const { return m_scheduledCount; }
+
+  /**
+   * @brief 累计唤醒空闲线程的次数(真正发生的唤醒系统调用)
+   */
+  uint64_t getIdleWakeups() const { return m_idleWakeups; }
+
+  /**
+   * @brief 平均每个任务引起的空闲线程唤醒次数
+   */
+  double getIdleWakeupsPerTask() const {
+    uint64_t tasks = m_scheduledCount;
+    return tasks ? (double)m_idleWakeups / tasks : 0;
+  }
+
+  /**
+   * @brief 累计在调度协程栈上直接执行的inline任务数
+   */
+  uint64_t getInlineCount() const { return m_inlineCount; }
+
+  /**
+   * @brief 当前的线程数量(包括use_caller的线程)
+   */
+  size_t getThreadCount() const {
+    return m_liveThreadCount + (m_rootFiber ? 1 : 0);
+  }
+
+  /**
+   * @brief 最多的线程数量(包括use_caller的线程)
+   */
+  size_t getMaxThreadCount() const {
+    return m_maxThreadCount + (m_rootFiber ? 1 : 0);
+  }
+
+  /**
+   * @brief 累计因为排队时间过长增加的线程数
+   */
+  uint64_t getGrowCount() const { return m_growCount; }
+
+  /**
+   * @brief 累计因为空闲退出的线程数
+   */
+  uint64_t getRetireCount() const { return m_retireCount; }
+
+  /**
+   * @brief 任务排队时间的滑动平均(微秒)，只在线程数可以伸缩时统计
+   */
+  uint64_t getQueueLatencyUS() const { return m_queueLatencyUs; }
+
 protected:
   void setThis(); // 设置当前的协程调度器
   bool hasIdleThreads() { return m_idleThreadCount > 0; } // 是否有空闲线程
   void run();                                             // 协程调度函数
 
-  virtual void tickle(); // 线程唤醒，通知协程调度器有任务了，派生类中实现
+  /**
+   * @brief 线程唤醒，通知协程调度器有任务了，派生类中实现
+   * @param thread 任务指定的线程id，优先唤醒该线程；-1唤醒任意一个空闲线程
+   */
+  virtual void tickle(int thread = -1);
   virtual bool stopping(); // 线程清理回收，返回是否可以停止
 
+  /**
+   * @brief 是否还有当前线程可以执行的任务
+   */
+  bool hasPendingTasks();
+
+  /**
+   * @brief 当前线程在本调度器中的工作线程下标，不是工作线程返回-1
+   */
+  static int GetWorkerIndex();
+
+  /**
+   * @brief 线程id对应的工作线程下标，还没开始run()的线程返回-1
+   */
+  int getWorkerIndex(int thread);
+
+  /**
+   * @brief 工作线程槽位数量(包括use_caller的线程)，按最多的线程数，构造后就确定
+   */
+  size_t getWorkerCount() const {
+    return m_maxThreadCount + (m_rootFiber ? 1 : 0);
+  }
+
+  /**
+   * @brief 当前线程是否因为空闲太久要退出了，idle()看到后应该尽快返回
+   */
+  bool retiring();
+
+  /**
+   * @brief 当前线程还要空闲多久(微秒)才可以退出
+   * @details idle()的阻塞时间不超过它，醒来后由run()决定是否退出。
+   *  不会退出的线程(线程数不能伸缩、use_caller的线程、已经是下限)返回~0ull
+   */
+  uint64_t getIdleRetireUS();
+
   // 协程无任务可调度时执行idle协程，借助epoll_wait来唤醒有任务可执行
   virtual void idle();
 
@@ -126,29 +298,35 @@ private:
    */
   template <class FiberOrCb> bool scheduleNoLock(FiberOrCb fc, int thread) {
     bool need_tickle = m_fibers.empty();
-    FiberAndThread ft(fc, thread);
+    FiberAndThread ft(std::move(fc), thread);
     if (ft.fiber || ft.cb) {
-      m_fibers.push_back(ft);
+      m_fibers.push_back(std::move(ft));
+      ++m_globalCount;
+      ++m_taskCount;
+      ++m_scheduledCount;
     }
     return need_tickle;
   }
 
-private:
+protected:
   /**
    * @brief 封装一个自定义的可执行对象结构体，来封装 协程/函数/线程组
    * @details 调度器调度执行的不仅为Fiber协程体，还可以是一个function可调用对象
    */
   struct FiberAndThread {
     Fiber::ptr fiber;         /// 协程
-    std::function<void()> cb; /// 协程执行函数
+    Task cb;                  /// 协程执行函数，不会拷贝，小的闭包不分配内存
     int thread;               /// 线程id
+    bool inlined = false;     /// cb不会让出，在调度协程的栈上直接执行
+    uint64_t enqueueUs = 0;   /// 入队时间，只在线程数可以伸缩时记录
 
     /**
      * @brief 构造函数，f协程在thr这个线程上运行
      * @param[in] f 协程
      * @param[in] thr 线程id
      */
-    FiberAndThread(Fiber::ptr f, int thr) : fiber(f), thread(thr) {}
+    FiberAndThread(Fiber::ptr f, int thr)
+        : fiber(f), thread(BindThread(f, thr)) {}
 
     /**
      * @brief 构造函数
@@ -169,6 +347,7 @@ private:
        * 用SP to SP，违背了SP利用局部变量生命周期管理heap内存的初衷
        */
       fiber.swap(*f); // 减少一次智能指针引用
+      thread = BindThread(fiber, thr);
     }
 
     /**
@@ -176,7 +355,7 @@ private:
      * @param[in] f 协程执行函数
      * @param[in] thr 线程id
      */
-    FiberAndThread(std::function<void()> f, int thr) : cb(f), thread(thr) {}
+    FiberAndThread(Task f, int thr) : cb(std::move(f)), thread(thr) {}
 
     /**
      * @brief 构造函数
@@ -184,15 +363,21 @@ private:
      * @param[in] thr 线程id
      * @post *f = nullptr
      */
-    FiberAndThread(std::function<void()> *f, int thr) : thread(thr) {
-      cb.swap(*f); // 减少一次智能指针引用
-    }
+    FiberAndThread(Task *f, int thr) : cb(std::move(*f)), thread(thr) {}
 
     /**
      * @brief 无参构造函数,和STL结合必须有默认构造函数，不然分配的对象无法初始化
      */
     FiberAndThread() : thread(-1) {}
 
+    /**
+     * @brief 共享栈协程运行过后只能在绑定的线程上恢复，忽略指定的线程
+     */
+    static int BindThread(const Fiber::ptr &f, int thr) {
+      int bound = f ? f->getSharedStackThread() : -1;
+      return bound != -1 ? bound : thr;
+    }
+
     /**
      * @brief 重置数据
      */
@@ -200,24 +385,139 @@ private:
       fiber = nullptr;
       cb = nullptr;
       thread = -1;
+      inlined = false;
+      enqueueUs = 0;
     }
   };
 
+  /**
+   * @brief 批量添加任务：未指定线程的任务一次加锁放进同一个队列，最多唤醒一次
+   * @param tasks 任务数组，调用后清空
+   */
+  void scheduleBatch(std::vector<FiberAndThread> &tasks);
+
+private:
+  /**
+   * @brief 记下绑定的CPU并重新绑定已有的工作线程，调用方持有m_mutex
+   */
+  void pinThreads(const std::vector<int> &cpus, bool pin_each);
+
+  /**
+   * @brief 工作线程的本地任务队列
+   */
+  struct WorkerQueue {
+    Spinlock mutex;                    /// 自旋锁，临界区只有一次deque操作
+    std::deque<FiberAndThread> tasks;  /// owner从尾部取，窃取者从头部取
+    std::atomic<size_t> size{0};       /// 任务数，不加锁判断是否值得去偷
+    std::deque<FiberAndThread> pinned; /// 指定在该线程执行的任务，FIFO
+    std::atomic<size_t> pinnedSize{0}; /// pinned任务数
+    std::atomic<int> threadId{-1};     /// 认领该队列的线程id
+    bool retired = false; /// 线程已经空闲退出，指定给它的任务改为任意线程执行
+  };
+
+  /**
+   * @brief 查找线程id对应的工作线程队列
+   * @return 没有找到(线程还没开始run或不属于该调度器)返回nullptr
+   */
+  WorkerQueue *findWorker(int thread);
+
+  /**
+   * @brief 添加一个任务，工作线程放入自己的本地队列，否则放入全局队列
+   * @return 是否需要tickle
+   */
+  bool enqueue(FiberAndThread &ft);
+
+  /**
+   * @brief 从当前线程的pinned队列头部取任务
+   */
+  bool takePinned(FiberAndThread &ft, bool &tickle_me);
+
+  /**
+   * @brief 从当前线程的本地队列尾部取任务
+   */
+  bool takeLocal(FiberAndThread &ft, bool &tickle_me);
+
+  /**
+   * @brief 从全局队列取一个当前线程可以执行的任务
+   */
+  bool takeGlobal(FiberAndThread &ft, bool &tickle_me);
+
+  /**
+   * @brief 从其他工作线程的本地队列头部偷一个任务
+   */
+  bool steal(FiberAndThread &ft);
+
+  /**
+   * @brief 把任务放回全局队列：还在其他线程上执行的协程、主动让出的协程
+   * @return 是否需要tickle
+   */
+  bool requeue(FiberAndThread &ft);
+
+  /**
+   * @brief 创建第i个槽位的工作线程
+   */
+  Thread::ptr createWorker(size_t i);
+
+  /**
+   * @brief 记录一个任务的排队时间，滑动平均超过阈值时尝试增加线程
+   * @param enqueue_us 任务入队的时间，0表示没有记录
+   */
+  void observeLatency(uint64_t enqueue_us);
+
+  /**
+   * @brief 排队时间超过阈值、没有空闲线程、距上次增加足够久时增加一个线程
+   */
+  void maybeGrow(uint64_t latency_us, uint64_t now_us);
+
+  /**
+   * @brief 在一个空闲的槽位上增加一个工作线程
+   * @return 是否增加了
+   */
+  bool spawnWorker();
+
+  /**
+   * @brief 当前线程交出槽位准备退出
+   * @return false 线程数已经是下限，或者退出前又来了指定给它的任务
+   */
+  bool retireWorker();
+
 protected:
-  size_t m_threadCount = 0;                   /// 线程总数
-  std::vector<Thread::ptr> m_threads;         /// 线程池
+  size_t m_threadCount = 0;                   /// 最少的线程数(除主线程)
+  size_t m_maxThreadCount = 0;                /// 最多的线程数(除主线程)
+  bool m_elastic = false;                     /// 线程数是否随负载伸缩
+  std::atomic<size_t> m_liveThreadCount{0};   /// 当前的线程数(除主线程)
+  std::vector<Thread::ptr> m_threads;         /// 线程池，按槽位，没有线程的为空
   std::vector<int> m_threadIds;               /// 线程id数组(除主线程)
+  std::vector<int> m_cpus;                    /// 工作线程绑定的CPU
+  bool m_pinEach = true;                      /// 每个线程是否只绑定一个CPU
   std::atomic<size_t> m_activeThreadCount{0}; /// 工作线程数量
   std::atomic<size_t> m_idleThreadCount{0};   /// 空闲线程数量
   Fiber::ptr m_rootFiber; /// use_caller=true时，调度器所在线程的调度协程
   int m_rootThread = 0; /// use_caller=true时，调度器所在线程的线程id
   bool m_stopping = true;  /// 是否正在停止
   bool m_autoStop = false; /// 是否自动停止
+  std::atomic<size_t> m_spinningCount{0}; /// 正在找任务的线程数，这时不用唤醒
+  std::atomic<uint64_t> m_scheduledCount{0}; /// 累计调度的任务数
+  std::atomic<uint64_t> m_idleWakeups{0};    /// 累计唤醒空闲线程的次数
+  std::atomic<uint64_t> m_inlineCount{0};    /// 累计直接执行的inline任务数
+  std::atomic<size_t> m_externalWaits{0}; /// 等待外部线程恢复的协程数
+  std::atomic<bool> m_sharedStack{false}; /// 任务协程是否使用共享栈
+  std::atomic<uint64_t> m_queueLatencyUs{0}; /// 任务排队时间的滑动平均
+  std::atomic<uint64_t> m_lastGrowUs{0};     /// 上次增加线程的时间
+  std::atomic<uint64_t> m_growCount{0};      /// 累计增加的线程数
+  std::atomic<uint64_t> m_retireCount{0};    /// 累计空闲退出的线程数
 
 private:
-  MutexType m_mutex;                  /// 锁
-  std::string m_name;                 /// 协程调度器名称
-  std::list<FiberAndThread> m_fibers; /// 协程任务队列
+  MutexType m_mutex;                    /// 锁，保护全局队列
+  std::string m_name;                   /// 协程调度器名称
+  std::list<FiberAndThread> m_fibers;   /// 全局注入队列
+  std::atomic<size_t> m_globalCount{0}; /// 全局队列任务数
+  std::atomic<size_t> m_taskCount{0};   /// 所有队列中的任务总数
+  std::atomic<size_t> m_pinnedCount{0}; /// 所有pinned队列中的任务总数
+  std::vector<std::unique_ptr<WorkerQueue>> m_workers; /// 工作线程本地队列
+  std::vector<int> m_oldCpus; /// acquireCpuAffinity()之前的绑定，都释放后恢复
+  bool m_oldPinEach = true;
+  int m_cpuRefs = 0;          /// acquireCpuAffinity()的计数
 };
 
 class SchedulerSwitcher : public Noncopyable {
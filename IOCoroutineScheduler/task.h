@@ -0,0 +1,156 @@
+/**
+ * @file task.h
+ * @author yinyb (990900296@qq.com)
+ * @brief 只能移动的任务类型
+ *  调度器、事件回调、到期定时器使用的void()可调用对象。std::function只有16字节的
+ *  内部缓冲区，std::bind(&TcpServer::handleClient, shared_from_this(), client)
+ *  这类闭包每次调度都要分配内存。Task内部缓冲区INLINE_SIZE字节，放得下的可调用对象
+ *  不分配内存；只要求可移动，不要求可拷贝
+ * @version 1.0
+ * @date 2022-04-04
+ * @copyright Copyright (c) {2022}
+ */
+
+#ifndef __BIN_TASK_H__
+#define __BIN_TASK_H__
+
+#include <cstddef>
+#include <functional>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+namespace bin {
+
+class Task {
+public:
+  /// 内部缓冲区大小，超过的可调用对象放在堆上
+  static const size_t INLINE_SIZE = 56;
+
+  Task() {}
+  Task(std::nullptr_t) {}
+
+  /**
+   * @brief 从任意void()可调用对象构造，空的std::function/函数指针得到空任务
+   */
+  template <class F, class Fn = typename std::decay<F>::type,
+            class = typename std::enable_if<
+                !std::is_same<Fn, Task>::value &&
+                std::is_void<decltype(std::declval<Fn &>()(), void())>::value>::type>
+  Task(F &&f) {
+    if (IsNull<Fn>(f, std::integral_constant<bool, Nullable<Fn>::value>())) {
+      return;
+    }
+    Store<Fn>(std::forward<F>(f), std::integral_constant<bool, FitsInline<Fn>()>());
+  }
+
+  Task(Task &&other) { moveFrom(other); }
+
+  Task &operator=(Task &&other) {
+    if (this != &other) {
+      clear();
+      moveFrom(other);
+    }
+    return *this;
+  }
+
+  Task &operator=(std::nullptr_t) {
+    clear();
+    return *this;
+  }
+
+  Task(const Task &) = delete;
+  Task &operator=(const Task &) = delete;
+
+  ~Task() { clear(); }
+
+  void operator()() { m_ops->call(m_buf); }
+
+  explicit operator bool() const { return m_ops != nullptr; }
+
+  void swap(Task &other) {
+    Task tmp(std::move(other));
+    other = std::move(*this);
+    *this = std::move(tmp);
+  }
+
+  /**
+   * @brief 可调用对象是否存放在内部缓冲区(没有分配内存)
+   */
+  bool isInline() const { return m_ops && m_ops->inlined; }
+
+private:
+  struct Ops {
+    void (*call)(void *buf);
+    void (*move)(void *dst, void *src); // 移动到dst并析构src
+    void (*destroy)(void *buf);
+    bool inlined;
+  };
+
+  template <class Fn> static constexpr bool FitsInline() {
+    return sizeof(Fn) <= INLINE_SIZE &&
+           alignof(Fn) <= alignof(std::max_align_t) &&
+           std::is_nothrow_move_constructible<Fn>::value;
+  }
+
+  // 函数指针和std::function可能是空的
+  template <class Fn> struct Nullable : std::is_pointer<Fn> {};
+  template <class R>
+  struct Nullable<std::function<R()>> : std::true_type {};
+
+  template <class Fn> static bool IsNull(const Fn &f, std::true_type) {
+    return !f;
+  }
+  template <class Fn> static bool IsNull(const Fn &, std::false_type) {
+    return false;
+  }
+
+  // 放在内部缓冲区
+  template <class Fn, class F> void Store(F &&f, std::true_type) {
+    static const Ops ops = {
+        [](void *buf) { (*static_cast<Fn *>(buf))(); },
+        [](void *dst, void *src) {
+          new (dst) Fn(std::move(*static_cast<Fn *>(src)));
+          static_cast<Fn *>(src)->~Fn();
+        },
+        [](void *buf) { static_cast<Fn *>(buf)->~Fn(); }, true};
+    new (m_buf) Fn(std::forward<F>(f));
+    m_ops = &ops;
+  }
+
+  // 太大或者移动可能抛异常，放在堆上，缓冲区里只存指针
+  template <class Fn, class F> void Store(F &&f, std::false_type) {
+    static const Ops ops = {
+        [](void *buf) { (**static_cast<Fn **>(buf))(); },
+        [](void *dst, void *src) {
+          *static_cast<Fn **>(dst) = *static_cast<Fn **>(src);
+        },
+        [](void *buf) { delete *static_cast<Fn **>(buf); }, false};
+    *reinterpret_cast<Fn **>(m_buf) = new Fn(std::forward<F>(f));
+    m_ops = &ops;
+  }
+
+  void moveFrom(Task &other) {
+    if (other.m_ops) {
+      other.m_ops->move(m_buf, other.m_buf);
+      m_ops = other.m_ops;
+      other.m_ops = nullptr;
+    }
+  }
+
+  void clear() {
+    if (m_ops) {
+      const Ops *ops = m_ops;
+      m_ops = nullptr;
+      ops->destroy(m_buf);
+    }
+  }
+
+private:
+  alignas(std::max_align_t) unsigned char m_buf[INLINE_SIZE];
+  const Ops *m_ops = nullptr;
+};
+
+} // namespace bin
+
+#endif
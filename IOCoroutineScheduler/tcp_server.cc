@@ -1,6 +1,7 @@
 #include "tcp_server.h"
 #include "config.h"
 #include "log.h"
+#include "util.h"
 
 namespace bin {
 
@@ -9,6 +10,25 @@ namespace bin {
 
     static bin::Logger::ptr g_logger = BIN_LOG_NAME("system");
 
+    //cpus为空时保持调度器原来的设置。调度器已经绑定到其他CPU时不覆盖，返回是否持有了绑定
+    //多个服务器共用同一个调度器时由调度器计数，都释放后恢复原来的绑定
+    static bool ApplyCpuAffinity(IOManager* worker, const std::string& cpus){
+        if(!worker || cpus.empty()){
+            return false;
+        }
+        std::vector<int> list = ParseCpuList(cpus);
+        if(list.empty()){
+            BIN_LOG_WARN(g_logger) << "invalid cpu list: " << cpus;
+            return false;
+        }
+        if(!worker->acquireCpuAffinity(list)){
+            BIN_LOG_WARN(g_logger) << "worker " << worker->getName() << " already pinned, cpus="
+                << cpus << " ignored";
+            return false;
+        }
+        return true;
+    }
+
     TcpServer::TcpServer(bin::IOManager* worker, bin::IOManager* io_worker, bin::IOManager* accept_worker)
         :m_worker(worker)
         ,m_ioWorker(io_worker)
@@ -19,6 +39,9 @@ namespace bin {
     }
 
     TcpServer::~TcpServer(){
+        //没有stop()就析构时也要释放调度器的CPU绑定
+        for(auto worker : m_pinnedWorkers)
+            worker->releaseCpuAffinity();
         //关闭所有的监听套接字
         for(auto& i : m_listenSocks)
             i->close();
@@ -70,6 +93,15 @@ namespace bin {
             return true;
         }
         m_isStop = false;
+        //按配置把各调度器的工作线程放到指定的CPU上
+        if(m_conf){
+            if(ApplyCpuAffinity(m_acceptWorker, m_conf->accept_worker_cpus))
+                m_pinnedWorkers.push_back(m_acceptWorker);
+            if(ApplyCpuAffinity(m_ioWorker, m_conf->io_worker_cpus))
+                m_pinnedWorkers.push_back(m_ioWorker);
+            if(ApplyCpuAffinity(m_worker, m_conf->process_worker_cpus))
+                m_pinnedWorkers.push_back(m_worker);
+        }
         //开启服务器，给每个监听套接字分配一个执行函数startAccept()去监测客户端的新连接，将其作为任务加入到IO调度器m_acceptWorker去进行调度管理
         for(auto& sock : m_listenSocks)
             m_acceptWorker->schedule(std::bind(&TcpServer::startAccept, shared_from_this(), sock));
@@ -80,6 +112,9 @@ namespace bin {
     //停止服务器，通过往IO调度器m_acceptWorker中添加任务的形式，在该匿名任务中唤醒所有监听线程并且让协程调度停止、所有线程退出
     void TcpServer::stop(){
         m_isStop = true;
+        for(auto worker : m_pinnedWorkers)
+            worker->releaseCpuAffinity();
+        m_pinnedWorkers.clear();
         auto self = shared_from_this();
         m_acceptWorker->schedule([this, self](){
             //唤醒所有线程 进行退出。因为是accept不取消事件，不会唤醒
@@ -32,6 +32,13 @@ namespace bin {
         std::string accept_worker;
         std::string io_worker;
         std::string process_worker;
+        //工作调度器绑定的CPU，格式同ParseCpuList()："0-3,8"、"node1"，为空不绑定。
+        //调度器已经绑定到别的CPU(构造时指定或者另一个服务器设置过)时不覆盖，只告警；
+        //使用同一个调度器的服务器都停止(或析构)后恢复原来的绑定。
+        //这里是对运行中的线程重新绑定，需要NUMA本地内存时在IOManager构造时传入CPU
+        std::string accept_worker_cpus;
+        std::string io_worker_cpus;
+        std::string process_worker_cpus;
         std::map<std::string, std::string> args;
 
         bool isValid() const {
@@ -49,6 +56,9 @@ namespace bin {
                 && accept_worker == oth.accept_worker
                 && io_worker == oth.io_worker
                 && process_worker == oth.process_worker
+                && accept_worker_cpus == oth.accept_worker_cpus
+                && io_worker_cpus == oth.io_worker_cpus
+                && process_worker_cpus == oth.process_worker_cpus
                 && args == oth.args
                 && id == oth.id
                 && type == oth.type;
@@ -72,6 +82,9 @@ namespace bin {
             conf.accept_worker = node["accept_worker"].as<std::string>();
             conf.io_worker = node["io_worker"].as<std::string>();
             conf.process_worker = node["process_worker"].as<std::string>();
+            conf.accept_worker_cpus = node["accept_worker_cpus"].as<std::string>("");
+            conf.io_worker_cpus = node["io_worker_cpus"].as<std::string>("");
+            conf.process_worker_cpus = node["process_worker_cpus"].as<std::string>("");
             conf.args = LexicalCast<std::string
                 ,std::map<std::string, std::string> >()(node["args"].as<std::string>(""));
             if(node["address"].IsDefined()){
@@ -99,6 +112,9 @@ namespace bin {
             node["accept_worker"] = conf.accept_worker;
             node["io_worker"] = conf.io_worker;
             node["process_worker"] = conf.process_worker;
+            node["accept_worker_cpus"] = conf.accept_worker_cpus;
+            node["io_worker_cpus"] = conf.io_worker_cpus;
+            node["process_worker_cpus"] = conf.process_worker_cpus;
             node["args"] = YAML::Load(LexicalCast<std::map<std::string, std::string>
                 , std::string>()(conf.args));
             for(auto& i : conf.address){
@@ -161,6 +177,7 @@ namespace bin {
         bool m_isStop;                  //服务是否停止
         bool m_ssl = false;
         TcpServerConf::ptr m_conf;
+        std::vector<IOManager*> m_pinnedWorkers;    //start()时按配置绑定了CPU的调度器，stop()或析构时释放
     };
 
 }
@@ -7,6 +7,10 @@
  * @copyright Copyright (c) {2022}
  */
 
+#include <errno.h>
+#include <sched.h>
+#include <unistd.h>
+
 #include "thread.h"
 #include "log.h"
 #include "util.h"
@@ -32,7 +36,25 @@ void Thread::SetName(const std::string &name) {
   t_thread_name = name;
 }
 
-Thread::Thread(std::function<void()> cb, const std::string &name)
+// cpus为空时是所有在线CPU
+static void MakeCpuSet(const std::vector<int> &cpus, cpu_set_t &set) {
+  CPU_ZERO(&set);
+  if (cpus.empty()) {
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    for (long i = 0; i < n && i < CPU_SETSIZE; ++i) {
+      CPU_SET(i, &set);
+    }
+    return;
+  }
+  for (int i : cpus) {
+    if (i >= 0 && i < CPU_SETSIZE) {
+      CPU_SET(i, &set);
+    }
+  }
+}
+
+Thread::Thread(std::function<void()> cb, const std::string &name,
+               const std::vector<int> &cpus)
     : m_cb(cb), m_name(name) {
   if (name.empty())
     m_name = "UNKNOW";
@@ -41,7 +63,20 @@ Thread::Thread(std::function<void()> cb, const std::string &name)
   // 在调用pthread_create()线程API的时候，传入this指针，就能通过这个指针去访问到类中的成员，
   // 否则类成员静态方法中无法使用非静态成员变量。
   // 或者，另外写一个普通成员函数，在线程回调函数中去调用那个函数也能解决该问题.
-  int rt = pthread_create(&m_thread, nullptr, &Thread::run, this);
+  pthread_attr_t attr;
+  pthread_attr_init(&attr);
+  if (!cpus.empty()) {
+    cpu_set_t set;
+    MakeCpuSet(cpus, set);
+    pthread_attr_setaffinity_np(&attr, sizeof(set), &set);
+  }
+  int rt = pthread_create(&m_thread, &attr, &Thread::run, this);
+  pthread_attr_destroy(&attr);
+  if (rt == EINVAL && !cpus.empty()) {
+    // 指定的CPU都不可用，不绑定
+    BIN_LOG_WARN(g_logger) << "thread affinity invalid, ignored. name=" << name;
+    rt = pthread_create(&m_thread, nullptr, &Thread::run, this);
+  }
   if (rt) {
     BIN_LOG_ERROR(g_logger)
         << "pthread_create thread fail, rt=" << rt << " name=" << name;
@@ -74,6 +109,21 @@ void Thread::join() {
   // BIN_LOG_INFO(g_logger) << "name: " << m_name << " join";
 }
 
+bool Thread::setAffinity(const std::vector<int> &cpus) {
+  if (!m_thread) {
+    return false;
+  }
+  cpu_set_t set;
+  MakeCpuSet(cpus, set);
+  int rt = pthread_setaffinity_np(m_thread, sizeof(set), &set);
+  if (rt) {
+    BIN_LOG_ERROR(g_logger) << "pthread_setaffinity_np fail, rt=" << rt
+                            << " name=" << m_name;
+    return false;
+  }
+  return true;
+}
+
 void *Thread::run(void *arg) {
   // 必须为static func, void*，保证线程能够接受任意类型的参数，到时候再强制转换
   BIN_LOG_INFO(g_logger) << "thread::run() begin";
@@ -10,6 +10,9 @@
 #ifndef __BIN_THREAD_H__
 #define __BIN_THREAD_H__
 
+#include <string>
+#include <vector>
+
 #include "mutex.h"
 
 namespace bin {
@@ -27,8 +30,11 @@ public:
    *  利用pthread库开启运行线程，并且置一个信号量去等待线程完全开启后再退出构造函数
    * @param cb the function that executes thread
    * @param name thread name
+   * @param cpus 线程可以运行的CPU，为空不限制。创建时就绑定，线程第一次访问的
+   *  内存(栈、线程局部变量)按first-touch分配在这些CPU所在的NUMA节点上
    */
-  Thread(std::function<void()> cb, const std::string &name);
+  Thread(std::function<void()> cb, const std::string &name,
+         const std::vector<int> &cpus = std::vector<int>());
 
   /**
    * @brief Destroy the Thread object
@@ -69,6 +75,13 @@ public:
    */
   void join();
 
+  /**
+   * @brief 修改线程可以运行的CPU
+   * @param cpus CPU编号，为空时恢复为所有在线CPU
+   * @return 是否成功
+   */
+  bool setAffinity(const std::vector<int> &cpus);
+
 private:
   /**
    * @brief 线程执行函数
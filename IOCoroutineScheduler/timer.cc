@@ -5,54 +5,67 @@
  *  在间隔一个指定时间后，会自动的往任务队列中添加一个函数/协程，
  *  执行我们需要的操作。支持一次性定时器触发和循环定时器触发
  *  使用场景：在特定时间段或者某一段时间内需要执行一些任务等场景
+ *  定时器保存在分层时间轮中，添加/取消/刷新都是O(1)
  * @version 1.0
  * @date 2022-04-01
  * @copyright Copyright (c) {2022}
  */
 
+#include <algorithm>
+#include <sched.h>
+
 #include "timer.h"
+#include "config.h"
 #include "util.h"
 
 namespace bin {
 
-bool Timer::Comparator::operator()(const Timer::ptr &lhs,
-                                   const Timer::ptr &rhs) const {
-  // 通过地址判断是否有值
-  if (!lhs && !rhs) {
+static ConfigVar<uint32_t>::ptr g_timer_tick = Config::Lookup<uint32_t>(
+    "timer.tick_us", 100, "timing wheel tick in microseconds");
+
+// 毫秒转微秒，很大的值不溢出
+static uint64_t MsToUs(uint64_t ms) {
+  return ms >= ~0ull / 2000 ? ~0ull / 2 : ms * 1000;
+}
+
+Timer::Timer(uint64_t us, std::function<void()> cb, bool recurring,
+             TimerManager *manager, TimerWheel *wheel, uint64_t slack)
+    : m_recurring(recurring), m_us(us), m_cb(cb), m_manager(manager) {
+  m_wheel = wheel;
+  m_slack = slack;
+  m_next = bin::GetLoopUS() + m_us; // 计算到期时间点
+}
+
+bool TimerNode::cancel() {
+  TimerWheel *wheel = m_wheel;
+  if (!wheel) {
     return false;
   }
-  if (!lhs) {
-    return true;
+  {
+    TimerWheel::MutexType::Lock lock(wheel->m_mutex);
+    if (m_level != -1) {
+      wheel->unlink(this);
+      return true;
+    }
   }
-  if (!rhs) {
-    return false;
+  // 已经被摘下，等到期回调执行完
+  while (m_firing.load(std::memory_order_acquire)) {
+    sched_yield();
   }
-  // 都有值 判断到期时间
-  if (lhs->m_next == rhs->m_next) {
-    // 到期时间相等的话 地址小的优先调度
-    return lhs.get() < rhs.get();
-  } else {
-    // 不相等，到期时间小的优先调度
-    return lhs->m_next < rhs->m_next;
-  }
-}
-
-Timer::Timer(uint64_t ms, std::function<void()> cb, bool recurring,
-             TimerManager *manager)
-    : m_recurring(recurring), m_ms(ms), m_cb(cb), m_manager(manager) {
-  m_next = bin::GetCurrentMS() + m_ms; // 计算到期时间点
+  return false;
 }
 
-Timer::Timer(uint64_t next) : m_next(next) {}
-
 bool Timer::cancel() {
-  // 通过操作TimerManger的定时器队列，通过比较定时器的内存地址以及到期时间点
-  // 找到对应的定时器对象，从定时器队列中移除。
-  TimerManager::RWMutexType::WriteLock lock(m_manager->m_mutex);
+  // 定时器记录了自己在时间轮上的位置，直接从槽的链表上摘下来
+  TimerWheel::MutexType::Lock lock(m_wheel->m_mutex);
   if (m_cb) {
     m_cb = nullptr;
-    auto it = m_manager->m_timers.find(shared_from_this());
-    m_manager->m_timers.erase(it);
+    if (m_level != -1) {
+      m_wheel->unlink(this);
+      // 释放时间轮持有的引用，调用者还持有一个
+      Timer::ptr self;
+      self.swap(m_self);
+    }
     return true;
   }
   return false;
@@ -60,21 +73,18 @@ bool Timer::cancel() {
 
 bool Timer::refresh() {
   // 重新刷新定时器的间隔时间，让其重新开始新的计时间隔，但不改变原来设定好的时间间隔量
-  // set底层是红黑树，有序，直接原地修改会打乱有序规则，发生未知错误，必须将原来的定时
-  // 器从这个有序序列中移除，再重新加入才能合法
-  TimerManager::RWMutexType::WriteLock lock(m_manager->m_mutex);
+  TimerWheel::MutexType::Lock lock(m_wheel->m_mutex);
   if (!m_cb) {
     return false;
   }
-  auto it = m_manager->m_timers.find(shared_from_this());
-  // 1、没找到
-  if (it == m_manager->m_timers.end()) {
+  // 1、不在时间轮中
+  if (m_level == -1) {
     return false;
   }
-  // 2、找到了：由于使用的set 要先移除再进行重置加入
-  m_manager->m_timers.erase(it);
-  m_next = bin::GetCurrentMS() + m_ms;
-  m_manager->m_timers.insert(shared_from_this());
+  // 2、摘下来按新的到期时间重新挂上
+  m_wheel->unlink(this);
+  m_next = bin::GetLoopUS() + m_us;
+  m_wheel->link(this);
   return true;
 }
 
@@ -85,59 +95,99 @@ bool Timer::refresh() {
 1.
 判断重新设定的时间间隔是否和原来相等，且重新设定是否从即刻生效。（如果和原来相等，并且即刻生效，其功能就会变成refresh()。）
 2.
-从TimerManaer的定时器队列里找出对应的定时器移除，并且重新计算定时器的到期时间点：
+从TimerManaer的时间轮里摘下对应的定时器，并且重新计算定时器的到期时间点：
     a. 如果from_now =
-true，即：即刻生效。获取当前时间GetCurrentMs()，将其作为新的时间起点，然后又加上新的时间间隔量。
+true，即：即刻生效。获取当前时间GetLoopUS()，将其作为新的时间起点，然后又加上新的时间间隔量。
     b. 如果from_now =
 false，即：不需要即刻生效。计算得到原来的时间起点原时间起点 = 原触发时间点 -
 原时间间隔，在原时间起点的基础上加上新的时间间隔来完成触发。
         也就是说这种重置定时器的做法，设置完之后的定时器已经过了一部分时间，计划等待时间
 >= 实际等待时间
 3.
-调用TimerManager::addTimer()将定时器重新加入队列，不直接使用set.insert()的原因在于：
+调用TimerManager::addTimer()将定时器重新加入时间轮，不直接使用link()的原因在于：
 当前定时器的到期时间点 <
 队头定时器(队列到期时间点最近的定时器)到期时间点，在加入队列时存在这种可能，需要tickle()去唤醒epoll_wait去修改其超时时间。
 */
 bool Timer::reset(uint64_t ms, bool from_now) {
-  if (ms == m_ms &&
+  uint64_t us = MsToUs(ms);
+  if (us == m_us &&
       !from_now) { // 新时间周期等于现时间周期 并且 起始时间不是现在，无需更改
     return true;
   }
-  TimerManager::RWMutexType::WriteLock lock(m_manager->m_mutex);
+  TimerWheel::MutexType::Lock lock(m_wheel->m_mutex);
   if (!m_cb) { // 没有任务也无需修改直接返回
     return false;
   }
-  auto it = m_manager->m_timers.find(shared_from_this());
   // 1、管理器内没找到
-  if (it == m_manager->m_timers.end()) {
+  if (m_level == -1) {
     return false;
   }
-  // 2、管理器内找到了
-  m_manager->m_timers.erase(it); // 注意：由于使用的set 要先移除再进行重置加入
+  // 2、管理器内找到了，先摘下再重新加入
+  m_wheel->unlink(this);
   uint64_t start = 0;
   if (from_now) { // 重新从现在开始计时
-    start = bin::GetCurrentMS();
+    start = bin::GetLoopUS();
   } else { // 继续上一次的计时
-    start = m_next - m_ms;
+    start = m_next - m_us;
   }
-  m_ms = ms;             // 设置新的计时间隔
-  m_next = start + m_ms; // 设置新的触发时间点
-  // 用addTimer不用reset是因为reset可能出现执行时间变成最小的可能(放在队头)
+  m_us = us;             // 设置新的计时间隔
+  m_next = start + m_us; // 设置新的触发时间点
+  // 用addTimer不用link是因为reset可能出现执行时间变成最小的可能(放在队头)
   // 会有一次唤醒
-  m_manager->addTimer(shared_from_this(), lock);
+  m_manager->addTimer(this, lock);
   return true;
 }
 
-TimerManager::TimerManager() { m_previouseTime = bin::GetCurrentMS(); }
+TimerWheel::TimerWheel(size_t index, uint64_t tick)
+    : m_index(index), m_tick(tick) {
+  for (int i = 0; i <= WHEEL_LEVELS; ++i) {
+    m_levelCount[i] = 0;
+    for (int j = 0; j < WHEEL_SIZE; ++j) {
+      m_wheel[i][j] = nullptr;
+    }
+  }
+  m_current = bin::GetLoopUS() / m_tick;
+}
+
+TimerWheel::~TimerWheel() {
+  // 断开定时器对自己的引用
+  for (int i = 0; i <= WHEEL_LEVELS; ++i) {
+    for (int j = 0; j < WHEEL_SIZE; ++j) {
+      while (m_wheel[i][j]) {
+        TimerNode *node = m_wheel[i][j];
+        unlink(node);
+        if (!node->m_callback) {
+          Timer::ptr self = std::move(static_cast<Timer *>(node)->m_self);
+        }
+      }
+    }
+  }
+}
+
+TimerManager::TimerManager(size_t wheels) {
+  m_tick = std::max(1u, g_timer_tick->getValue());
+  m_rateTime = bin::GetMonotonicMS();
+  for (size_t i = 0; i < std::max(wheels, (size_t)1); ++i) {
+    m_wheels.emplace_back(new TimerWheel(i, m_tick));
+  }
+}
 
 TimerManager::~TimerManager() {}
 
 Timer::ptr TimerManager::addTimer(uint64_t ms, std::function<void()> cb,
-                                  bool recurring) {
-  // 在TimerManager 中构造Timer
-  Timer::ptr timer(new Timer(ms, cb, recurring, this));
-  RWMutexType::WriteLock lock(m_mutex);
-  addTimer(timer, lock);
+                                  bool recurring, uint64_t slack_ms) {
+  return addTimerUS(MsToUs(ms), cb, recurring, MsToUs(slack_ms));
+}
+
+Timer::ptr TimerManager::addTimerUS(uint64_t us, std::function<void()> cb,
+                                    bool recurring, uint64_t slack_us) {
+  // 在TimerManager 中构造Timer，放进当前线程的时间轮
+  size_t index = getTimerWheel();
+  TimerWheel *wheel = m_wheels[index < m_wheels.size() ? index : 0].get();
+  Timer::ptr timer(new Timer(us, cb, recurring, this, wheel, slack_us));
+  TimerWheel::MutexType::Lock lock(wheel->m_mutex);
+  timer->m_self = timer;
+  addTimer(timer.get(), lock);
   return timer;
 }
 
@@ -152,80 +202,145 @@ static void OnTimer(std::weak_ptr<void> weak_cond, std::function<void()> cb) {
 Timer::ptr TimerManager::addConditionTimer(uint64_t ms,
                                            std::function<void()> cb,
                                            std::weak_ptr<void> weak_cond,
-                                           bool recurring) {
+                                           bool recurring, uint64_t slack_ms) {
   // 添加一个条件定时器，和普通定时器相比，多了一个用weak_ptr<>弱指针指向shared_ptr<>
   // 共享指针管理的"条件"，定时器触发时检查"条件"是否还存在，不存在将不执行所持有的任务
-  return addTimer(ms, std::bind(&OnTimer, weak_cond, cb), recurring);
+  return addTimer(ms, std::bind(&OnTimer, weak_cond, cb), recurring, slack_ms);
+}
+
+void TimerManager::addTimer(TimerNode &node, uint64_t ms,
+                            TimerNode::Callback cb, uint64_t slack_ms) {
+  addTimerUS(node, MsToUs(ms), cb, MsToUs(slack_ms));
+}
+
+void TimerManager::addTimerUS(TimerNode &node, uint64_t us,
+                              TimerNode::Callback cb, uint64_t slack_us) {
+  size_t index = getTimerWheel();
+  TimerWheel *wheel = m_wheels[index < m_wheels.size() ? index : 0].get();
+  node.m_callback = cb;
+  node.m_wheel = wheel;
+  node.m_slack = slack_us;
+  node.m_next = bin::GetLoopUS() + us;
+  TimerWheel::MutexType::Lock lock(wheel->m_mutex);
+  addTimer(&node, lock);
 }
 
 uint64_t TimerManager::getNextTimer() {
-  RWMutexType::ReadLock lock(m_mutex);
+  uint64_t next = ~0ull;
+  for (size_t i = 0; i < m_wheels.size(); ++i) {
+    next = std::min(next, getNextTimerUS(i));
+  }
+  return next == ~0ull ? ~0ull : (next + 999) / 1000;
+}
+
+uint64_t TimerManager::getNextTimerUS(size_t index) {
+  TimerWheel &wheel = *m_wheels[index];
+  TimerWheel::MutexType::Lock lock(wheel.m_mutex);
   // 获取队头定时器时间一次 就可以去唤醒一次
-  m_tickled = false;
+  wheel.m_tickled = false;
   // 定时器队列为空返回一个极大值
-  if (m_timers.empty())
+  uint64_t next = wheel.nextExpireTick();
+  if (next == ~0ull)
     return ~0ull;
-  const Timer::ptr &next = *m_timers.begin();
-  uint64_t now_ms = bin::GetCurrentMS();
-  if (now_ms >=
-      next->m_next) // 现在获取的时间 已经晚于预计要触发的时间点 马上执行
+  uint64_t next_us = next * m_tick;
+  uint64_t now_us = bin::GetLoopUS();
+  if (now_us >= next_us) // 现在获取的时间 已经晚于预计要触发的时间点 马上执行
     return 0;
   else // 还没到预定时间就返回剩余时间间隔
-    return next->m_next - now_ms;
+    return next_us - now_us;
 }
 
-void TimerManager::listExpiredCb(std::vector<std::function<void()>> &cbs) {
-  // 检查当前的定时队列，找出所有已经到时需要触发的定时器，从定时器队列中移除，并且将这
-  // 些已经要触发的定时器中的函数/协程全部取出放入一个目标容器内。
-  // 注意：处理服务器时间被修改的情况，会对定时器触发有一定的影响
-  uint64_t now_ms = bin::GetCurrentMS();
+size_t TimerManager::listExpiredCb(std::vector<Task> &cbs) {
+  size_t fired = 0;
+  for (size_t i = 0; i < m_wheels.size(); ++i) {
+    fired += listExpiredCb(i, cbs);
+  }
+  countTimerWakeup(fired);
+  return fired;
+}
+
+size_t TimerManager::listExpiredCb(size_t index,
+                                   std::vector<Task> &cbs) {
+  TimerWheel &wheel = *m_wheels[index];
+  // 不加锁先看一眼，空的时间轮不用锁
+  if (wheel.m_count == 0) {
+    return 0;
+  }
+  size_t cbs_size = cbs.size();
+  uint64_t now_us = bin::GetLoopUS();
+  // 到期的定时器在解锁之后才释放
   std::vector<Timer::ptr> expired;
+  std::vector<TimerNode *> fire;
   {
-    RWMutexType::ReadLock lock(m_mutex);
-    if (m_timers.empty())
-      return;
+    TimerWheel::MutexType::Lock lock(wheel.m_mutex);
+    wheel.listExpired(now_us, cbs, expired, fire);
   }
-  // 先读锁，再写锁，检查了两次empty()
-  RWMutexType::WriteLock lock(m_mutex);
-  if (m_timers.empty()) {
-    return;
+  // 侵入式节点在锁外回调，回调结束后cancel()才会返回，之后不能再访问节点
+  for (auto node : fire) {
+    node->m_callback(node);
+    node->m_firing.store(false, std::memory_order_release);
   }
-  bool rollover = detectClockRollover(now_ms);
-  // 服务器时间没有发生改变 且不存在超时定时器 就退出函数
-  if (!rollover && ((*m_timers.begin())->m_next > now_ms))
+  return cbs.size() - cbs_size + fire.size();
+}
+
+void TimerManager::countTimerWakeup(size_t fired) {
+  if (fired) {
+    ++m_timerWakeups;
+    m_timersFired += fired;
+  }
+}
+
+double TimerManager::getTimerWakeupsPerSecond() {
+  Mutex::Lock lock(m_rateMutex);
+  uint64_t now = bin::GetMonotonicMS();
+  uint64_t wakeups = m_timerWakeups;
+  uint64_t used = now - m_rateTime;
+  double rate = used ? (wakeups - m_rateWakeups) * 1000.0 / used : 0;
+  m_rateTime = now;
+  m_rateWakeups = wakeups;
+  return rate;
+}
+
+void TimerWheel::listExpired(uint64_t now_us,
+                             std::vector<Task> &cbs,
+                             std::vector<Timer::ptr> &expired,
+                             std::vector<TimerNode *> &fire) {
+  // 推进时间轮，把经过的槽上的定时器全部取出，回调放入目标容器
+  // 单调时钟不会回退，不用处理系统时间被修改的情况
+  if (m_count == 0) {
     return;
-  // 构造一个装有当前时间的Timer为了应用lower_bound算法函数
-  Timer::ptr now_timer(new Timer(now_ms));
-  // 如果服务器时间发生了变动 就返回end() 会将整个m_timers全部清理 重新加入队列
-  // 否则 将找出大于等于当前时间的第一个Timer
-  auto it = rollover ? m_timers.end() : m_timers.lower_bound(now_timer);
-  // 找到还没到时的第一个定时器的位置后 停下
-  while (it != m_timers.end() && (*it)->m_next == now_ms)
-    ++it;
-  // 将队头~当前位置之前 所有已经到时的定时器全部拿出 到expired队列中
-  expired.insert(expired.begin(), m_timers.begin(), it);
-  // 将原队列前部到期的定时器全部移除
-  m_timers.erase(m_timers.begin(), it);
-  // 扩充可执行任务队列空间,
-  // reserve()强制容器把它的容量改为至少n，提供的n不小于当前大小
-  cbs.reserve(expired.size());
-  for (auto &tmr : expired) { // tmr : timer
-    cbs.push_back(tmr->m_cb);
-    // 循环定时器就放回 set中
+  }
+  std::vector<TimerNode *> nodes;
+  advance(now_us / m_tick, nodes);
+  for (auto node : nodes) {
+    if (node->m_callback) {
+      node->m_firing.store(true, std::memory_order_relaxed);
+      fire.push_back(node);
+      continue;
+    }
+    Timer *tmr = static_cast<Timer *>(node); // tmr : timer
+    // 循环定时器拷贝一份回调，重新挂回时间轮；一次性定时器直接把回调移走
     if (tmr->m_recurring) {
-      tmr->m_next = now_ms + tmr->m_ms;
-      m_timers.insert(tmr);
-    } else
+      cbs.emplace_back(tmr->m_cb);
+      tmr->m_next = now_us + tmr->m_us;
+      link(tmr);
+    } else {
+      cbs.emplace_back(std::move(tmr->m_cb));
       tmr->m_cb = nullptr;
+      expired.push_back(std::move(tmr->m_self));
+    }
   }
 }
 
-void TimerManager::addTimer(Timer::ptr val, RWMutexType::WriteLock &lock) {
-  auto it = m_timers.insert(val).first;
-  bool at_front = (it == m_timers.begin()) && !m_tickled;
+void TimerManager::addTimer(TimerNode *node,
+                            TimerWheel::MutexType::Lock &lock) {
+  TimerWheel &wheel = *node->m_wheel;
+  uint64_t front = wheel.nextExpireTick();
+  wheel.link(node);
+  bool at_front = (node->m_expire < front) && !wheel.m_tickled;
   // 频繁修改时候 避免总是去唤醒
   if (at_front) {
-    m_tickled = true;
+    wheel.m_tickled = true;
   }
   lock.unlock(); // 解锁重载函数addTimer()中添加的锁
   // 当有比之前更小的
@@ -234,23 +349,172 @@ void TimerManager::addTimer(Timer::ptr val, RWMutexType::WriteLock &lock) {
   // onTimerInsertAtFront()不然会超时
   // power: 实际上：将挂起的协程唤醒，重新走一遍流程idle()---->run()--->idle()
   if (at_front) {
-    onTimerInsertedAtFront();
+    onTimerInsertedAtFront(wheel.m_index);
   }
 }
 
-bool TimerManager::detectClockRollover(uint64_t now_ms) {
-  // now_ms < 上一次记录的时间 && now_ms < 上一次记录的时间的一个小时前的时间
-  bool rollover = false;
-  if (now_ms < m_previouseTime && now_ms < (m_previouseTime - 60 * 60 * 1000)) {
-    rollover = true;
+bool TimerManager::hasTimer() {
+  for (auto &i : m_wheels) {
+    if (i->m_count != 0) {
+      return true;
+    }
   }
-  m_previouseTime = now_ms;
-  return rollover;
+  return false;
 }
 
-bool TimerManager::hasTimer() {
-  RWMutexType::ReadLock lock(m_mutex);
-  return !m_timers.empty();
+uint64_t TimerWheel::expireTick(const TimerNode *timer) const {
+  // 向上取整，定时器不会提前触发
+  uint64_t expire = (timer->m_next + m_tick - 1) / m_tick;
+  if (!timer->m_slack) {
+    return expire;
+  }
+  // [expire, limit]内低位清零最多的tick：取两者不同的最高位，把limit低于它的位清零。
+  // 到期时间相近、slack相近的定时器会取到同一个tick
+  uint64_t limit = (timer->m_next + timer->m_slack) / m_tick;
+  if (limit <= expire) {
+    return expire;
+  }
+  int bit = 63 - __builtin_clzll(expire ^ limit);
+  return limit & ~((1ull << bit) - 1);
+}
+
+void TimerWheel::link(TimerNode *timer) {
+  // 已经过期的放到当前tick
+  timer->m_expire = expireTick(timer);
+  if (timer->m_expire < m_current) {
+    timer->m_expire = m_current;
+  }
+  uint64_t diff = timer->m_expire - m_current;
+  int level = 0;
+  while (level < WHEEL_LEVELS &&
+         diff >= (1ull << (WHEEL_BITS * (level + 1)))) {
+    ++level;
+  }
+  int slot = level < WHEEL_LEVELS
+                 ? (timer->m_expire >> (WHEEL_BITS * level)) & WHEEL_MASK
+                 : 0;
+  TimerNode *&head = m_wheel[level][slot];
+  timer->m_prevNode = nullptr;
+  timer->m_nextNode = head;
+  if (head) {
+    head->m_prevNode = timer;
+  }
+  head = timer;
+  timer->m_level = level;
+  timer->m_slot = slot;
+  ++m_levelCount[level];
+  ++m_count;
+  if (!m_nextDirty && timer->m_expire < m_nextTick) {
+    m_nextTick = timer->m_expire;
+  }
+}
+
+void TimerWheel::unlink(TimerNode *timer) {
+  if (timer->m_prevNode) {
+    timer->m_prevNode->m_nextNode = timer->m_nextNode;
+  } else {
+    m_wheel[timer->m_level][timer->m_slot] = timer->m_nextNode;
+  }
+  if (timer->m_nextNode) {
+    timer->m_nextNode->m_prevNode = timer->m_prevNode;
+  }
+  --m_levelCount[timer->m_level];
+  --m_count;
+  if (timer->m_expire == m_nextTick) {
+    m_nextDirty = true;
+  }
+  timer->m_level = -1;
+  timer->m_prevNode = timer->m_nextNode = nullptr;
+}
+
+void TimerWheel::cascade(int level, int slot) {
+  TimerNode *t = m_wheel[level][slot];
+  m_wheel[level][slot] = nullptr;
+  while (t) {
+    TimerNode *next = t->m_nextNode;
+    --m_levelCount[level];
+    --m_count;
+    link(t);
+    t = next;
+  }
+}
+
+void TimerWheel::advance(uint64_t now_tick,
+                         std::vector<TimerNode *> &expired) {
+  m_nextDirty = true;
+  while (m_current <= now_tick) {
+    if (m_count == 0) {
+      m_current = now_tick + 1;
+      break;
+    }
+    // 到了高层槽的边界，先从高层往低层降
+    if (m_levelCount[WHEEL_LEVELS] &&
+        (m_current & ((1ull << (WHEEL_BITS * WHEEL_LEVELS)) - 1)) == 0) {
+      cascade(WHEEL_LEVELS, 0);
+    }
+    for (int level = WHEEL_LEVELS - 1; level > 0; --level) {
+      if ((m_current & ((1ull << (WHEEL_BITS * level)) - 1)) == 0) {
+        cascade(level, (m_current >> (WHEEL_BITS * level)) & WHEEL_MASK);
+      }
+    }
+    // 第0层当前槽上的定时器都在这个tick到期
+    TimerNode *&head = m_wheel[0][m_current & WHEEL_MASK];
+    while (head) {
+      expired.push_back(head);
+      unlink(head);
+    }
+    ++m_current;
+    // 低层都空的话直接跳到下一个需要降层的边界
+    int empty = 0;
+    while (empty < WHEEL_LEVELS && m_levelCount[empty] == 0) {
+      ++empty;
+    }
+    if (empty > 0) {
+      uint64_t span = 1ull << (WHEEL_BITS * empty);
+      uint64_t boundary = (m_current + span - 1) & ~(span - 1);
+      m_current = std::min(boundary, now_tick + 1);
+    }
+  }
+}
+
+uint64_t TimerWheel::nextExpireTick() {
+  if (!m_nextDirty) {
+    return m_nextTick;
+  }
+  uint64_t next = ~0ull;
+  // 第0层按槽顺序找到的第一个就是本层最早的
+  if (m_levelCount[0]) {
+    for (uint64_t i = 0; i < (uint64_t)WHEEL_SIZE; ++i) {
+      if (m_wheel[0][(m_current + i) & WHEEL_MASK]) {
+        next = m_current + i;
+        break;
+      }
+    }
+  }
+  // 高层按块顺序找到第一个非空槽，槽内取最小值。偏移0的槽里既可能是下一圈的，
+  // 也可能是m_current正好停在边界上还没降层的，总是要看一下
+  for (int level = 1; level <= WHEEL_LEVELS; ++level) {
+    if (!m_levelCount[level]) {
+      continue;
+    }
+    uint64_t base = level < WHEEL_LEVELS ? m_current >> (WHEEL_BITS * level) : 0;
+    for (TimerNode *t = m_wheel[level][base & WHEEL_MASK]; t; t = t->m_nextNode) {
+      next = std::min(next, t->m_expire);
+    }
+    for (int i = 1; i < WHEEL_SIZE; ++i) {
+      TimerNode *t = m_wheel[level][(base + i) & WHEEL_MASK];
+      if (!t) {
+        continue;
+      }
+      for (; t; t = t->m_nextNode) {
+        next = std::min(next, t->m_expire);
+      }
+      break;
+    }
+  }
+  m_nextTick = next;
+  m_nextDirty = false;
+  return next;
 }
 
 } // namespace bin
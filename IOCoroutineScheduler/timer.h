@@ -5,6 +5,13 @@
  *  在间隔一个指定时间后，会自动的往任务队列中添加一个函数/协程，
  *  执行我们需要的操作。支持一次性定时器触发和循环定时器触发
  *  使用场景：在特定时间段或者某一段时间内需要执行一些任务等场景
+ *  定时器保存在分层时间轮中，添加/取消/刷新都是O(1)；每个调度线程一个时间轮，
+ *  线程只处理自己的定时器，不同线程之间不争用同一把锁
+ *  定时器可以带一个允许推迟的时间(slack)，到期时间在[ms, ms+slack]内向对齐的tick取整，
+ *  到期时间相近的定时器落到同一个槽里，一次唤醒一起处理(类似Linux的timer slack)
+ *  时间使用单调时钟GetLoopUS()，事件循环里每轮只读一次时钟，修改系统时间不影响定时器。
+ *  注意在事件循环里长时间运行的任务之后设置定时器，起点是这一轮的时间，需要的话先UpdateLoopTime()
+ *  内部按微秒计时，tick默认100us，addTimerUS()可以设置不到1ms的定时器
  * @version 1.0
  * @date 2022-04-01
  * @copyright Copyright (c) {2022}
@@ -13,15 +20,58 @@
 #ifndef __BIN_TIMER_H__
 #define __BIN_TIMER_H__
 
+#include <atomic>
+#include <functional>
 #include <memory>
-#include <set>
 #include <vector>
 
+#include "task.h"
 #include "thread.h"
 
 namespace bin {
 
 class TimerManager;
+class TimerWheel;
+
+/**
+ * @brief 侵入式定时器节点
+ * @details 可以嵌在其他对象里或者放在协程栈上，通过TimerManager::addTimer(node,...)
+ *  挂到当前线程的时间轮上，设置和取消都不分配内存。到期时在处理时间轮的线程里
+ *  直接调用回调(不经过调度器)，回调要短且不能阻塞。
+ *  节点在挂着或者回调执行期间必须保持有效：释放或重新设置之前先调用cancel()
+ */
+class TimerNode {
+  friend class Timer;
+  friend class TimerWheel;
+  friend class TimerManager;
+
+public:
+  typedef void (*Callback)(TimerNode *node);
+
+  TimerNode() {}
+  TimerNode(const TimerNode &) = delete;
+  TimerNode &operator=(const TimerNode &) = delete;
+
+  /**
+   * @brief 取消定时器
+   * @details 回调正在执行时会等它结束，返回后节点可以安全释放或重新设置
+   * @return true 在到期之前取消了；false 没有设置或者已经到期
+   */
+  bool cancel();
+
+private:
+  uint64_t m_next = 0;             // 精确的执行时间(微秒)
+  uint64_t m_slack = 0;            // 允许推迟的微秒数
+  Callback m_callback = nullptr;   // 到期回调，Timer为空
+  TimerWheel *m_wheel = nullptr;   // 所属的时间轮
+  std::atomic<bool> m_firing{false}; // 已经摘下，回调正在执行
+  // 时间轮槽位里的侵入式双向链表，由所属时间轮的锁保护
+  uint64_t m_expire = 0;             // 到期的tick
+  int m_level = -1;                  // 所在的层，-1表示不在时间轮中
+  int m_slot = 0;                    // 所在的槽
+  TimerNode *m_prevNode = nullptr;   // 槽内前一个定时器
+  TimerNode *m_nextNode = nullptr;   // 槽内后一个定时器
+};
 
 /**
  * @brief Timer类，构造函数私有属性,不能直接创建其对象
@@ -29,13 +79,15 @@ class TimerManager;
  *  Timer和TimerManager互相置为友元类
  *  方便TimerManager的addTimer()调用Timer的private constructor
  */
-class Timer : public std::enable_shared_from_this<Timer> {
+class Timer : private TimerNode, public std::enable_shared_from_this<Timer> {
   friend class TimerManager;
+  friend class TimerWheel;
 
 public:
   typedef std::shared_ptr<Timer> ptr;
   /**
    * @brief 取消当前定时器的定时任务
+   * @details 可以在任意线程调用，只锁定时器所在的时间轮
    * @return success or not
    */
   bool cancel();
@@ -57,115 +109,237 @@ private:
   /**
    * @brief Construct a new Timer object
    *  Timer的构造函数为私有意味着不能显示创建对象，必须由TimerManager来创建
-   * @param ms 定时器执行间隔时间
+   * @param us 定时器执行间隔时间(微秒)
    * @param cb callback function
    * @param recurring 是否循环执行
    * @param manager TimerManager
+   * @param wheel 所属的时间轮
+   * @param slack 允许推迟的微秒数
    */
-  Timer(uint64_t ms, std::function<void()> cb, bool recurring,
-        TimerManager *manager);
-  /**
-   * @brief Construct a new Timer object
-   * @param next 执行的时间戳(毫秒)
-   */
-  Timer(uint64_t next);
+  Timer(uint64_t us, std::function<void()> cb, bool recurring,
+        TimerManager *manager, TimerWheel *wheel, uint64_t slack);
 
 private:
   bool m_recurring = false;          // 是否循环定时器
-  uint64_t m_ms = 0;                 // 执行周期
-  uint64_t m_next = 0;               // 精确的执行时间
+  uint64_t m_us = 0;                 // 执行周期(微秒)
   std::function<void()> m_cb;        // 回调函数
   TimerManager *m_manager = nullptr; // 定时器管理器
+  Timer::ptr m_self; // 在时间轮中时持有自己，保证不被释放
+};
+
+/**
+ * @brief 分层时间轮
+ * @details WHEEL_LEVELS层，每层WHEEL_SIZE个槽。第0层每个槽1个tick，
+ *  第n层每个槽WHEEL_SIZE^n个tick；超出最高层范围的放在溢出链表(第WHEEL_LEVELS层)。
+ *  推进到高层槽的边界时，把该槽的定时器重新挂到低层(cascade)。
+ *  所有成员由m_mutex保护，只有m_count可以不加锁读
+ */
+class TimerWheel : Noncopyable {
+  friend class TimerNode;
+  friend class Timer;
+  friend class TimerManager;
+
+public:
+  typedef Mutex MutexType;
+
+  /**
+   * @param index 在TimerManager中的下标
+   * @param tick 每个tick的微秒数
+   */
+  TimerWheel(size_t index, uint64_t tick);
+  ~TimerWheel();
 
 private:
   /**
-   * @brief 定时器比较仿函数
-   *  Timer内部构建仿函数作为set容器比较的函数调用，set存储指针默认通过指针值排列
-   *  我们希望通过比较到期时间来进行排列
+   * @brief 计算到期tick，slack范围内取对齐位数最多的tick
+   */
+  uint64_t expireTick(const TimerNode *timer) const;
+  /**
+   * @brief 按到期tick把定时器挂到时间轮对应的层和槽上
+   */
+  void link(TimerNode *timer);
+  /**
+   * @brief 把定时器从时间轮上摘下来，Timer的m_self由调用者处理
+   */
+  void unlink(TimerNode *timer);
+  /**
+   * @brief 把一个槽上的定时器全部摘下，按当前tick重新挂一遍(降层)
+   */
+  void cascade(int level, int slot);
+  /**
+   * @brief 推进时间轮到now_tick(含)，到期的定时器放入expired
+   */
+  void advance(uint64_t now_tick, std::vector<TimerNode *> &expired);
+  /**
+   * @brief 取出到期的定时器，循环定时器重新挂上
+   * @param now_us 当前时间(微秒)
+   * @param cbs Timer的回调
+   * @param expired 到期的Timer，解锁后再释放
+   * @param fire 到期的侵入式节点，解锁后调用回调
+   */
+  void listExpired(uint64_t now_us, std::vector<Task> &cbs,
+                   std::vector<Timer::ptr> &expired,
+                   std::vector<TimerNode *> &fire);
+  /**
+   * @brief 最近一个定时器的到期tick，没有返回~0ull
    */
-  struct Comparator {
-    // 比较定时器的智能指针的大小(按执行时间排序)
-    bool operator()(const Timer::ptr &lhs, const Timer::ptr &rhs) const;
-  };
+  uint64_t nextExpireTick();
+
+private:
+  static const int WHEEL_BITS = 8;
+  static const int WHEEL_SIZE = 1 << WHEEL_BITS;
+  static const uint64_t WHEEL_MASK = WHEEL_SIZE - 1;
+  static const int WHEEL_LEVELS = 4;
+
+  MutexType m_mutex;
+  size_t m_index = 0;                           // 在TimerManager中的下标
+  TimerNode *m_wheel[WHEEL_LEVELS + 1][WHEEL_SIZE]; // 每个槽的链表头
+  size_t m_levelCount[WHEEL_LEVELS + 1];        // 每层的定时器数
+  std::atomic<size_t> m_count{0};               // 定时器总数
+  uint64_t m_tick = 100;                        // 每个tick的微秒数
+  uint64_t m_current = 0;                       // 下一个要处理的tick
+  uint64_t m_nextTick = ~0ull; // 缓存的最近到期tick
+  bool m_nextDirty = false;    // m_nextTick需要重新计算
+  // 是否触发onTimerInsertedAtFront，避免频繁修改的一个ticked标记
+  bool m_tickled = false;
 };
 
 /**
  * @brief 定时器管理器
  *  虚基类，管理Timer定时器队列，让其能够有序的执行到期后的定时任务
  *  让其继承类通过纯虚函数 onTimerInsertedAtFront() 去加入相关的其他业务拓展
+ *  定时器分散在多个时间轮里，由派生类的getTimerWheel()决定当前线程使用哪一个
  */
 class TimerManager {
   friend class Timer;
 
 public:
-  typedef RWMutex RWMutexType;
-
-  TimerManager();
+  /**
+   * @param wheels 时间轮数量，至少1个
+   */
+  TimerManager(size_t wheels = 1);
   virtual ~TimerManager();
 
   /**
-   * @brief 创建定时器并添加到定时器集合(m_timers)中
+   * @brief 创建定时器并添加到当前线程的时间轮中
    * @param ms 定时器执行间隔时间
    * @param cb callback function
    * @param recurring 是否循环定时器
+   * @param slack_ms 允许推迟的毫秒数，用于合并到期时间相近的定时器
    * @return 创建的定时器
    */
   Timer::ptr addTimer(uint64_t ms, std::function<void()> cb,
-                      bool recurring = false);
+                      bool recurring = false, uint64_t slack_ms = 0);
+  /**
+   * @brief 创建微秒精度的定时器，参数同addTimer()，时间都是微秒
+   */
+  Timer::ptr addTimerUS(uint64_t us, std::function<void()> cb,
+                        bool recurring = false, uint64_t slack_us = 0);
   /**
-   * @brief 创建定时器并添加到定时器集合(m_timers)中
+   * @brief 创建定时器并添加到当前线程的时间轮中
    * @param ms 定时器执行间隔时间
    * @param cb callback function
    * @param weak_cond 条件
    * @param recurring 是否循环定时器
+   * @param slack_ms 允许推迟的毫秒数
    * @return 创建的定时器
    */
   Timer::ptr addConditionTimer(uint64_t ms, std::function<void()> cb,
                                std::weak_ptr<void> weak_cond,
-                               bool recurring = false);
+                               bool recurring = false, uint64_t slack_ms = 0);
+  /**
+   * @brief 把侵入式定时器节点挂到当前线程的时间轮上，不分配内存
+   * @param node 没有挂着的节点
+   * @param ms 定时器执行间隔时间
+   * @param cb 到期回调，在处理时间轮的线程里直接调用
+   * @param slack_ms 允许推迟的毫秒数
+   */
+  void addTimer(TimerNode &node, uint64_t ms, TimerNode::Callback cb,
+                uint64_t slack_ms = 0);
+  /**
+   * @brief 把侵入式定时器节点挂到当前线程的时间轮上，时间都是微秒
+   */
+  void addTimerUS(TimerNode &node, uint64_t us, TimerNode::Callback cb,
+                  uint64_t slack_us = 0);
   /**
-   * @brief 获取需要执行的定时器的回调函数列表
+   * @brief 获取所有时间轮中需要执行的定时器的回调函数列表，算作一次定时器唤醒
    * @param cbs 包含cb的回调函数数组
+   * @return 到期的定时器数量
    */
-  void listExpiredCb(std::vector<std::function<void()>> &cbs);
+  size_t listExpiredCb(std::vector<Task> &cbs);
+  /**
+   * @brief 获取一个时间轮中需要执行的定时器的回调函数列表
+   * @details 不计入唤醒次数，调用者处理完一次唤醒后调用countTimerWakeup()
+   * @param wheel 时间轮下标
+   * @param cbs 包含cb的回调函数数组
+   * @return 到期的定时器数量(包括侵入式节点)
+   */
+  size_t listExpiredCb(size_t wheel, std::vector<Task> &cbs);
   /**
    * @brief 获取当前定时器队列队头的到期时间点的值,如果超出了触发时间点，返回0
    * @return the Next Timer object 
    */
-  uint64_t getNextTimer(); // 获取到最近一个定时器执行的时间间隔(毫秒)
+  uint64_t getNextTimer(); // 获取到最近一个定时器执行的时间间隔(毫秒，向上取整)
+  /**
+   * @brief 一个时间轮中最近一个定时器执行的时间间隔(微秒)，没有返回~0ull
+   * @param wheel 时间轮下标
+   */
+  uint64_t getNextTimerUS(size_t wheel);
   /**
-   * @brief 是否有定时器
+   * @brief 是否有定时器，不加锁
    */
   bool hasTimer();
+  /**
+   * @brief 时间轮的精度(微秒)
+   */
+  uint64_t getTick() const { return m_tick; }
+  /**
+   * @brief 时间轮数量
+   */
+  size_t getTimerWheelCount() const { return m_wheels.size(); }
+  /**
+   * @brief 累计处理到期定时器的唤醒次数
+   */
+  uint64_t getTimerWakeups() const { return m_timerWakeups; }
+  /**
+   * @brief 累计到期的定时器数量，除以唤醒次数就是平均每次唤醒合并的定时器数
+   */
+  uint64_t getTimersFired() const { return m_timersFired; }
+  /**
+   * @brief 距离上次调用(第一次为创建以来)平均每秒的定时器唤醒次数
+   */
+  double getTimerWakeupsPerSecond();
 
 protected:
   /**
-   * @brief 当有新的定时器插入到定时器的首部,执行该函数
+   * @brief 当有新的定时器插入到时间轮的首部,执行该函数
+   * @param wheel 插入的时间轮下标
    */
-  virtual void onTimerInsertedAtFront() = 0;
+  virtual void onTimerInsertedAtFront(size_t wheel) = 0;
   /**
-   * @brief 将定时器添加到管理器中
-   * @param val 定时器
-   * @param lock 锁
+   * @brief 当前线程添加定时器使用的时间轮下标
    */
-  void addTimer(Timer::ptr val, RWMutexType::WriteLock &lock);
-
-private:
+  virtual size_t getTimerWheel() { return 0; }
   /**
-   * @brief 检测服务器时间是否被调后了
-   *  重点检查时间被调小的情况因为可能会导致定时器队列里所有任务都触发。
-   * @param now_ms 当前时间
-   * @return true 被调后了
-   * @return false 未被调后
+   * @brief 将定时器添加到所属的时间轮中
+   * @param node 定时器
+   * @param lock 时间轮的锁
    */
-  bool detectClockRollover(uint64_t now_ms);
+  void addTimer(TimerNode *node, TimerWheel::MutexType::Lock &lock);
+  /**
+   * @brief 记一次定时器唤醒
+   * @param fired 这次唤醒到期的定时器数量，为0不计
+   */
+  void countTimerWakeup(size_t fired);
 
 private:
-  RWMutexType m_mutex;
-  std::set<Timer::ptr, Timer::Comparator> m_timers; // 定时器集合
-  // 是否触发onTimerInsertedAtFront，避免频繁修改的一个ticked标记
-  bool m_tickled = false;
-  uint64_t m_previouseTime = 0; // 上次执行时间
+  uint64_t m_tick = 100; // 每个tick的微秒数
+  std::vector<std::unique_ptr<TimerWheel>> m_wheels;
+  std::atomic<uint64_t> m_timerWakeups{0}; // 处理到期定时器的唤醒次数
+  std::atomic<uint64_t> m_timersFired{0};  // 到期的定时器数量
+  Mutex m_rateMutex;                       // 保护下面的采样点
+  uint64_t m_rateTime = 0;                 // 上次计算唤醒速率的时间
+  uint64_t m_rateWakeups = 0;              // 上次计算唤醒速率时的唤醒次数
 };
 
 } // namespace bin
@@ -7,15 +7,19 @@
  * @copyright Copyright (c) {2022}
  */
 
+#include <algorithm>
 #include <arpa/inet.h>
 #include <dirent.h>
 #include <execinfo.h>
 #include <google/protobuf/unknown_field_set.h>
+#include <fstream>
 #include <ifaddrs.h>
+#include <sched.h>
 #include <string.h>
 #include <sys/stat.h>
 #include <sys/time.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "coroutine.h"
@@ -26,6 +30,9 @@ namespace bin {
 
 static bin::Logger::ptr g_logger = BIN_LOG_NAME("system");
 
+// 0表示当前线程不在事件循环里
+static thread_local uint64_t t_loop_us = 0;
+
 pid_t GetThreadId() { return syscall(SYS_gettid); }
 
 uint32_t GetFiberId() { return bin::Fiber::GetFiberId(); }
@@ -95,6 +102,27 @@ uint64_t GetCurrentMS() {
   return tv.tv_sec * 1000ul + tv.tv_usec / 1000;
 }
 
+uint64_t GetMonotonicMS() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000ul + ts.tv_nsec / 1000000;
+}
+
+uint64_t GetMonotonicUS() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000 * 1000ul + ts.tv_nsec / 1000;
+}
+
+uint64_t GetLoopUS() {
+  uint64_t now = t_loop_us;
+  return now ? now : GetMonotonicUS();
+}
+
+void UpdateLoopTime() { t_loop_us = GetMonotonicUS(); }
+
+void ClearLoopTime() { t_loop_us = 0; }
+
 uint64_t GetCurrentUS() {
   struct timeval tv;
   gettimeofday(&tv, NULL);
@@ -846,6 +874,53 @@ std::string GetIPv4() {
   return ip;
 }
 
+std::vector<int> ParseCpuList(const std::string &str) {
+  std::vector<int> cpus;
+  size_t pos = 0;
+  while (pos <= str.size()) {
+    size_t end = str.find(',', pos);
+    if (end == std::string::npos) {
+      end = str.size();
+    }
+    std::string item = StringUtil::Trim(str.substr(pos, end - pos));
+    pos = end + 1;
+    if (item.empty()) {
+      continue;
+    }
+    if (item.compare(0, 4, "node") == 0) {
+      std::ifstream ifs("/sys/devices/system/node/" + item + "/cpulist");
+      std::string list;
+      if (std::getline(ifs, list) && list.find("node") == std::string::npos) {
+        std::vector<int> node = ParseCpuList(list);
+        cpus.insert(cpus.end(), node.begin(), node.end());
+      }
+      continue;
+    }
+    char *next = nullptr;
+    long first = strtol(item.c_str(), &next, 10);
+    if (next == item.c_str() || first < 0) {
+      continue;
+    }
+    long last = first;
+    if (*next == '-') {
+      const char *begin = next + 1;
+      last = strtol(begin, &next, 10);
+      if (next == begin || last < first) {
+        continue;
+      }
+    }
+    if (*next != '\0') {
+      continue;
+    }
+    for (long i = first; i <= last && i < CPU_SETSIZE; ++i) {
+      cpus.push_back((int)i);
+    }
+  }
+  std::sort(cpus.begin(), cpus.end());
+  cpus.erase(std::unique(cpus.begin(), cpus.end()), cpus.end());
+  return cpus;
+}
+
 bool YamlToJson(const YAML::Node &ynode, Json::Value &jnode) {
   try {
     if (ynode.IsScalar()) {
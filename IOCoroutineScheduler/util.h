@@ -47,6 +47,25 @@ uint64_t GetCurrentMS();
 // 获取当前时间的微秒
 uint64_t GetCurrentUS();
 
+// 单调时钟的毫秒，不受系统时间修改影响，定时器和超时都用它
+uint64_t GetMonotonicMS();
+
+// 单调时钟的微秒
+uint64_t GetMonotonicUS();
+
+// 事件循环缓存的单调时钟(微秒)，IOManager::idle()每轮更新一次。
+// 不在事件循环里的线程每次都读时钟
+uint64_t GetLoopUS();
+
+// 事件循环缓存的单调时钟(毫秒)
+inline uint64_t GetLoopMS() { return GetLoopUS() / 1000; }
+
+// 重新读取时钟，更新当前线程缓存的时间
+void UpdateLoopTime();
+
+// 线程离开事件循环，之后GetLoopUS()每次读时钟
+void ClearLoopTime();
+
 std::string ToUpper(const std::string &name);
 
 std::string ToLower(const std::string &name);
@@ -243,6 +262,13 @@ public:
 std::string GetHostName();
 std::string GetIPv4();
 
+/**
+ * @brief 解析CPU列表，格式和/sys/devices/system/cpu/online一样："0-3,8,10-11"
+ * @details "node1"表示NUMA节点1上的所有CPU(读/sys/devices/system/node/node1/cpulist)。
+ *  非法的项被忽略，返回排序去重后的CPU编号
+ */
+std::vector<int> ParseCpuList(const std::string &str);
+
 bool YamlToJson(const YAML::Node &ynode, Json::Value &jnode);
 bool JsonToYaml(const Json::Value &jnode, YAML::Node &ynode);
 
@@ -0,0 +1,166 @@
+#include "IOCoroutineScheduler/bin.h"
+#include "IOCoroutineScheduler/tcp_server.h"
+#include <sched.h>
+
+bin::Logger::ptr g_logger = BIN_LOG_ROOT();
+
+static std::vector<int> current_cpus(){
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    sched_getaffinity(0, sizeof(set), &set);
+    std::vector<int> cpus;
+    for(int i = 0; i < CPU_SETSIZE; ++i){
+        if(CPU_ISSET(i, &set)){
+            cpus.push_back(i);
+        }
+    }
+    return cpus;
+}
+
+//block1: CPU列表解析
+void test_parse(){
+    BIN_ASSERT((bin::ParseCpuList("0-3,8") == std::vector<int>{0, 1, 2, 3, 8}));
+    BIN_ASSERT((bin::ParseCpuList(" 2, 1 ,1") == std::vector<int>{1, 2}));
+    BIN_ASSERT((bin::ParseCpuList("x,3-1,5,7-") == std::vector<int>{5}));
+    BIN_ASSERT(bin::ParseCpuList("").empty());
+    std::vector<int> node0 = bin::ParseCpuList("node0");
+    BIN_LOG_INFO(g_logger) << "node0 cpus=" << node0.size();
+    BIN_ASSERT(!node0.empty() && node0[0] == 0);
+}
+
+static bool wait_for(std::function<bool()> cond, uint64_t ms){
+    uint64_t end = bin::GetMonotonicMS() + ms;
+    while(!cond()){
+        if(bin::GetMonotonicMS() > end){
+            return false;
+        }
+        usleep(10 * 1000);
+    }
+    return true;
+}
+
+//block2: 创建时绑定的线程，CPU取当前允许的第一个，不假定有CPU 0
+void test_thread(){
+    int first = current_cpus()[0];
+    std::vector<int> cpus;
+    bin::Thread thr([&cpus](){
+        cpus = current_cpus();
+    }, "pinned", std::vector<int>{first});
+    thr.join();
+    BIN_ASSERT((cpus == std::vector<int>{first}));
+}
+
+//block3: 构造时绑定的调度器；已经start()的调度器重新绑定/取消绑定
+void test_scheduler(){
+    size_t online = current_cpus().size();
+    int first = current_cpus()[0];
+    std::atomic<int> pinned{0};
+    {
+        bin::IOManager iom(2, false, "affinity", 0, std::vector<int>{first});
+        BIN_ASSERT((iom.getCpuAffinity() == std::vector<int>{first}));
+        for(int i = 0; i < 100; ++i){
+            iom.schedule([&pinned, first](){
+                if(current_cpus() == std::vector<int>{first} && sched_getcpu() == first){
+                    ++pinned;
+                }
+            });
+        }
+        iom.stop();
+        BIN_ASSERT(pinned == 100);
+    }
+
+    pinned = 0;
+    std::atomic<int> done{0};
+    bin::IOManager iom(2, false, "affinity");
+    iom.setCpuAffinity(std::vector<int>{first});
+    for(int i = 0; i < 100; ++i){
+        iom.schedule([&pinned, &done, first](){
+            if(current_cpus() == std::vector<int>{first} && sched_getcpu() == first){
+                ++pinned;
+            }
+            ++done;
+        });
+    }
+    BIN_ASSERT(wait_for([&done](){ return done == 100; }, 5000));
+    BIN_ASSERT(pinned == 100);
+    iom.setCpuAffinity(std::vector<int>());
+    std::atomic<size_t> count{0};
+    iom.schedule([&count](){
+        count = current_cpus().size();
+    });
+    iom.stop();
+    BIN_ASSERT(count == online);
+}
+
+//block4: TcpServerConf里的CPU配置
+void test_conf(){
+    bin::TcpServerConf conf;
+    conf.address.push_back("0.0.0.0:8020");
+    conf.accept_worker = "accept";
+    conf.io_worker = "io";
+    conf.process_worker = "io";
+    conf.accept_worker_cpus = "0";
+    conf.io_worker_cpus = "node0";
+    std::string str = bin::LexicalCast<bin::TcpServerConf, std::string>()(conf);
+    bin::TcpServerConf conf2 = bin::LexicalCast<std::string, bin::TcpServerConf>()(str);
+    BIN_ASSERT(conf == conf2);
+    BIN_ASSERT(conf2.process_worker_cpus.empty());
+}
+
+//block5: 共用调度器的服务器不互相覆盖绑定，都停止后恢复
+void test_tcp_server(){
+    std::string first = std::to_string(current_cpus()[0]);
+    bin::IOManager iom(1, false, "server");
+    bin::TcpServerConf conf;
+    conf.io_worker_cpus = first;
+    bin::TcpServer::ptr s1(new bin::TcpServer(&iom, &iom, &iom));
+    bin::TcpServer::ptr s2(new bin::TcpServer(&iom, &iom, &iom));
+    bin::TcpServer::ptr s3(new bin::TcpServer(&iom, &iom, &iom));
+    s1->setConf(conf);
+    s2->setConf(conf);
+    conf.io_worker_cpus = first + ",1023";
+    s3->setConf(conf);
+    s1->start();
+    s2->start();
+    s3->start();
+    std::vector<int> expect{current_cpus()[0]};
+    BIN_ASSERT(iom.getCpuAffinity() == expect);
+    s3->stop();
+    s1->stop();
+    BIN_ASSERT(iom.getCpuAffinity() == expect);
+    s2->stop();
+    BIN_ASSERT(iom.getCpuAffinity().empty());
+
+    //没有stop()就析构的服务器也释放绑定
+    conf.io_worker_cpus = first;
+    bin::TcpServer::ptr s5(new bin::TcpServer(&iom, &iom, &iom));
+    s5->setConf(conf);
+    s5->start();
+    BIN_ASSERT(iom.getCpuAffinity() == expect);
+    s5.reset();
+    BIN_ASSERT(iom.getCpuAffinity().empty());
+
+    //构造时绑定的不被覆盖，停止后保持原样
+    conf.io_worker_cpus = first + ",1023";
+    bin::IOManager pinned(1, false, "server", 0, expect);
+    bin::TcpServer::ptr s4(new bin::TcpServer(&pinned, &pinned, &pinned));
+    s4->setConf(conf);
+    s4->start();
+    BIN_ASSERT(pinned.getCpuAffinity() == expect);
+    s4->stop();
+    BIN_ASSERT(pinned.getCpuAffinity() == expect);
+    iom.stop();
+    pinned.stop();
+}
+
+int main(int argc, char** argv){
+    g_logger->setLevel(bin::LogLevel::INFO);
+    BIN_LOG_NAME("system")->setLevel(bin::LogLevel::WARN);
+    test_parse();
+    test_thread();
+    test_scheduler();
+    test_conf();
+    test_tcp_server();
+    BIN_LOG_INFO(g_logger) << "affinity ok";
+    return 0;
+}
@@ -0,0 +1,312 @@
+#include "IOCoroutineScheduler/bin.h"
+#include "IOCoroutineScheduler/address.h"
+#include <fstream>
+
+bin::Logger::ptr g_logger = BIN_LOG_ROOT();
+
+//本地的DNS桩服务器，在不开hook的线程里用阻塞socket应答
+class StubServer {
+public:
+    StubServer(){
+        m_sock = socket(AF_INET, SOCK_DGRAM, 0);
+        sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        BIN_ASSERT(bind(m_sock, (sockaddr*)&addr, sizeof(addr)) == 0);
+        socklen_t len = sizeof(addr);
+        getsockname(m_sock, (sockaddr*)&addr, &len);
+        m_port = ntohs(addr.sin_port);
+        timeval tv{0, 50 * 1000};
+        setsockopt(m_sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        m_thread.reset(new bin::Thread(std::bind(&StubServer::run, this), "dns_stub"));
+    }
+
+    ~StubServer(){
+        m_stop = true;
+        m_thread->join();
+        close(m_sock);
+    }
+
+    uint16_t getPort() const { return m_port; }
+    int getQueries() const { return m_queries; }
+
+private:
+    static void put16(std::string& s, uint16_t v){
+        s.push_back(v >> 8);
+        s.push_back(v & 0xff);
+    }
+
+    static void put32(std::string& s, uint32_t v){
+        put16(s, v >> 16);
+        put16(s, v & 0xffff);
+    }
+
+    static std::string encodeName(const std::string& name){
+        std::string s;
+        std::stringstream ss(name);
+        std::string label;
+        while(std::getline(ss, label, '.')){
+            s.push_back(label.size());
+            s += label;
+        }
+        s.push_back('\0');
+        return s;
+    }
+
+    static void record(std::string& s, const std::string& owner, uint16_t type, uint32_t ttl, const std::string& rdata){
+        s += owner;
+        put16(s, type);
+        put16(s, 1);
+        put32(s, ttl);
+        put16(s, rdata.size());
+        s += rdata;
+    }
+
+    static std::string ipv4(uint32_t ip){
+        std::string s;
+        put32(s, ip);
+        return s;
+    }
+
+    void run(){
+        char buf[512];
+        while(!m_stop){
+            sockaddr_in from;
+            socklen_t len = sizeof(from);
+            int n = recvfrom(m_sock, buf, sizeof(buf), 0, (sockaddr*)&from, &len);
+            if(n < 12){
+                continue;
+            }
+            ++m_queries;
+            //问题段的名字没有压缩
+            std::string name;
+            size_t pos = 12;
+            while(pos < (size_t)n && buf[pos]){
+                if(!name.empty()){
+                    name += ".";
+                }
+                name.append(buf + pos + 1, buf[pos]);
+                pos += buf[pos] + 1;
+            }
+            pos += 5;
+            uint16_t qtype = ((uint8_t)buf[pos - 4] << 8) | (uint8_t)buf[pos - 3];
+
+            std::string answers, authority;
+            uint16_t ancount = 0, nscount = 0;
+            uint8_t rcode = 0;
+            uint16_t flags = 0x8180;
+            const std::string self("\xc0\x0c", 2); //指向问题段的名字
+            if(name == "drop.test"){
+                continue;
+            }else if(name == "slow.test"){
+                usleep(200 * 1000);
+                record(answers, self, 1, 60, ipv4(0x0a000004));
+                ancount = 1;
+            }else if(name == "a.test"){
+                if(qtype == 1){
+                    record(answers, self, 1, 1, ipv4(0x0a000001));
+                    record(answers, self, 1, 1, ipv4(0x0a000002));
+                    ancount = 2;
+                }else{
+                    //NODATA，SOA的MINIMUM是否定缓存的TTL
+                    std::string soa = encodeName("ns.test") + encodeName("admin.test");
+                    for(int i = 0; i < 5; ++i){
+                        put32(soa, 60);
+                    }
+                    record(authority, encodeName("test"), 6, 300, soa);
+                    nscount = 1;
+                }
+            }else if(name == "cname.test" && qtype == 1){
+                record(answers, self, 5, 60, encodeName("a.test"));
+                record(answers, encodeName("a.test"), 1, 30, ipv4(0x0a000003));
+                ancount = 2;
+            }else if(name == "tc.test"){
+                //截断的应答：TC置位，只带了一部分记录
+                record(answers, self, 1, 60, ipv4(0x0a000006));
+                ancount = 1;
+                flags |= 0x0200;
+            }else if(name == "host.corp.example" && qtype == 1){
+                record(answers, self, 1, 60, ipv4(0x0a000005));
+                ancount = 1;
+            }else{
+                rcode = 3;
+            }
+
+            std::string rsp(buf, 2);
+            put16(rsp, flags | rcode);
+            put16(rsp, 1);
+            put16(rsp, ancount);
+            put16(rsp, nscount);
+            put16(rsp, 0);
+            rsp.append(buf + 12, pos - 12);
+            rsp += answers;
+            rsp += authority;
+            sendto(m_sock, rsp.data(), rsp.size(), 0, (sockaddr*)&from, len);
+        }
+    }
+
+private:
+    int m_sock;
+    uint16_t m_port;
+    std::atomic<int> m_queries{0};
+    std::atomic<bool> m_stop{false};
+    bin::Thread::ptr m_thread;
+};
+
+static void write_file(const std::string& path, const std::string& content){
+    std::ofstream ofs(path);
+    ofs << content;
+}
+
+static std::vector<std::string> lookup(const std::string& host, int family = AF_INET){
+    std::vector<bin::Address::ptr> addrs;
+    std::vector<std::string> result;
+    if(bin::Address::Lookup(addrs, host, family)){
+        for(auto& i : addrs){
+            result.push_back(i->toString());
+        }
+    }
+    return result;
+}
+
+//block1: 解析resolv.conf和hosts文件
+void test_parse(){
+    const char* conf_path = "/tmp/test_dns_resolv.conf";
+    write_file(conf_path, "# comment\n"
+                          "nameserver 127.0.0.1\n"
+                          "nameserver ::1 ; comment\n"
+                          "nameserver bad\n"
+                          "search corp.example other.example.\n"
+                          "options ndots:2 timeout:1 attempts:3 rotate\n");
+    bin::ResolvConf conf;
+    BIN_ASSERT(bin::Resolver::LoadResolvConf(conf_path, conf));
+    BIN_ASSERT(conf.nameservers.size() == 2);
+    BIN_ASSERT(conf.nameservers[0]->toString() == "127.0.0.1:53");
+    BIN_ASSERT(conf.nameservers[1]->toString() == "[::1]:53");
+    BIN_ASSERT(conf.search.size() == 2 && conf.search[1] == "other.example");
+    BIN_ASSERT(conf.ndots == 2 && conf.timeout_ms == 1000 && conf.attempts == 3);
+    unlink(conf_path);
+
+    const char* hosts_path = "/tmp/test_dns_hosts";
+    write_file(hosts_path, "10.1.1.1 MyHost alias # comment\n::1 v6host\n");
+    bin::Resolver::HostsMap hosts;
+    BIN_ASSERT(bin::Resolver::LoadHosts(hosts_path, hosts));
+    BIN_ASSERT(hosts.size() == 3 && hosts.count("myhost") && hosts.count("v6host"));
+    BIN_ASSERT(hosts["alias"][0]->toString() == "10.1.1.1:0");
+    unlink(hosts_path);
+}
+
+//block2: 不在调度器里阻塞解析：hosts、缓存、TTL过期、CNAME、否定缓存、搜索域
+void test_thread(StubServer& stub){
+    bin::Resolver* resolver = bin::ResolverMgr::GetInstance();
+    resolver->clearCache();
+    BIN_ASSERT(lookup("myhost:80") == std::vector<std::string>{"10.1.1.1:80"});
+    BIN_ASSERT(lookup("localhost:81") == std::vector<std::string>{"127.0.0.1:81"});
+    BIN_ASSERT(stub.getQueries() == 0);
+
+    std::vector<std::string> expect{"10.0.0.1:8080", "10.0.0.2:8080"};
+    BIN_ASSERT(lookup("a.test:8080") == expect);
+    BIN_ASSERT(stub.getQueries() == 1);
+    uint64_t hits = resolver->getCacheHitCount();
+    BIN_ASSERT(lookup("A.Test:8080") == expect);
+    BIN_ASSERT(stub.getQueries() == 1 && resolver->getCacheHitCount() == hits + 1);
+    //AAAA是NODATA，和glibc一样接着查搜索域a.test.corp.example
+    BIN_ASSERT(lookup("a.test", AF_UNSPEC).size() == 2);
+    BIN_ASSERT(stub.getQueries() == 3);
+    usleep(1100 * 1000);
+    BIN_ASSERT(lookup("a.test:8080") == expect);
+    BIN_ASSERT(stub.getQueries() == 4);
+    BIN_ASSERT(lookup("a.test", AF_INET6).empty());
+    BIN_ASSERT(stub.getQueries() == 4);
+
+    BIN_ASSERT(lookup("cname.test") == std::vector<std::string>{"10.0.0.3:0"});
+    BIN_ASSERT(lookup("host:1") == std::vector<std::string>{"10.0.0.5:1"});
+
+    int queries = stub.getQueries();
+    BIN_ASSERT(lookup("nx.test").empty());
+    BIN_ASSERT(stub.getQueries() > queries);
+    queries = stub.getQueries();
+    BIN_ASSERT(lookup("nx.test").empty());
+    BIN_ASSERT(stub.getQueries() == queries);
+
+    //截断的应答不当作结果，不换服务器重试，也不缓存
+    std::vector<bin::IPAddress::ptr> addrs;
+    queries = stub.getQueries();
+    BIN_ASSERT(resolver->resolve("tc.test.", AF_INET, addrs) == bin::Resolver::UNAVAILABLE);
+    BIN_ASSERT(addrs.empty() && stub.getQueries() == queries + 1);
+    BIN_ASSERT(resolver->resolve("tc.test.", AF_UNSPEC, addrs) == bin::Resolver::UNAVAILABLE);
+    BIN_ASSERT(addrs.empty() && stub.getQueries() == queries + 2);
+}
+
+//block3: 协程里解析只挂起协程；相同名字的并发查询只发一次
+void test_fiber(StubServer& stub){
+    bin::Resolver* resolver = bin::ResolverMgr::GetInstance();
+    resolver->clearCache();
+    int queries = stub.getQueries();
+    uint64_t coalesced = resolver->getCoalescedCount();
+    bin::IOManager iom(1, false, "dns");
+    std::atomic<int> done{0};
+    std::atomic<int> ticks{0};
+    int ticks_during = 0;
+    for(int i = 0; i < 10; ++i){
+        iom.schedule([&](){
+            BIN_ASSERT(lookup("slow.test:53") == std::vector<std::string>{"10.0.0.4:53"});
+            if(++done == 10){
+                ticks_during = ticks;
+            }
+        });
+    }
+    iom.schedule([&](){
+        while(done < 10){
+            usleep(10 * 1000);
+            ++ticks;
+        }
+    });
+    iom.stop();
+    BIN_LOG_INFO(g_logger) << "ticks during query=" << ticks_during
+                           << " coalesced=" << resolver->getCoalescedCount() - coalesced;
+    BIN_ASSERT(done == 10);
+    BIN_ASSERT(stub.getQueries() == queries + 1);
+    BIN_ASSERT(resolver->getCoalescedCount() == coalesced + 9);
+    BIN_ASSERT(ticks_during >= 10);
+}
+
+//block4: 服务器不应答时超时，超时的结果不缓存
+void test_timeout(StubServer& stub){
+    bin::Config::Lookup<uint32_t>("dns.timeout_ms")->setValue(100);
+    bin::Config::Lookup<uint32_t>("dns.attempts")->setValue(1);
+    bin::Resolver* resolver = bin::ResolverMgr::GetInstance();
+    int queries = stub.getQueries();
+    bin::IOManager iom(1, false, "dns");
+    iom.schedule([&](){
+        std::vector<bin::IPAddress::ptr> addrs;
+        uint64_t start = bin::GetMonotonicMS();
+        BIN_ASSERT(resolver->resolve("drop.test.", AF_INET, addrs) == bin::Resolver::TIMEOUT);
+        BIN_ASSERT(bin::GetMonotonicMS() - start < 1000);
+        BIN_ASSERT(lookup("drop.test.").empty());
+    });
+    iom.stop();
+    BIN_ASSERT(stub.getQueries() == queries + 2);
+}
+
+int main(int argc, char** argv){
+    g_logger->setLevel(bin::LogLevel::INFO);
+    BIN_LOG_NAME("system")->setLevel(bin::LogLevel::WARN);
+    test_parse();
+
+    StubServer stub;
+    write_file("/tmp/test_dns_resolv.conf", "nameserver 192.0.2.1\nsearch corp.example\n");
+    write_file("/tmp/test_dns_hosts", "10.1.1.1 myhost\n");
+    bin::Config::Lookup<std::string>("dns.resolv_conf")->setValue("/tmp/test_dns_resolv.conf");
+    bin::Config::Lookup<std::string>("dns.hosts")->setValue("/tmp/test_dns_hosts");
+    bin::Config::Lookup<std::vector<std::string> >("dns.nameservers")->setValue(
+            std::vector<std::string>{"127.0.0.1:" + std::to_string(stub.getPort())});
+    test_thread(stub);
+    test_fiber(stub);
+    test_timeout(stub);
+    unlink("/tmp/test_dns_resolv.conf");
+    unlink("/tmp/test_dns_hosts");
+    BIN_LOG_INFO(g_logger) << "dns ok";
+    return 0;
+}
@@ -0,0 +1,99 @@
+#include "IOCoroutineScheduler/bin.h"
+#include <set>
+
+bin::Logger::ptr g_logger = BIN_LOG_ROOT();
+
+static void busy(uint64_t ms){
+    uint64_t end = bin::GetMonotonicUS() + ms * 1000;
+    while(bin::GetMonotonicUS() < end);
+}
+
+static bool wait_for(std::function<bool()> cond, uint64_t ms){
+    uint64_t end = bin::GetMonotonicMS() + ms;
+    while(!cond()){
+        if(bin::GetMonotonicMS() > end){
+            return false;
+        }
+        usleep(10 * 1000);
+    }
+    return true;
+}
+
+//block1: 排队时间过长增加线程，空闲后退回下限；指定给已退出线程的任务照常执行
+void test_grow_retire(){
+    bin::IOManager iom(1, false, "elastic", 4);
+    BIN_ASSERT(iom.getThreadCount() == 1 && iom.getMaxThreadCount() == 4);
+    std::atomic<int> done{0};
+    std::atomic<size_t> max_threads{0};
+    bin::Mutex mutex;
+    std::set<int> tids;
+    for(int i = 0; i < 20; ++i){
+        iom.schedule([&](){
+            busy(20);
+            size_t n = iom.getThreadCount();
+            if(n > max_threads){
+                max_threads = n;
+            }
+            {
+                bin::Mutex::Lock lock(mutex);
+                tids.insert(bin::GetThreadId());
+            }
+            ++done;
+        });
+    }
+    BIN_ASSERT(wait_for([&](){ return done == 20; }, 5000));
+    BIN_LOG_INFO(g_logger) << "max_threads=" << max_threads
+                           << " grown=" << iom.getGrowCount()
+                           << " latency_us=" << iom.getQueueLatencyUS();
+    BIN_ASSERT(iom.getGrowCount() > 0 && max_threads > 1 && max_threads <= 4);
+    BIN_ASSERT(wait_for([&](){ return iom.getThreadCount() == 1; }, 5000));
+    BIN_ASSERT(iom.getRetireCount() == iom.getGrowCount());
+
+    std::atomic<int> alive{0};
+    iom.schedule([&alive](){ alive = bin::GetThreadId(); });
+    BIN_ASSERT(wait_for([&](){ return alive != 0; }, 1000));
+    int retired = -1;
+    for(int tid : tids){
+        if(tid != alive){
+            retired = tid;
+        }
+    }
+    BIN_ASSERT(retired != -1);
+    std::atomic<bool> ran{false};
+    iom.schedule([&ran](){ ran = true; }, retired);
+    BIN_ASSERT(wait_for([&](){ return ran.load(); }, 1000));
+    iom.stop();
+}
+
+//block2: use_caller的线程不计入伸缩，也不会退出
+void test_use_caller(){
+    bin::IOManager iom(2, true, "caller", 3);
+    BIN_ASSERT(iom.getThreadCount() == 2 && iom.getMaxThreadCount() == 3);
+    std::atomic<int> done{0};
+    for(int i = 0; i < 10; ++i){
+        iom.schedule([&done](){
+            busy(20);
+            ++done;
+        });
+    }
+    BIN_ASSERT(wait_for([&](){ return done == 10; }, 5000));
+    BIN_ASSERT(wait_for([&](){ return iom.getThreadCount() == 2; }, 5000));
+    BIN_LOG_INFO(g_logger) << "caller grown=" << iom.getGrowCount()
+                           << " retired=" << iom.getRetireCount();
+    BIN_ASSERT(iom.getRetireCount() == iom.getGrowCount());
+    iom.schedule([&done](){ ++done; });
+    iom.stop();
+    BIN_ASSERT(done == 11);
+}
+
+int main(int argc, char** argv){
+    g_logger->setLevel(bin::LogLevel::INFO);
+    BIN_LOG_NAME("system")->setLevel(bin::LogLevel::WARN);
+    bin::Config::Lookup<uint32_t>("scheduler.elastic.grow_latency_us")->setValue(1000);
+    bin::Config::Lookup<uint32_t>("scheduler.elastic.grow_interval_ms")->setValue(5);
+    bin::Config::Lookup<uint32_t>("scheduler.elastic.idle_retire_ms")->setValue(200);
+    test_grow_retire();
+    test_use_caller();
+    BIN_LOG_INFO(g_logger) << "elastic ok";
+    return 0;
+}
@@ -0,0 +1,146 @@
+#include "IOCoroutineScheduler/bin.h"
+#include "IOCoroutineScheduler/fiber_context.h"
+#include <stdlib.h>
+#include <ucontext.h>
+
+bin::Logger::ptr g_logger = BIN_LOG_ROOT();
+
+// 每一轮 切入+切出 记两次切换
+static const uint64_t s_rounds = 1000000;
+static const size_t s_stack_size = 128 * 1024;
+
+static void report(const char* name, uint64_t begin_us){
+    uint64_t used = bin::GetCurrentUS() - begin_us;
+    if(used == 0){
+        used = 1;
+    }
+    BIN_LOG_INFO(g_logger) << name << ": switches=" << s_rounds * 2
+        << " used=" << used << "us"
+        << " switches/s=" << (uint64_t)(s_rounds * 2 * 1000000.0 / used)
+        << " ns/switch=" << used * 1000.0 / (s_rounds * 2);
+}
+
+//block1: 裸ucontext，每次swapcontext都有一次rt_sigprocmask
+static ucontext_t s_uc_main;
+static ucontext_t s_uc_co;
+
+static void uc_entry(){
+    while(true){
+        swapcontext(&s_uc_co, &s_uc_main);
+    }
+}
+
+void bench_ucontext(){
+    void* stack = malloc(s_stack_size);
+    getcontext(&s_uc_co);
+    s_uc_co.uc_link = nullptr;
+    s_uc_co.uc_stack.ss_sp = stack;
+    s_uc_co.uc_stack.ss_size = s_stack_size;
+    makecontext(&s_uc_co, &uc_entry, 0);
+
+    uint64_t begin = bin::GetCurrentUS();
+    for(uint64_t i = 0; i < s_rounds; ++i){
+        swapcontext(&s_uc_main, &s_uc_co);
+    }
+    report("ucontext", begin);
+    // uc_entry不会退出，栈直接丢弃
+    free(stack);
+}
+
+//block2: 裸汇编切换，只保存callee-saved寄存器
+#ifdef BIN_FIBER_ASM_SUPPORTED
+static void* s_asm_main = nullptr;
+static void* s_asm_co = nullptr;
+
+static void asm_entry(){
+    while(true){
+        bin_swap_context(&s_asm_co, s_asm_main);
+    }
+}
+
+void bench_asm(){
+    void* stack = malloc(s_stack_size);
+    s_asm_co = bin::MakeAsmContext(stack, s_stack_size, &asm_entry);
+
+    uint64_t begin = bin::GetCurrentUS();
+    for(uint64_t i = 0; i < s_rounds; ++i){
+        bin_swap_context(&s_asm_main, s_asm_co);
+    }
+    report("asm", begin);
+    free(stack);
+}
+#endif
+
+//block3: bin::Fiber call()/back()，使用编译时选择的后端
+static bin::Fiber* s_fiber = nullptr;
+
+static void fiber_entry(){
+    for(uint64_t i = 0; i < s_rounds; ++i){
+        s_fiber->back();
+    }
+}
+
+void bench_fiber(){
+    bin::Fiber::GetThis();
+    bin::Fiber::ptr fiber(new bin::Fiber(&fiber_entry, 0, true));
+    s_fiber = fiber.get();
+
+    uint64_t begin = bin::GetCurrentUS();
+    for(uint64_t i = 0; i < s_rounds; ++i){
+        fiber->call();
+    }
+    std::string name = std::string("Fiber(") + bin::FiberContext::BackendName() + ")";
+    report(name.c_str(), begin);
+    // 让fiber_entry执行完毕，协程状态变为TERM
+    fiber->call();
+}
+
+//block4: 调度器里YieldToReady，每轮切出到调度协程再切回来，包含一次入队出队
+static void yield_entry(){
+    uint64_t begin = bin::GetCurrentUS();
+    for(uint64_t i = 0; i < s_rounds; ++i){
+        bin::Fiber::YieldToReady();
+    }
+    report("YieldToReady", begin);
+}
+
+void bench_yield(){
+    // 调度器每次取任务都会打INFO日志，压测时关掉
+    BIN_LOG_NAME("system")->setLevel(bin::LogLevel::ERROR);
+    bin::Scheduler sc(1, true, "bench");
+    sc.start();
+    sc.schedule(&yield_entry);
+    sc.stop();
+}
+
+//block5: 取当前协程，GetThis()有一次原子CAS和一次原子减，GetThisRaw()没有
+void bench_get_this(){
+    bin::Fiber::GetThis();
+    uint64_t ids = 0;
+    uint64_t begin = bin::GetCurrentUS();
+    for(uint64_t i = 0; i < s_rounds; ++i){
+        ids += bin::Fiber::GetThis()->getId();
+    }
+    uint64_t used = bin::GetCurrentUS() - begin;
+    begin = bin::GetCurrentUS();
+    for(uint64_t i = 0; i < s_rounds; ++i){
+        ids += bin::Fiber::GetThisRaw()->getId();
+    }
+    uint64_t used_raw = bin::GetCurrentUS() - begin;
+    BIN_LOG_INFO(g_logger) << "GetThis: ns/call=" << used * 1000.0 / s_rounds
+        << " GetThisRaw: ns/call=" << used_raw * 1000.0 / s_rounds
+        << " (" << ids << ")";
+}
+
+int main(int argc, char** argv){
+    g_logger->setLevel(bin::LogLevel::INFO);
+    BIN_LOG_NAME("system")->setLevel(bin::LogLevel::INFO);
+    bench_ucontext();
+#ifdef BIN_FIBER_ASM_SUPPORTED
+    bench_asm();
+#endif
+    bench_fiber();
+    bench_get_this();
+    bench_yield();
+    return 0;
+}
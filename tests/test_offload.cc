@@ -0,0 +1,166 @@
+#include "IOCoroutineScheduler/bin.h"
+#include "IOCoroutineScheduler/hook.h"
+#include <fcntl.h>
+#include <sys/uio.h>
+#include <stdexcept>
+
+bin::Logger::ptr g_logger = BIN_LOG_ROOT();
+
+//block1: 返回值、异常、不在调度器里直接执行
+void test_basic(){
+    uint64_t inlined = bin::GetOffloadStats().inlined;
+    BIN_ASSERT(bin::offload([](){ return 42; }) == 42);
+    BIN_ASSERT(bin::GetOffloadStats().inlined == inlined + 1);
+
+    bin::IOManager iom(1, false, "offload");
+    std::atomic<int> done{0};
+    iom.schedule([&done](){
+        pid_t self = bin::GetThreadId();
+        pid_t other = bin::offload([](){ return bin::GetThreadId(); });
+        BIN_ASSERT(other != self);
+        // 回到原来的调度器上恢复
+        BIN_ASSERT(bin::IOManager::GetThis() != nullptr);
+        std::string s = bin::offload([](){ return std::string("offload"); });
+        BIN_ASSERT(s == "offload");
+        bool caught = false;
+        try{
+            bin::offload([](){ throw std::runtime_error("boom"); });
+        }catch(std::runtime_error& e){
+            caught = std::string(e.what()) == "boom";
+        }
+        BIN_ASSERT(caught);
+        ++done;
+    });
+    iom.stop();
+    BIN_ASSERT(done == 1);
+}
+
+//block2: 阻塞调用期间工作线程继续执行其他协程
+void test_not_stalled(){
+    bin::IOManager iom(1, false, "offload");
+    std::atomic<bool> finished{false};
+    std::atomic<int> ticks{0};
+    int ticks_during = 0;
+    iom.schedule([&](){
+        bin::offload([](){ usleep_f(200 * 1000); });
+        ticks_during = ticks;
+        finished = true;
+    });
+    iom.schedule([&](){
+        while(!finished){
+            usleep(10 * 1000);
+            ++ticks;
+        }
+    });
+    iom.stop();
+    BIN_LOG_INFO(g_logger) << "ticks during offload=" << ticks_during;
+    BIN_ASSERT(ticks_during >= 10);
+}
+
+//block3: hook的文件IO里只有会阻塞的卸载，errno带回调用方
+void test_file_io(){
+    const char* path = "/tmp/test_offload.txt";
+    bin::IOManager iom(1, false, "offload");
+    uint64_t offloaded = bin::GetOffloadStats().offloaded;
+    std::atomic<int> done{0};
+    iom.schedule([&](){
+        int fd = open(path, O_CREAT | O_TRUNC | O_RDWR, 0644);
+        BIN_ASSERT(fd >= 0);
+        BIN_ASSERT(write(fd, "hello offload", 13) == 13);
+        BIN_ASSERT(pwrite(fd, "H", 1, 0) == 1);
+        BIN_ASSERT(fsync(fd) == 0);
+        char buf[32] = {0};
+        BIN_ASSERT(pread(fd, buf, sizeof(buf), 0) == 13);
+        BIN_ASSERT(std::string(buf) == "Hello offload");
+        //小块写不卸载
+        BIN_ASSERT(bin::GetOffloadStats().offloaded == offloaded + 2);
+        std::string big(64 * 1024, 'x');
+        BIN_ASSERT(write(fd, big.data(), big.size()) == (ssize_t)big.size());
+        BIN_ASSERT(bin::GetOffloadStats().offloaded == offloaded + 3);
+        //普通文件的read和pread一样卸载
+        BIN_ASSERT(lseek(fd, 0, SEEK_SET) == 0);
+        BIN_ASSERT(read(fd, buf, sizeof(buf)) == sizeof(buf));
+        iovec iov{buf, sizeof(buf)};
+        BIN_ASSERT(readv(fd, &iov, 1) == sizeof(buf));
+        BIN_ASSERT(bin::GetOffloadStats().offloaded == offloaded + 5);
+        close(fd);
+        errno = 0;
+        BIN_ASSERT(read(fd, buf, sizeof(buf)) == -1 && errno == EBADF);
+        ++done;
+    });
+    iom.stop();
+    unlink(path);
+    BIN_ASSERT(done == 1);
+    bin::OffloadStats stats = bin::GetOffloadStats();
+    BIN_LOG_INFO(g_logger) << "offloaded=" << stats.offloaded
+                           << " inlined=" << stats.inlined
+                           << " threads=" << stats.threads;
+    BIN_ASSERT(stats.offloaded == offloaded + 5);
+}
+
+//block4: 持锁写文件不会挂起协程，单线程上等锁的协程不会把线程占死
+void test_write_under_lock(){
+    const char* path = "/tmp/test_offload_lock.txt";
+    int fd = open(path, O_CREAT | O_TRUNC | O_RDWR, 0644);
+    BIN_ASSERT(fd >= 0);
+    bin::IOManager iom(1, false, "offload");
+    bin::Mutex mutex;
+    std::atomic<int> done{0};
+    for(int i = 0; i < 2; ++i){
+        iom.schedule([&](){
+            for(int j = 0; j < 100; ++j){
+                bin::Mutex::Lock lock(mutex);
+                BIN_ASSERT(write(fd, "line\n", 5) == 5);
+            }
+            ++done;
+        });
+    }
+    iom.stop();
+    close(fd);
+    unlink(path);
+    BIN_ASSERT(done == 2);
+}
+
+//block5: fclose这类没经过hook的close留下的FdCtx过期，同号的管道不按普通文件卸载
+void test_stale_ctx(){
+    const char* path = "/tmp/test_offload_stale.txt";
+    bin::IOManager iom(1, false, "offload");
+    uint64_t offloaded = bin::GetOffloadStats().offloaded;
+    std::atomic<int> done{0};
+    iom.schedule([&](){
+        int fd1 = open(path, O_CREAT | O_TRUNC | O_RDWR, 0644);
+        int fd2 = open(path, O_RDWR);
+        BIN_ASSERT(fd1 >= 0 && fd2 >= 0);
+        BIN_ASSERT(write(fd1, "x", 1) == 1);
+        BIN_ASSERT(write(fd2, "x", 1) == 1);
+        close_f(fd1);
+        close_f(fd2);
+        int fds[2];
+        BIN_ASSERT(pipe(fds) == 0);
+        BIN_ASSERT(fds[0] == fd1 && fds[1] == fd2);
+        //管道的缓冲区是64KB，写得进去
+        std::string big(64 * 1024, 'x');
+        BIN_ASSERT(write(fds[1], big.data(), big.size()) == (ssize_t)big.size());
+        char buf[64];
+        BIN_ASSERT(read(fds[0], buf, sizeof(buf)) == sizeof(buf));
+        BIN_ASSERT(bin::GetOffloadStats().offloaded == offloaded);
+        close(fds[0]);
+        close(fds[1]);
+        ++done;
+    });
+    iom.stop();
+    unlink(path);
+    BIN_ASSERT(done == 1);
+}
+
+int main(int argc, char** argv){
+    g_logger->setLevel(bin::LogLevel::INFO);
+    BIN_LOG_NAME("system")->setLevel(bin::LogLevel::WARN);
+    test_basic();
+    test_not_stalled();
+    test_file_io();
+    test_write_under_lock();
+    test_stale_ctx();
+    BIN_LOG_INFO(g_logger) << "offload ok";
+    return 0;
+}
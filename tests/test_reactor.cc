@@ -0,0 +1,228 @@
+#include "IOCoroutineScheduler/bin.h"
+
+#include <arpa/inet.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+bin::Logger::ptr g_logger = BIN_LOG_ROOT();
+
+static const int s_clients = 50;
+static const int s_rounds = 200;
+static std::atomic<int> s_ok{0};
+static std::atomic<int> s_bad{0};
+
+// 服务端：每个连接原样回写，直到对端关闭
+static void echo(int fd){
+    char buf[256];
+    while(true){
+        ssize_t n = recv(fd, buf, sizeof(buf), 0);
+        if(n <= 0){
+            break;
+        }
+        if(send(fd, buf, n, 0) != n){
+            break;
+        }
+    }
+    close(fd);
+}
+
+// worker: 读写连接的IOManager
+static void accept_loop(int listen_fd, bin::IOManager* worker){
+    while(true){
+        sockaddr_in addr;
+        socklen_t len = sizeof(addr);
+        int fd = accept(listen_fd, (sockaddr*)&addr, &len);
+        if(fd < 0){
+            BIN_LOG_INFO(g_logger) << "accept exit errno=" << errno;
+            break;
+        }
+        worker->schedule(std::bind(&echo, fd));
+    }
+}
+
+static void client(const sockaddr_in& addr){
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if(connect(fd, (const sockaddr*)&addr, sizeof(addr))){
+        BIN_LOG_ERROR(g_logger) << "connect errno=" << errno;
+        ++s_bad;
+        close(fd);
+        return;
+    }
+    char out[64];
+    char in[64];
+    for(int i = 0; i < s_rounds; ++i){
+        int len = snprintf(out, sizeof(out), "fd=%d round=%d", fd, i);
+        if(write(fd, out, len) != len){
+            ++s_bad;
+            break;
+        }
+        int got = 0;
+        while(got < len){
+            ssize_t n = read(fd, in + got, len - got);
+            if(n <= 0){
+                break;
+            }
+            got += n;
+        }
+        if(got != len || memcmp(in, out, len)){
+            ++s_bad;
+            break;
+        }
+        ++s_ok;
+    }
+    close(fd);
+}
+
+// 对端不回数据，读超时
+static void client_timeout(const sockaddr_in& addr){
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    connect(fd, (const sockaddr*)&addr, sizeof(addr));
+    timeval tv{0, 100 * 1000};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    char buf[16];
+    uint64_t begin = bin::GetCurrentMS();
+    ssize_t n = read(fd, buf, sizeof(buf));
+    uint64_t used = bin::GetCurrentMS() - begin;
+    if(n != -1 || errno != ETIMEDOUT || used < 90){
+        BIN_LOG_ERROR(g_logger) << "timeout n=" << n << " errno=" << errno
+            << " used=" << used;
+        ++s_bad;
+    }
+    close(fd);
+}
+
+// split: accept在单独的IOManager上，连接在另一个IOManager上读写和关闭，和TcpServer一样
+void run(const std::string& type, bool persistent, bool split = false){
+    bin::Config::Lookup<std::string>("iomanager.reactor")->setValue(type);
+    bin::Config::Lookup<bool>("iomanager.persistent_events")->setValue(persistent);
+    s_ok = 0;
+    s_bad = 0;
+    uint64_t begin = bin::GetCurrentUS();
+    std::string name;
+    {
+        // acceptor在iom之后析构：最后关闭监听socket的是iom上的客户端，iom停止后才能停止acceptor
+        std::unique_ptr<bin::IOManager> acceptor(split ? new bin::IOManager(1, false, "accept") : nullptr);
+        bin::IOManager iom(2, false, "reactor");
+        bin::IOManager* accept_iom = split ? acceptor.get() : &iom;
+        name = iom.getReactorName();
+        iom.schedule([accept_iom](){
+            int listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+            int on = 1;
+            setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+            sockaddr_in addr;
+            memset(&addr, 0, sizeof(addr));
+            addr.sin_family = AF_INET;
+            addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+            bind(listen_fd, (const sockaddr*)&addr, sizeof(addr));
+            socklen_t len = sizeof(addr);
+            getsockname(listen_fd, (sockaddr*)&addr, &len);
+            listen(listen_fd, 128);
+
+            bin::IOManager* iom = bin::IOManager::GetThis();
+            accept_iom->schedule(std::bind(&accept_loop, listen_fd, iom));
+            std::shared_ptr<std::atomic<int>> left(new std::atomic<int>(s_clients + 1));
+            auto done = [left, listen_fd](){
+                // 最后一个客户端结束后关闭监听socket，accept_loop退出
+                if(--*left == 0){
+                    close(listen_fd);
+                }
+            };
+            for(int i = 0; i < s_clients; ++i){
+                iom->schedule([addr, done](){
+                    client(addr);
+                    done();
+                });
+            }
+            iom->schedule([addr, done](){
+                client_timeout(addr);
+                done();
+            });
+        });
+    }
+    uint64_t used = bin::GetCurrentUS() - begin;
+    BIN_LOG_INFO(g_logger) << "reactor=" << name
+        << " persistent=" << persistent << " split=" << split << " round trips=" << s_ok
+        << " bad=" << s_bad << " used=" << used << "us";
+}
+
+// 在iom上执行cb并等它结束
+static void run_on(bin::IOManager& iom, std::function<void()> cb){
+    std::atomic<bool> done{false};
+    iom.schedule([&](){
+        cb();
+        done = true;
+    });
+    while(!done){
+        usleep(1000);
+    }
+}
+
+// 句柄在A上等待过、在B上关闭，同号的新句柄在A上等待仍然能被唤醒
+void run_reuse(){
+    bin::Config::Lookup<std::string>("iomanager.reactor")->setValue("epoll");
+    bin::Config::Lookup<bool>("iomanager.persistent_events")->setValue(true);
+    bin::IOManager a(1, false, "a");
+    bin::IOManager b(1, false, "b");
+    int udp = -1;
+    run_on(a, [&](){
+        udp = socket(AF_INET, SOCK_DGRAM, 0);
+        timeval tv{0, 10 * 1000};
+        setsockopt(udp, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        char c;
+        BIN_ASSERT(recv(udp, &c, 1, 0) == -1 && errno == ETIMEDOUT);
+    });
+    run_on(b, [&](){
+        close(udp);
+    });
+    run_on(a, [&](){
+        int listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+        sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        bind(listen_fd, (const sockaddr*)&addr, sizeof(addr));
+        socklen_t len = sizeof(addr);
+        getsockname(listen_fd, (sockaddr*)&addr, &len);
+        listen(listen_fd, 8);
+        timeval tv{2, 0};
+        setsockopt(listen_fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        // 没开hook的线程里阻塞连接
+        bin::Thread connector([addr](){
+            usleep(100 * 1000);
+            int fd = socket(AF_INET, SOCK_STREAM, 0);
+            connect(fd, (const sockaddr*)&addr, sizeof(addr));
+            close(fd);
+        }, "connector");
+        uint64_t begin = bin::GetCurrentMS();
+        int fd = accept(listen_fd, nullptr, nullptr);
+        uint64_t used = bin::GetCurrentMS() - begin;
+        BIN_LOG_INFO(g_logger) << "reuse fd=" << listen_fd << " old fd=" << udp
+            << " accept=" << fd << " used=" << used << "ms";
+        if(fd < 0 || used > 1000){
+            ++s_bad;
+        }
+        connector.join();
+        close(fd);
+        close(listen_fd);
+    });
+}
+
+int main(int argc, char** argv){
+    g_logger->setLevel(bin::LogLevel::INFO);
+    BIN_LOG_NAME("system")->setLevel(bin::LogLevel::WARN);
+    int bad = 0;
+    // io_uring走提交式IO，不使用常驻注册
+    run("epoll", false);
+    bad += s_bad + (s_ok != s_clients * s_rounds);
+    run("epoll", true);
+    bad += s_bad + (s_ok != s_clients * s_rounds);
+    run("io_uring", true);
+    bad += s_bad + (s_ok != s_clients * s_rounds);
+    run("epoll", true, true);
+    bad += s_bad + (s_ok != s_clients * s_rounds);
+    s_bad = 0;
+    run_reuse();
+    bad += s_bad;
+    return bad ? 1 : 0;
+}
@@ -0,0 +1,207 @@
+#include "IOCoroutineScheduler/bin.h"
+#include <new>
+#include <sched.h>
+#include <stdlib.h>
+
+bin::Logger::ptr g_logger = BIN_LOG_ROOT();
+
+// 统计堆分配次数
+static std::atomic<uint64_t> s_allocs{0};
+
+void* operator new(size_t size){
+    ++s_allocs;
+    void* p = malloc(size ? size : 1);
+    if(!p){
+        throw std::bad_alloc();
+    }
+    return p;
+}
+
+void operator delete(void* p) noexcept{
+    free(p);
+}
+
+void operator delete(void* p, size_t) noexcept{
+    free(p);
+}
+
+static const int s_tasks = 200000;
+static std::atomic<int> s_done{0};
+
+static void task(){
+    ++s_done;
+}
+
+// 工作线程内部派生任务，走本地队列 + 窃取
+static void spawner(int n){
+    for(int i = 0; i < n; ++i){
+        bin::Scheduler::GetThis()->schedule(&task);
+    }
+}
+
+static void report(const char* name, size_t threads, uint64_t begin_us
+                   , bin::IOManager& iom){
+    uint64_t used = bin::GetCurrentUS() - begin_us;
+    if(used == 0){
+        used = 1;
+    }
+    BIN_LOG_INFO(g_logger) << name << ": threads=" << threads
+        << " tasks=" << s_done
+        << " used=" << used << "us"
+        << " tasks/s=" << (uint64_t)(s_done * 1000000.0 / used)
+        << " wakeups/task=" << iom.getIdleWakeupsPerTask();
+}
+
+//block1: 外部线程schedule，走全局注入队列
+void bench_external(size_t threads){
+    s_done = 0;
+    uint64_t begin = bin::GetCurrentUS();
+    bin::IOManager iom(threads, false, "bench");
+    for(int i = 0; i < s_tasks; ++i){
+        iom.schedule(&task);
+    }
+    iom.stop();
+    report("external", threads, begin, iom);
+}
+
+//block2: 每个工作线程派生一批任务
+void bench_internal(size_t threads){
+    s_done = 0;
+    uint64_t begin = bin::GetCurrentUS();
+    bin::IOManager iom(threads, false, "bench");
+    int spawners = 64;
+    for(int i = 0; i < spawners; ++i){
+        iom.schedule(std::bind(&spawner, s_tasks / spawners));
+    }
+    iom.stop();
+    report("internal", threads, begin, iom);
+}
+
+//block3: 不会让出的任务走inline路径，不创建任务协程
+static void inline_spawner(int n){
+    for(int i = 0; i < n; ++i){
+        bin::Scheduler::GetThis()->scheduleInline(&task);
+    }
+}
+
+void bench_inline(size_t threads){
+    s_done = 0;
+    uint64_t begin = bin::GetCurrentUS();
+    bin::IOManager iom(threads, false, "bench");
+    int spawners = 64;
+    for(int i = 0; i < spawners; ++i){
+        iom.schedule(std::bind(&inline_spawner, s_tasks / spawners));
+    }
+    iom.stop();
+    report("inline", threads, begin, iom);
+    BIN_ASSERT(iom.getInlineCount() == (uint64_t)s_done);
+}
+
+//block4: 和TcpServer::handleClient一样绑定成员函数 + 两个shared_ptr的闭包，统计每个任务的分配次数
+struct Conn : public std::enable_shared_from_this<Conn> {
+    void handle(std::shared_ptr<int> client){
+        ++s_done;
+    }
+};
+
+static void closure_spawner(int n){
+    std::shared_ptr<Conn> conn(new Conn);
+    std::shared_ptr<int> client(new int(0));
+    for(int i = 0; i < n; ++i){
+        bin::Scheduler::GetThis()->schedule(std::bind(&Conn::handle, conn, client));
+    }
+}
+
+void bench_closure(size_t threads){
+    // 闭包本身：std::function放不下，Task放得下
+    std::shared_ptr<Conn> conn(new Conn);
+    std::shared_ptr<int> client(new int(0));
+    uint64_t before = s_allocs;
+    std::function<void()> f(std::bind(&Conn::handle, conn, client));
+    uint64_t function_allocs = s_allocs - before;
+    before = s_allocs;
+    bin::Task t(std::bind(&Conn::handle, conn, client));
+    uint64_t task_allocs = s_allocs - before;
+    BIN_ASSERT(t.isInline() && task_allocs == 0);
+
+    s_done = 0;
+    bin::IOManager iom(threads, false, "bench");
+    int spawners = 64;
+    before = s_allocs;
+    uint64_t begin = bin::GetCurrentUS();
+    for(int i = 0; i < spawners; ++i){
+        iom.schedule(std::bind(&closure_spawner, s_tasks / spawners));
+    }
+    iom.stop();
+    report("closure", threads, begin, iom);
+    BIN_LOG_INFO(g_logger) << "closure: std::function allocs=" << function_allocs
+        << " Task allocs=" << task_allocs
+        << " allocs/task=" << (double)(s_allocs - before) / s_done;
+}
+
+//block5: 连接式的回调，每个都挂起一次再结束，统计新建了多少协程
+static void churn(int left){
+    bin::Fiber::YieldToReady();
+    ++s_done;
+    if(left > 1){
+        bin::Scheduler::GetThis()->schedule(std::bind(&churn, left - 1));
+    }
+}
+
+void bench_churn(size_t threads){
+    s_done = 0;
+    bin::IOManager iom(threads, false, "bench");
+    int chains = 64;
+    bin::FiberPoolStats before = bin::Fiber::GetPoolStats();
+    uint64_t begin = bin::GetCurrentUS();
+    for(int i = 0; i < chains; ++i){
+        iom.schedule(std::bind(&churn, s_tasks / 10 / chains));
+    }
+    iom.stop();
+    report("churn", threads, begin, iom);
+    bin::FiberPoolStats after = bin::Fiber::GetPoolStats();
+    BIN_LOG_INFO(g_logger) << "churn: fibers created=" << after.created - before.created
+        << " reused=" << after.reused - before.reused
+        << " destroyed=" << after.destroyed - before.destroyed
+        << " created/s=" << after.created_per_sec
+        << " global_cached=" << after.global_cached;
+    BIN_ASSERT(after.created - before.created < (uint64_t)s_done / 10);
+}
+
+//block6: 外部线程一次只投一个任务并等它做完，工作线程每次都是刚空闲下来就来了任务
+void bench_pingpong(size_t threads){
+    static const int rounds = 20000;
+    std::atomic<int> done{0};
+    bin::IOManager iom(threads, false, "bench");
+    uint64_t begin = bin::GetCurrentUS();
+    for(int i = 0; i < rounds; ++i){
+        iom.schedule([&done](){
+            ++done;
+        });
+        while(done <= i){
+            sched_yield();
+        }
+    }
+    uint64_t used = bin::GetCurrentUS() - begin;
+    BIN_LOG_INFO(g_logger) << "pingpong: threads=" << threads << " rounds=" << rounds
+        << " us/round=" << (double)used / rounds
+        << " spin_hits=" << iom.getSpinHits()
+        << " spin_misses=" << iom.getSpinMisses()
+        << " idle_wakeups=" << iom.getIdleWakeups();
+    iom.stop();
+}
+
+int main(int argc, char** argv){
+    g_logger->setLevel(bin::LogLevel::INFO);
+    BIN_LOG_NAME("system")->setLevel(bin::LogLevel::WARN);
+    size_t max_threads = argc > 1 ? atoi(argv[1]) : 8;
+    for(size_t i = 1; i <= max_threads; i *= 2){
+        bench_external(i);
+        bench_internal(i);
+        bench_inline(i);
+        bench_closure(i);
+        bench_churn(i);
+        bench_pingpong(i);
+    }
+    return 0;
+}
@@ -0,0 +1,49 @@
+#include "IOCoroutineScheduler/bin.h"
+#include <string.h>
+#include <unistd.h>
+
+bin::Logger::ptr g_logger = BIN_LOG_ROOT();
+
+static const int s_fibers = 10000;
+static std::atomic<int> s_done{0};
+static std::atomic<int> s_bad{0};
+
+// 栈上放一块有内容的数组，挂起再切回后检查内容和线程都没变
+void park(int id){
+    char buf[2048];
+    memset(buf, id & 0xff, sizeof(buf));
+    int tid = bin::GetThreadId();
+    usleep(200 * 1000);
+    for(size_t i = 0; i < sizeof(buf); ++i){
+        if(buf[i] != (char)(id & 0xff)){
+            ++s_bad;
+            break;
+        }
+    }
+    if(tid != bin::GetThreadId()){
+        ++s_bad;
+    }
+    ++s_done;
+}
+
+void report(){
+    usleep(100 * 1000);
+    BIN_LOG_INFO(g_logger) << "parked fibers=" << bin::Fiber::TotalFibers()
+        << " saved_bytes=" << bin::Fiber::SharedStackSavedBytes()
+        << " (" << bin::Fiber::SharedStackSavedBytes() / s_fibers << " per fiber)";
+}
+
+int main(int argc, char** argv){
+    g_logger->setLevel(bin::LogLevel::INFO);
+    BIN_LOG_NAME("system")->setLevel(bin::LogLevel::WARN);
+    {
+        bin::IOManager iom(2, false, "shared");
+        iom.setSharedStack(true);
+        for(int i = 0; i < s_fibers; ++i){
+            iom.schedule(std::bind(&park, i));
+        }
+        iom.schedule(bin::Fiber::ptr(new bin::Fiber(&report, 0, false, true)));
+    }
+    BIN_LOG_INFO(g_logger) << "done=" << s_done << " bad=" << s_bad;
+    return s_bad == 0 && s_done == s_fibers ? 0 : 1;
+}
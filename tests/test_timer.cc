@@ -0,0 +1,254 @@
+#include "IOCoroutineScheduler/bin.h"
+#include <stdlib.h>
+
+bin::Logger::ptr g_logger = BIN_LOG_ROOT();
+
+static const int s_timers = 20000;
+static const uint64_t s_maxDelay = 1500; // 跨过时间轮第0层，覆盖降层
+static std::atomic<int> s_fired{0};
+static std::atomic<int> s_early{0};
+static std::atomic<int> s_late{0};
+static std::atomic<int> s_cancelled{0};
+static std::atomic<uint64_t> s_maxLate{0};
+
+// 定时器以事件循环缓存的时间为起点，期望的到期时间也用GetLoopMS()计算。
+// 回调可能被别的线程偷走执行，那个线程缓存的时间可能更早，所以触发时读单调时钟
+static void on_timer(uint64_t expect){
+    ++s_fired;
+    uint64_t now = bin::GetMonotonicMS();
+    if(now < expect){
+        ++s_early;
+        return;
+    }
+    uint64_t late = now - expect;
+    uint64_t old = s_maxLate;
+    while(late > old && !s_maxLate.compare_exchange_weak(old, late));
+    if(late > 50){
+        ++s_late;
+    }
+}
+
+//block1: 大量随机定时器，一半取消
+void test_many(bin::IOManager& iom){
+    std::vector<bin::Timer::ptr> timers;
+    timers.reserve(s_timers);
+    for(int i = 0; i < s_timers; ++i){
+        uint64_t ms = rand() % s_maxDelay;
+        uint64_t expect = bin::GetLoopMS() + ms;
+        timers.push_back(iom.addTimer(ms, std::bind(&on_timer, expect)));
+    }
+    for(int i = 0; i < s_timers; i += 2){
+        if(timers[i]->cancel()){
+            ++s_cancelled;
+        }
+    }
+}
+
+//block2: 工作线程在自己的时间轮上加定时器，一半由其他线程取消
+static const int s_workerTimers = 2000;
+static bin::Mutex s_workerMutex;
+static std::vector<bin::Timer::ptr> s_workerPending;
+
+void test_worker(bin::IOManager& iom){
+    for(int t = 0; t < 4; ++t){
+        iom.schedule([](){
+            bin::IOManager* iom = bin::IOManager::GetThis();
+            for(int i = 0; i < s_workerTimers; ++i){
+                uint64_t ms = rand() % s_maxDelay;
+                uint64_t expect = bin::GetLoopMS() + ms;
+                bin::Timer::ptr timer = iom->addTimer(ms, std::bind(&on_timer, expect));
+                if(i % 2){
+                    bin::Mutex::Lock lock(s_workerMutex);
+                    s_workerPending.push_back(timer);
+                }
+            }
+        });
+    }
+    // 外部线程取消工作线程时间轮上的定时器
+    std::thread([](){
+        usleep(50 * 1000);
+        bin::Mutex::Lock lock(s_workerMutex);
+        for(auto& i : s_workerPending){
+            if(i->cancel()){
+                ++s_cancelled;
+            }
+        }
+    }).join();
+}
+
+//block3: 侵入式定时器节点，到期后重新设置
+struct RearmNode : public bin::TimerNode {
+    int left = 3;
+    bool cancelled = false;
+    uint64_t expect = 0;
+};
+static const int s_nodes = 1000;
+static RearmNode s_rearm[s_nodes];
+static std::atomic<int> s_nodeFired{0};
+
+static void on_node(bin::TimerNode* node){
+    RearmNode* n = static_cast<RearmNode*>(node);
+    if(bin::GetMonotonicMS() < n->expect){
+        ++s_early;
+    }
+    ++s_nodeFired;
+    if(--n->left > 0){
+        // 回调里不能重新设置自己，交给协程去做
+        bin::IOManager::GetThis()->schedule([n](){
+            n->cancel();
+            n->expect = bin::GetLoopMS() + 10;
+            bin::IOManager::GetThis()->addTimer(*n, 10, &on_node);
+        });
+    }
+}
+
+void test_node(bin::IOManager& iom){
+    iom.schedule([](){
+        bin::IOManager* iom = bin::IOManager::GetThis();
+        for(int i = 0; i < s_nodes; ++i){
+            s_rearm[i].expect = bin::GetLoopMS() + i % 100;
+            iom->addTimer(s_rearm[i], i % 100, &on_node);
+        }
+        // 一半取消；0ms的节点可能已经被其他线程触发并重新加入，left记着还剩几次
+        for(int i = 0; i < s_nodes; i += 2){
+            if(s_rearm[i].cancel()){
+                s_rearm[i].cancelled = true;
+            }
+        }
+    });
+}
+
+//block4: 循环定时器触发若干次后取消；刷新和重置
+void test_api(bin::IOManager& iom){
+    static int s_count = 0;
+    static bin::Timer::ptr s_recurring;
+    s_recurring = iom.addTimer(10, [](){
+        if(++s_count == 5){
+            s_recurring->cancel();
+        }
+    }, true);
+
+    static uint64_t s_refreshBegin = bin::GetMonotonicMS();
+    static bin::Timer::ptr s_refreshed = iom.addTimer(100, [](){
+        uint64_t used = bin::GetMonotonicMS() - s_refreshBegin;
+        BIN_LOG_INFO(g_logger) << "refreshed timer used=" << used;
+        BIN_ASSERT(used >= 150);
+    });
+    iom.addTimer(50, [](){
+        BIN_ASSERT(s_refreshed->refresh());
+    });
+
+    bin::Timer::ptr later = iom.addTimer(5000, [](){
+        BIN_LOG_INFO(g_logger) << "reset timer fired";
+    });
+    BIN_ASSERT(later->reset(20, true));
+    BIN_ASSERT(!iom.addTimer(1, nullptr)->refresh());
+
+    iom.addTimer(1000, [](){
+        BIN_LOG_INFO(g_logger) << "recurring count=" << s_count;
+        BIN_ASSERT(s_count == 5);
+    });
+}
+
+//block5: 大量到期时间相近的定时器，带slack时合并成少数几次唤醒
+static const int s_slackTimers = 1000;
+static const uint64_t s_slack = 64;
+static std::atomic<int> s_slackBad{0};
+
+static void on_slack_timer(uint64_t expect, uint64_t slack){
+    uint64_t now = bin::GetLoopMS();
+    if(now < expect || now > expect + slack + 50){
+        ++s_slackBad;
+    }
+}
+
+uint64_t test_slack(uint64_t slack){
+    bin::IOManager iom(2, false, "slack");
+    iom.schedule([slack](){
+        bin::IOManager* iom = bin::IOManager::GetThis();
+        for(int i = 0; i < s_slackTimers; ++i){
+            // 相邻定时器错开1ms，覆盖100ms
+            uint64_t ms = 500 + i % 100;
+            uint64_t expect = bin::GetLoopMS() + ms;
+            iom->addTimer(ms, std::bind(&on_slack_timer, expect, slack), false
+                    , slack);
+        }
+    });
+    iom.stop();
+    BIN_LOG_INFO(g_logger) << "slack=" << slack << " timers=" << s_slackTimers
+        << " fired=" << iom.getTimersFired()
+        << " wakeups=" << iom.getTimerWakeups()
+        << " wakeups/s=" << iom.getTimerWakeupsPerSecond();
+    BIN_ASSERT(iom.getTimersFired() == (uint64_t)s_slackTimers);
+    return iom.getTimerWakeups();
+}
+
+//block6: 微秒定时器；不到1ms的usleep/nanosleep真正挂起，不会立即返回
+static const int s_usTimers = 1000;
+static std::atomic<int> s_usFired{0};
+
+void test_us(){
+    bin::IOManager iom(2, false, "us");
+    for(int i = 0; i < s_usTimers; ++i){
+        uint64_t us = rand() % 5000;
+        uint64_t expect = bin::GetLoopUS() + us;
+        iom.addTimerUS(us, [expect](){
+            ++s_usFired;
+            if(bin::GetLoopUS() < expect){
+                ++s_early;
+            }
+        });
+    }
+    iom.schedule([](){
+        uint64_t begin = bin::GetMonotonicUS();
+        for(int i = 0; i < 100; ++i){
+            usleep(300);
+        }
+        uint64_t used = bin::GetMonotonicUS() - begin;
+        BIN_LOG_INFO(g_logger) << "usleep(300)x100 used=" << used << "us";
+        BIN_ASSERT(used >= 100 * 300);
+
+        timespec req{0, 300 * 1000};
+        begin = bin::GetMonotonicUS();
+        for(int i = 0; i < 100; ++i){
+            nanosleep(&req, nullptr);
+        }
+        used = bin::GetMonotonicUS() - begin;
+        BIN_LOG_INFO(g_logger) << "nanosleep(300us)x100 used=" << used << "us";
+        BIN_ASSERT(used >= 100 * 300);
+    });
+    iom.stop();
+    BIN_ASSERT(s_usFired == s_usTimers);
+}
+
+int main(int argc, char** argv){
+    g_logger->setLevel(bin::LogLevel::INFO);
+    BIN_LOG_NAME("system")->setLevel(bin::LogLevel::WARN);
+    uint64_t begin = bin::GetCurrentMS();
+    {
+        bin::IOManager iom(2, false, "timer");
+        test_many(iom);
+        test_worker(iom);
+        test_node(iom);
+        test_api(iom);
+    }
+    test_us();
+    uint64_t exact_wakeups = test_slack(0);
+    uint64_t slack_wakeups = test_slack(s_slack);
+    BIN_ASSERT(s_slackBad == 0);
+    BIN_ASSERT(slack_wakeups * 4 < exact_wakeups);
+    int total = s_timers + 4 * s_workerTimers;
+    BIN_LOG_INFO(g_logger) << "timers=" << total << " fired=" << s_fired
+        << " cancelled=" << s_cancelled << " early=" << s_early
+        << " late=" << s_late << " max_late=" << s_maxLate << "ms"
+        << " used=" << bin::GetCurrentMS() - begin << "ms";
+    int node_fired = 0;
+    for(auto& i : s_rearm){
+        node_fired += 3 - i.left;
+        BIN_ASSERT(i.cancelled || i.left == 0);
+    }
+    BIN_LOG_INFO(g_logger) << "nodes=" << s_nodes << " fired=" << s_nodeFired;
+    BIN_ASSERT(node_fired == s_nodeFired);
+    return (s_fired + s_cancelled == total && s_early == 0 && s_late == 0)
+        ? 0 : 1;
+}